@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jhash.h"
+#include "addr_table.h"
+
+#define ADDR_SLOT_EMPTY  0
+#define ADDR_SLOT_TOMB  1
+
+/* Old slots moved over with each insertion or removal while resizing. */
+#define ADDR_TABLE_SWEEP_STEP  32
+/* Bytes of a swept array given back with each one after that. */
+#define ADDR_TABLE_UNMAP_STEP  (256 * 1024)
+
+static inline uint32_t addr_key_hash(const struct addr_table *t,
+		const struct addr_key *key)
+{
+	uint32_t h = jhash2((const uint32_t *)key, sizeof(*key) / 4, t->seed);
+
+	/* 0 and 1 mark free slots. */
+	return h > ADDR_SLOT_TOMB ? h : h + 2;
+}
+
+/* Arrays are mapped (zero-filled and faulted in as they get used), not malloc()ed. */
+static int addr_array_alloc(struct addr_array *a, unsigned size)
+{
+	void *p = mmap(NULL, (size_t)size * sizeof(*a->slots), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		return -1;
+	a->slots = p;
+	a->mask = size - 1;
+	a->count = 0;
+	return 0;
+}
+
+static inline size_t addr_array_len(const struct addr_array *a)
+{
+	return ((size_t)a->mask + 1) * sizeof(*a->slots);
+}
+
+static void addr_array_free(struct addr_array *a)
+{
+	if (a->slots)
+		munmap(a->slots, addr_array_len(a));
+	memset(a, 0x0, sizeof(*a));
+}
+
+/**
+ * Unmapping a big array at once takes milliseconds, so one that has
+ * been swept is given back to the system a piece at a time.
+ */
+static void addr_table_unmap_step(struct addr_table *t, size_t len)
+{
+	if (len > t->retired_len)
+		len = t->retired_len;
+	if (len) {
+		munmap(t->retired, len);
+		t->retired += len;
+		t->retired_len -= len;
+	}
+}
+
+static struct addr_slot *addr_array_find(const struct addr_table *t,
+		const struct addr_array *a, const struct addr_key *key, uint32_t hash)
+{
+	unsigned i;
+
+	if (a->slots == NULL)
+		return NULL;
+	for (i = hash & a->mask; a->slots[i].hash != ADDR_SLOT_EMPTY; i = (i + 1) & a->mask) {
+		if (a->slots[i].hash == hash && t->match(t->match_ctx, a->slots[i].value, key))
+			return &a->slots[i];
+	}
+	return NULL;
+}
+
+/* Into the first free slot of its cluster, the key must not be there. */
+static void addr_array_put(struct addr_array *a, const struct addr_slot *s)
+{
+	unsigned i;
+
+	for (i = s->hash & a->mask; a->slots[i].hash != ADDR_SLOT_EMPTY; i = (i + 1) & a->mask)
+		;
+	a->slots[i] = *s;
+	a->count++;
+}
+
+/**
+ * Empty slot 'i' and shift the rest of its cluster back, so that no
+ * tombstones are needed: an entry moves into the hole unless its home
+ * slot lies (cyclically) between the hole and itself.
+ */
+static void addr_array_delete(struct addr_array *a, unsigned i)
+{
+	unsigned j = i, home;
+
+	for (;;) {
+		j = (j + 1) & a->mask;
+		if (a->slots[j].hash == ADDR_SLOT_EMPTY)
+			break;
+		home = a->slots[j].hash & a->mask;
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			a->slots[i] = a->slots[j];
+			i = j;
+		}
+	}
+	a->slots[i].hash = ADDR_SLOT_EMPTY;
+	a->count--;
+}
+
+/* Move up to 'n' slots of the old array over, free it when done. */
+static void addr_table_sweep(struct addr_table *t, unsigned n)
+{
+	struct addr_slot *s;
+
+	if (t->old.slots == NULL) {
+		addr_table_unmap_step(t, ADDR_TABLE_UNMAP_STEP);
+		return;
+	}
+	while (n--) {
+		if (t->old.count == 0 || t->sweep > t->old.mask) {
+			/* The last retired one is surely gone by now, rarely not. */
+			addr_table_unmap_step(t, t->retired_len);
+			t->retired = (char *)t->old.slots;
+			t->retired_len = addr_array_len(&t->old);
+			memset(&t->old, 0x0, sizeof(t->old));
+			break;
+		}
+		s = &t->old.slots[t->sweep++];
+		if (s->hash > ADDR_SLOT_TOMB) {
+			addr_array_put(&t->cur, s);
+			s->hash = ADDR_SLOT_TOMB;
+			t->old.count--;
+		}
+	}
+}
+
+/* Start moving everything over to a new array of 'size' slots. */
+static int addr_table_resize(struct addr_table *t, unsigned size)
+{
+	struct addr_array a;
+
+	/* One resize at a time: the last one is finished first, rarely. */
+	addr_table_sweep(t, ~0U);
+	if (addr_array_alloc(&a, size) < 0)
+		return -1;
+	t->resizes++;
+	t->old = t->cur;
+	t->cur = a;
+	t->sweep = 0;
+	return 0;
+}
+
+/**
+ * 'min_size' must be a power of 2. 'match' tells if the entry of a
+ * value has a key, with 'match_ctx' passed on to it.
+ */
+int addr_table_init(struct addr_table *t, unsigned min_size, uint32_t seed,
+		addr_match_fn match, const void *match_ctx)
+{
+	memset(t, 0x0, sizeof(*t));
+	t->min_size = min_size;
+	t->seed = seed;
+	t->match = match;
+	t->match_ctx = match_ctx;
+	return addr_array_alloc(&t->cur, min_size);
+}
+
+void addr_table_destroy(struct addr_table *t)
+{
+	addr_array_free(&t->cur);
+	addr_array_free(&t->old);
+	addr_table_unmap_step(t, t->retired_len);
+}
+
+/* Value of 'key', 0 if it isn't there. */
+uint32_t addr_table_lookup(const struct addr_table *t, const struct addr_key *key)
+{
+	uint32_t hash = addr_key_hash(t, key);
+	struct addr_slot *s;
+
+	if ((s = addr_array_find(t, &t->cur, key, hash)) ||
+		(s = addr_array_find(t, &t->old, key, hash)))
+		return s->value;
+	return 0;
+}
+
+/* Add 'key', which must not be in the table yet, with a nonzero value. */
+int addr_table_insert(struct addr_table *t, const struct addr_key *key, uint32_t value)
+{
+	unsigned size = t->cur.mask + 1;
+	struct addr_slot s;
+
+	addr_table_sweep(t, ADDR_TABLE_SWEEP_STEP);
+	if (addr_table_count(t) + 1 > size / 4 * 3 &&
+		addr_table_resize(t, size * 2) < 0 && t->cur.count + 1 >= size)
+		return -1;
+
+	s.hash = addr_key_hash(t, key);
+	s.value = value;
+	addr_array_put(&t->cur, &s);
+	return 0;
+}
+
+/* Take 'key' out, returns its value or 0 if it wasn't there. */
+uint32_t addr_table_remove(struct addr_table *t, const struct addr_key *key)
+{
+	uint32_t hash = addr_key_hash(t, key);
+	unsigned size = t->cur.mask + 1;
+	struct addr_slot *s;
+	uint32_t value = 0;
+
+	if ((s = addr_array_find(t, &t->cur, key, hash))) {
+		value = s->value;
+		addr_array_delete(&t->cur, (unsigned)(s - t->cur.slots));
+	} else if ((s = addr_array_find(t, &t->old, key, hash))) {
+		value = s->value;
+		s->hash = ADDR_SLOT_TOMB;
+		t->old.count--;
+	}
+
+	addr_table_sweep(t, ADDR_TABLE_SWEEP_STEP);
+	/* Halving never takes long: there are few entries left to move. */
+	if (value && size > t->min_size && t->old.slots == NULL &&
+		addr_table_count(t) < size / 8)
+		addr_table_resize(t, size / 2);
+	return value;
+}
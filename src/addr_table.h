@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __ADDR_TABLE_H
+#define __ADDR_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+/**
+ * Hash table from IPv4/IPv6 addresses (with a port or not) to the
+ * indexes of the entries that hold them, with open addressing. A slot
+ * is only 8 bytes, the full hash and the index: the key stays in the
+ * entry, and 'match' is asked to compare it when the hashes are equal,
+ * which is nearly only for the one that is looked for. Linear probing,
+ * deletion by shifting the cluster back.
+ *
+ * The table doubles at 3/4 full and halves below 1/8. It is resized
+ * incrementally: the new array takes all insertions while the old one is
+ * swept a few slots at each insertion or removal (moved slots are left
+ * as tombstones), and lookups check both until it is empty. So no single
+ * operation pays for a whole rehash, or for unmapping a whole array.
+ */
+
+struct addr_key {
+	uint16_t af;
+	uint16_t port;     /* network byte order, 0 if there is none */
+	union {
+		struct in_addr in;
+		struct in6_addr in6;
+	};
+};
+
+/* If the entry of index 'value' has the key 'key'. */
+typedef bool (*addr_match_fn)(const void *ctx, uint32_t value,
+		const struct addr_key *key);
+
+struct addr_slot {
+	uint32_t hash;     /* ADDR_SLOT_EMPTY, ADDR_SLOT_TOMB or a hash */
+	uint32_t value;    /* never 0 */
+};
+
+struct addr_array {
+	struct addr_slot *slots;
+	unsigned mask;     /* number of slots - 1 */
+	unsigned count;
+};
+
+struct addr_table {
+	struct addr_array cur;
+	/* Being moved over to 'cur', slots from 'sweep' on. */
+	struct addr_array old;
+	unsigned sweep;
+	/* Swept out, not unmapped yet. */
+	char *retired;
+	size_t retired_len;
+	unsigned min_size;
+	uint32_t seed;
+	addr_match_fn match;
+	const void *match_ctx;
+	unsigned long resizes;
+};
+
+int addr_table_init(struct addr_table *t, unsigned min_size, uint32_t seed,
+		addr_match_fn match, const void *match_ctx);
+void addr_table_destroy(struct addr_table *t);
+uint32_t addr_table_lookup(const struct addr_table *t, const struct addr_key *key);
+int addr_table_insert(struct addr_table *t, const struct addr_key *key, uint32_t value);
+uint32_t addr_table_remove(struct addr_table *t, const struct addr_key *key);
+
+/* Bytes of the slot arrays, those being swept out included. */
+static inline size_t addr_table_memory(const struct addr_table *t)
+{
+	size_t n = t->cur.slots ? t->cur.mask + 1 : 0;
+
+	if (t->old.slots)
+		n += t->old.mask + 1;
+	return n * sizeof(struct addr_slot) + t->retired_len;
+}
+
+static inline unsigned addr_table_count(const struct addr_table *t)
+{
+	return t->cur.count + t->old.count;
+}
+
+/* Key of an IPv4 or IPv6 address; padding and unused bytes zeroed. */
+static inline void addr_key_set(struct addr_key *key, uint16_t af,
+		const void *addr, uint16_t port)
+{
+	key->af = af;
+	key->port = port;
+	if (af == AF_INET6) {
+		key->in6 = *(const struct in6_addr *)addr;
+	} else {
+		memset(&key->in6, 0x0, sizeof(key->in6));
+		key->in = *(const struct in_addr *)addr;
+	}
+}
+
+#endif /* __ADDR_TABLE_H */
@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "af_xdp.h"
+
+#ifdef HAVE_AF_XDP
+
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+  #define AF_XDP  44
+#endif
+#ifndef SOL_XDP
+  #define SOL_XDP  283
+#endif
+
+#define XSK_FRAME_SIZE  2048
+#define XSK_RING_SIZE  2048
+/* The first half of the frames takes turns in the fill and RX rings, the other in TX. */
+#define XSK_FRAMES  (XSK_RING_SIZE * 2)
+#define XSK_QUEUES_MAX  64
+#define XSK_ROUTES  256
+
+#ifndef ETH_HLEN
+  #define ETH_HLEN  14
+#endif
+
+struct xdp_prog {
+	int ifindex;
+	int map_fd, prog_fd, link_fd;
+	/* Family of the UDP socket, peers are given in the same form. */
+	sa_family_t sock_family;
+};
+
+struct xsk_ring {
+	uint32_t *producer, *consumer, *flags;
+	void *descs;
+	uint32_t mask;
+	/* Our own end of the ring, published with the next flush. */
+	uint32_t cached;
+	void *map;
+	size_t map_len;
+};
+
+/**
+ * How to reach a peer through the interface, learnt from its last
+ * datagram that came in through XDP.
+ */
+struct xsk_route {
+	struct sockaddr_inx peer;
+	uint8_t peer_mac[6], local_mac[6];
+	union {
+		struct in_addr in;
+		struct in6_addr in6;
+	} local;
+	uint16_t local_port;
+	bool valid;
+};
+
+struct xsk {
+	int fd;
+	struct xdp_prog *prog;
+	char *umem;
+	struct xsk_ring fill, comp, rx, tx;
+	unsigned rx_taken;
+	uint64_t tx_free[XSK_RING_SIZE];
+	unsigned tx_free_len;
+	unsigned tx_queued;
+	uint16_t ip_id;
+	struct xsk_route routes[XSK_ROUTES];
+};
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define BPF_INSN(c, d, s, o, i) \
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s)  BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)  BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)  BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND64_IMM(d, i)  BPF_INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LDX_MEM(sz, d, s, o)  BPF_INSN(BPF_LDX | BPF_MEM | (sz), d, s, o, 0)
+#define JGT_REG(d, s, o)  BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, d, s, o, 0)
+#define JEQ_IMM(d, i, o)  BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define JNE_IMM(d, i, o)  BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, d, 0, o, i)
+#define JA(o)  BPF_INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define LD_MAP_FD(d, fd) \
+	BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), BPF_INSN(0, 0, 0, 0, 0)
+#define CALL(f)  BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()  BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* Jump targets in the program below, offsets count from the next insn. */
+enum { L_IPV6 = 19, L_REDIRECT = 26, L_PASS = 32 };
+
+/**
+ * Untagged IPv4 (no options, no fragments) or, if 'ipv6', IPv6 (no
+ * extension headers) UDP to 'port' goes to the AF_XDP socket of the
+ * receiving queue; everything else, or if that queue has none, passes
+ * on. An IPv4 socket gets no IPv6, it would have never seen it.
+ */
+static int xdp_prog_load(int map_fd, uint16_t port, bool ipv6)
+{
+	struct bpf_insn insns[] = {
+		/* 0 */ MOV64_REG(BPF_REG_6, BPF_REG_1),
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data)),
+		LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end)),
+		MOV64_REG(BPF_REG_4, BPF_REG_2),
+		ADD64_IMM(BPF_REG_4, ETH_HLEN + 20 + 8),
+		/* 5 */ JGT_REG(BPF_REG_4, BPF_REG_3, L_PASS - 6),
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 12),
+		JEQ_IMM(BPF_REG_5, htons(ETH_P_IPV6), L_IPV6 - 8),
+		JNE_IMM(BPF_REG_5, htons(ETH_P_IP), L_PASS - 9),
+		/* 9: IPv4 */
+		LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN),
+		/* 10 */ JNE_IMM(BPF_REG_5, 0x45, L_PASS - 11),
+		LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 9),
+		JNE_IMM(BPF_REG_5, IPPROTO_UDP, L_PASS - 13),
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6),
+		AND64_IMM(BPF_REG_5, htons(0x3fff)),
+		/* 15 */ JNE_IMM(BPF_REG_5, 0, L_PASS - 16),
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 20 + 2),
+		JEQ_IMM(BPF_REG_5, port, L_REDIRECT - 18),
+		JA(L_PASS - 19),
+		/* 19: IPv6 */
+		MOV64_REG(BPF_REG_4, BPF_REG_2),
+		/* 20 */ ADD64_IMM(BPF_REG_4, ETH_HLEN + 40 + 8),
+		JGT_REG(BPF_REG_4, BPF_REG_3, L_PASS - 22),
+		LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6),
+		JNE_IMM(BPF_REG_5, IPPROTO_UDP, L_PASS - 24),
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 40 + 2),
+		/* 25 (no unreachable insns for the verifier, so it stays in) */
+		ipv6 ? JNE_IMM(BPF_REG_5, port, L_PASS - 26) : JA(L_PASS - 26),
+		/* 26: redirect */
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)),
+		LD_MAP_FD(BPF_REG_1, map_fd),
+		MOV64_IMM(BPF_REG_3, XDP_PASS),
+		/* 30 */ CALL(BPF_FUNC_redirect_map),
+		EXIT(),
+		/* 32: pass */
+		MOV64_IMM(BPF_REG_0, XDP_PASS),
+		EXIT(),
+	};
+	static char log_buf[4096];
+	union bpf_attr attr;
+	int fd;
+
+	memset(&attr, 0x0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uintptr_t)"GPL";
+	attr.log_buf = (uintptr_t)log_buf;
+	attr.log_size = sizeof(log_buf);
+	attr.log_level = 1;
+	if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) < 0 && log_buf[0])
+		fprintf(stderr, "*** XDP program rejected:\n%s", log_buf);
+	return fd;
+}
+
+/**
+ * Load the redirect program for the port of 'loc_addr' and attach it
+ * to 'ifname', in driver mode if it can do XDP, else in generic mode.
+ */
+struct xdp_prog *xdp_prog_attach(const char *ifname, const struct sockaddr_inx *loc_addr)
+{
+	struct xdp_prog *prog;
+	union bpf_attr attr;
+	int saved_errno;
+
+	if ((prog = calloc(1, sizeof(*prog))) == NULL)
+		return NULL;
+	prog->map_fd = prog->prog_fd = prog->link_fd = -1;
+	prog->sock_family = loc_addr->sa.sa_family;
+
+	if ((prog->ifindex = (int)if_nametoindex(ifname)) == 0)
+		goto err;
+
+	memset(&attr, 0x0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = XSK_QUEUES_MAX;
+	if ((prog->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) < 0)
+		goto err;
+
+	if ((prog->prog_fd = xdp_prog_load(prog->map_fd, port_of_sockaddr(loc_addr),
+			prog->sock_family == AF_INET6)) < 0)
+		goto err;
+
+	memset(&attr, 0x0, sizeof(attr));
+	attr.link_create.prog_fd = prog->prog_fd;
+	attr.link_create.target_ifindex = prog->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+	if ((prog->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+		attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+		if ((prog->link_fd = sys_bpf(BPF_LINK_CREATE, &attr)) < 0)
+			goto err;
+	}
+
+	return prog;
+
+err:
+	saved_errno = errno;
+	xdp_prog_detach(prog);
+	errno = saved_errno;
+	return NULL;
+}
+
+void xdp_prog_detach(struct xdp_prog *prog)
+{
+	if (prog->link_fd >= 0)
+		close(prog->link_fd);
+	if (prog->prog_fd >= 0)
+		close(prog->prog_fd);
+	if (prog->map_fd >= 0)
+		close(prog->map_fd);
+	free(prog);
+}
+
+static int xsk_ring_map(struct xsk *xsk, struct xsk_ring *ring,
+		const struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+	char *map;
+
+	ring->map_len = off->desc + XSK_RING_SIZE * desc_size;
+	map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+	if (map == MAP_FAILED)
+		return -1;
+	ring->map = map;
+	ring->producer = (uint32_t *)(map + off->producer);
+	ring->consumer = (uint32_t *)(map + off->consumer);
+	ring->flags = (uint32_t *)(map + off->flags);
+	ring->descs = map + off->desc;
+	ring->mask = XSK_RING_SIZE - 1;
+	return 0;
+}
+
+/**
+ * Open an AF_XDP socket on 'queue' of the interface, with a UMEM of
+ * its own, and put it in the program's map for that queue.
+ */
+struct xsk *xsk_open(struct xdp_prog *prog, unsigned queue)
+{
+	struct xdp_umem_reg mr;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen = sizeof(off);
+	int ring_size = XSK_RING_SIZE, saved_errno;
+	uint32_t key = queue, value;
+	union bpf_attr attr;
+	struct xsk *xsk;
+	uint64_t *addrs;
+	unsigned i;
+
+	if (queue >= XSK_QUEUES_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((xsk = calloc(1, sizeof(*xsk))) == NULL)
+		return NULL;
+	xsk->prog = prog;
+	if ((xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) < 0)
+		goto err;
+
+	/* Shared, so that it stays the same pages across do_daemonize(). */
+	xsk->umem = mmap(NULL, (size_t)XSK_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		xsk->umem = NULL;
+		goto err;
+	}
+
+	memset(&mr, 0x0, sizeof(mr));
+	mr.addr = (uintptr_t)xsk->umem;
+	mr.len = (uint64_t)XSK_FRAMES * XSK_FRAME_SIZE;
+	mr.chunk_size = XSK_FRAME_SIZE;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0 ||
+		setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0 ||
+		setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0 ||
+		setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0 ||
+		setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0 ||
+		getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+		goto err;
+
+	if (xsk_ring_map(xsk, &xsk->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+		xsk_ring_map(xsk, &xsk->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+		xsk_ring_map(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+		xsk_ring_map(xsk, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+		goto err;
+
+	/* All of the RX frames go to the fill ring first. */
+	addrs = xsk->fill.descs;
+	for (i = 0; i < XSK_RING_SIZE; i++)
+		addrs[i] = (uint64_t)i * XSK_FRAME_SIZE;
+	xsk->fill.cached = XSK_RING_SIZE;
+	__atomic_store_n(xsk->fill.producer, xsk->fill.cached, __ATOMIC_RELEASE);
+	for (i = 0; i < XSK_RING_SIZE; i++)
+		xsk->tx_free[i] = (uint64_t)(XSK_RING_SIZE + i) * XSK_FRAME_SIZE;
+	xsk->tx_free_len = XSK_RING_SIZE;
+	xsk->rx.cached = *xsk->rx.consumer;
+	xsk->tx.cached = *xsk->tx.producer;
+	xsk->comp.cached = *xsk->comp.consumer;
+
+	memset(&sxdp, 0x0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = prog->ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+		goto err;
+
+	value = (uint32_t)xsk->fd;
+	memset(&attr, 0x0, sizeof(attr));
+	attr.map_fd = prog->map_fd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&value;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+		goto err;
+
+	return xsk;
+
+err:
+	saved_errno = errno;
+	xsk_close(xsk);
+	errno = saved_errno;
+	return NULL;
+}
+
+void xsk_close(struct xsk *xsk)
+{
+	struct xsk_ring *rings[] = { &xsk->fill, &xsk->comp, &xsk->rx, &xsk->tx };
+	unsigned i;
+
+	for (i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+		if (rings[i]->map)
+			munmap(rings[i]->map, rings[i]->map_len);
+	}
+	if (xsk->fd >= 0)
+		close(xsk->fd);
+	if (xsk->umem)
+		munmap(xsk->umem, (size_t)XSK_FRAMES * XSK_FRAME_SIZE);
+	free(xsk);
+}
+
+int xsk_fd(const struct xsk *xsk)
+{
+	return xsk->fd;
+}
+
+static struct xsk_route *xsk_route_of(struct xsk *xsk, const struct sockaddr_inx *peer)
+{
+	uint32_t h;
+
+	if (peer->sa.sa_family == AF_INET6)
+		memcpy(&h, &peer->in6.sin6_addr.s6_addr[12], 4);
+	else
+		h = peer->in.sin_addr.s_addr;
+	h = (h ^ port_of_sockaddr(peer)) * 2654435761U;
+	return &xsk->routes[h >> 24];
+}
+
+/* Take the UDP payload and peer out of a frame. */
+static bool xsk_parse(struct xsk *xsk, char *pkt, size_t len, struct xsk_rx *rx)
+{
+	struct sockaddr_inx *peer = &rx->peer;
+	char *ip, *udp;
+	uint16_t proto, ip_len, udp_len;
+	size_t avail;
+
+	if (len < ETH_HLEN + 20 + 8)
+		return false;
+	memcpy(&proto, pkt + 12, 2);
+	ip = pkt + ETH_HLEN;
+	avail = len - ETH_HLEN;
+	memset(peer, 0x0, sizeof(*peer));
+
+	if (proto == htons(ETH_P_IP)) {
+		memcpy(&ip_len, ip + 2, 2);
+		ip_len = ntohs(ip_len);
+		if (ip[0] != 0x45 || ip_len < 20 + 8 || ip_len > avail)
+			return false;
+		udp = ip + 20;
+		avail = ip_len - 20;
+		if (xsk->prog->sock_family == AF_INET6) {
+			peer->in6.sin6_family = AF_INET6;
+			peer->in6.sin6_addr.s6_addr[10] = 0xff;
+			peer->in6.sin6_addr.s6_addr[11] = 0xff;
+			memcpy(&peer->in6.sin6_addr.s6_addr[12], ip + 12, 4);
+			memcpy(&peer->in6.sin6_port, udp, 2);
+		} else {
+			peer->in.sin_family = AF_INET;
+			memcpy(&peer->in.sin_addr, ip + 12, 4);
+			memcpy(&peer->in.sin_port, udp, 2);
+		}
+	} else if (proto == htons(ETH_P_IPV6)) {
+		if (avail < 40 + 8 || xsk->prog->sock_family != AF_INET6)
+			return false;
+		memcpy(&ip_len, ip + 4, 2);
+		ip_len = ntohs(ip_len);
+		if (ip_len < 8 || ip_len > avail - 40)
+			return false;
+		udp = ip + 40;
+		avail = ip_len;
+		peer->in6.sin6_family = AF_INET6;
+		memcpy(&peer->in6.sin6_addr, ip + 8, 16);
+		memcpy(&peer->in6.sin6_port, udp, 2);
+	} else {
+		return false;
+	}
+
+	memcpy(&udp_len, udp + 4, 2);
+	udp_len = ntohs(udp_len);
+	if (udp_len < 8 || udp_len > avail)
+		return false;
+	rx->frame = pkt;
+	rx->data = udp + 8;
+	rx->len = udp_len - 8;
+	return true;
+}
+
+/**
+ * Learn the way back to the peer of 'rx', once its datagram has been
+ * taken as authentic: a forged one must not redirect the replies.
+ */
+void xsk_learn(struct xsk *xsk, const struct xsk_rx *rx)
+{
+	struct xsk_route *rt = xsk_route_of(xsk, &rx->peer);
+	const char *pkt = rx->frame, *ip = pkt + ETH_HLEN;
+	const char *udp = (char *)rx->data - 8;
+
+	if (rt->valid && is_sockaddr_equal(&rt->peer, &rx->peer) &&
+		memcmp(rt->peer_mac, pkt + 6, 6) == 0)
+		return;
+	rt->peer = rx->peer;
+	memcpy(rt->peer_mac, pkt + 6, 6);
+	memcpy(rt->local_mac, pkt, 6);
+	if (udp - ip == 20)
+		memcpy(&rt->local.in, ip + 16, 4);
+	else
+		memcpy(&rt->local.in6, ip + 24, 16);
+	memcpy(&rt->local_port, udp + 2, 2);
+	rt->valid = true;
+}
+
+/**
+ * Up to 'n' frames from the RX ring, a datagram each, or with a NULL
+ * 'data' if it is none of ours; the frames are held until
+ * xsk_recv_done(), which must come before the next call.
+ */
+unsigned xsk_recv(struct xsk *xsk, struct xsk_rx *rx, unsigned n)
+{
+	uint32_t avail = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - xsk->rx.cached;
+	struct xdp_desc *descs = xsk->rx.descs, *d;
+	unsigned i;
+
+	if (avail > n)
+		avail = n;
+	for (i = 0; i < avail; i++) {
+		d = &descs[(xsk->rx.cached + i) & xsk->rx.mask];
+		if (d->len > XSK_FRAME_SIZE ||
+			!xsk_parse(xsk, xsk->umem + d->addr, d->len, &rx[i]))
+			rx[i].data = NULL;
+	}
+	xsk->rx_taken = avail;
+	return avail;
+}
+
+/* Give the frames of the last xsk_recv() back to the fill ring. */
+void xsk_recv_done(struct xsk *xsk)
+{
+	struct xdp_desc *descs = xsk->rx.descs;
+	uint64_t *addrs = xsk->fill.descs;
+	unsigned i;
+
+	if (xsk->rx_taken == 0)
+		return;
+	for (i = 0; i < xsk->rx_taken; i++) {
+		addrs[(xsk->fill.cached + i) & xsk->fill.mask] =
+			descs[(xsk->rx.cached + i) & xsk->rx.mask].addr & ~(uint64_t)(XSK_FRAME_SIZE - 1);
+	}
+	xsk->fill.cached += xsk->rx_taken;
+	xsk->rx.cached += xsk->rx_taken;
+	xsk->rx_taken = 0;
+	__atomic_store_n(xsk->fill.producer, xsk->fill.cached, __ATOMIC_RELEASE);
+	__atomic_store_n(xsk->rx.consumer, xsk->rx.cached, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(xsk->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)
+		recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/* Frames the kernel is done sending go back to the free list. */
+static void xsk_reclaim(struct xsk *xsk)
+{
+	uint32_t done = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE) - xsk->comp.cached;
+	uint64_t *addrs = xsk->comp.descs;
+
+	for (; done > 0; done--, xsk->comp.cached++)
+		xsk->tx_free[xsk->tx_free_len++] = addrs[xsk->comp.cached & xsk->comp.mask];
+	__atomic_store_n(xsk->comp.consumer, xsk->comp.cached, __ATOMIC_RELEASE);
+}
+
+static size_t xsk_build_ipv4(const struct xsk_route *rt, char *ip,
+		const struct in_addr *dst, uint16_t id, size_t udp_len)
+{
+	uint16_t v16;
+
+	ip[0] = 0x45;
+	ip[1] = 0;
+	v16 = htons((uint16_t)(20 + udp_len));
+	memcpy(ip + 2, &v16, 2);
+	v16 = htons(id);
+	memcpy(ip + 4, &v16, 2);
+	v16 = htons(0x4000);
+	memcpy(ip + 6, &v16, 2);
+	ip[8] = 64;
+	ip[9] = IPPROTO_UDP;
+	memset(ip + 10, 0x0, 2);
+	memcpy(ip + 12, &rt->local.in, 4);
+	memcpy(ip + 16, dst, 4);
+	v16 = ip_csum_fold(ip_csum_partial(ip, 20, 0));
+	memcpy(ip + 10, &v16, 2);
+	return 20;
+}
+
+static size_t xsk_build_ipv6(const struct xsk_route *rt, char *ip,
+		const struct in6_addr *dst, size_t udp_len)
+{
+	uint16_t v16;
+
+	memset(ip, 0x0, 4);
+	ip[0] = 0x60;
+	v16 = htons((uint16_t)udp_len);
+	memcpy(ip + 4, &v16, 2);
+	ip[6] = IPPROTO_UDP;
+	ip[7] = 64;
+	memcpy(ip + 8, &rt->local.in6, 16);
+	memcpy(ip + 24, dst, 16);
+	return 40;
+}
+
+/**
+ * Queue a datagram to 'peer' in the TX ring, out with the next
+ * xsk_flush(). -1 if the peer has not been seen through XDP or no
+ * frame is free, it has to go through the UDP socket then.
+ */
+int xsk_send(struct xsk *xsk, const void *data, size_t len,
+		const struct sockaddr_inx *peer)
+{
+	struct xsk_route *rt = xsk_route_of(xsk, peer);
+	const struct in6_addr *dst6 = NULL;
+	const struct in_addr *dst4 = NULL;
+	struct xdp_desc *d;
+	char *pkt, *udp;
+	size_t ip_hlen, udp_len = 8 + len;
+	uint16_t v16;
+	uint64_t addr;
+
+	if (!rt->valid || !is_sockaddr_equal(&rt->peer, peer))
+		return -1;
+	if (peer->sa.sa_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(&peer->in6.sin6_addr))
+		dst6 = &peer->in6.sin6_addr;
+	else if (peer->sa.sa_family == AF_INET6)
+		dst4 = (const struct in_addr *)&peer->in6.sin6_addr.s6_addr[12];
+	else
+		dst4 = &peer->in.sin_addr;
+	if (ETH_HLEN + 40 + udp_len > XSK_FRAME_SIZE)
+		return -1;
+
+	if (xsk->tx_free_len == 0)
+		xsk_reclaim(xsk);
+	if (xsk->tx_free_len == 0)
+		return -1;
+	addr = xsk->tx_free[--xsk->tx_free_len];
+	pkt = xsk->umem + addr;
+
+	memcpy(pkt, rt->peer_mac, 6);
+	memcpy(pkt + 6, rt->local_mac, 6);
+	v16 = htons(dst4 ? ETH_P_IP : ETH_P_IPV6);
+	memcpy(pkt + 12, &v16, 2);
+	if (dst4)
+		ip_hlen = xsk_build_ipv4(rt, pkt + ETH_HLEN, dst4, xsk->ip_id++, udp_len);
+	else
+		ip_hlen = xsk_build_ipv6(rt, pkt + ETH_HLEN, dst6, udp_len);
+
+	udp = pkt + ETH_HLEN + ip_hlen;
+	memcpy(udp, &rt->local_port, 2);
+	v16 = port_of_sockaddr(peer);
+	memcpy(udp + 2, &v16, 2);
+	v16 = htons((uint16_t)udp_len);
+	memcpy(udp + 4, &v16, 2);
+	memset(udp + 6, 0x0, 2);
+	memcpy(udp + 8, data, len);
+	if (dst6) {
+		/* Not optional over IPv6. */
+		v16 = ip_csum_fold(ip_csum_partial(udp, udp_len,
+				ip_csum_partial(pkt + ETH_HLEN + 8, 32,
+				htons(IPPROTO_UDP) + htons((uint16_t)udp_len))));
+		if (v16 == 0)
+			v16 = 0xffff;
+		memcpy(udp + 6, &v16, 2);
+	}
+
+	d = &((struct xdp_desc *)xsk->tx.descs)[xsk->tx.cached++ & xsk->tx.mask];
+	d->addr = addr;
+	d->len = (uint32_t)(ETH_HLEN + ip_hlen + udp_len);
+	d->options = 0;
+	xsk->tx_queued++;
+	return 0;
+}
+
+/* Hand the queued datagrams to the kernel. True if there were any. */
+bool xsk_flush(struct xsk *xsk)
+{
+	if (xsk->tx_queued == 0)
+		return false;
+	__atomic_store_n(xsk->tx.producer, xsk->tx.cached, __ATOMIC_RELEASE);
+	xsk->tx_queued = 0;
+	sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	xsk_reclaim(xsk);
+	return true;
+}
+
+#else /* !HAVE_AF_XDP */
+
+struct xdp_prog *xdp_prog_attach(const char *ifname, const struct sockaddr_inx *loc_addr)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void xdp_prog_detach(struct xdp_prog *prog)
+{
+}
+
+struct xsk *xsk_open(struct xdp_prog *prog, unsigned queue)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void xsk_close(struct xsk *xsk)
+{
+}
+
+int xsk_fd(const struct xsk *xsk)
+{
+	return -1;
+}
+
+unsigned xsk_recv(struct xsk *xsk, struct xsk_rx *rx, unsigned n)
+{
+	return 0;
+}
+
+void xsk_learn(struct xsk *xsk, const struct xsk_rx *rx)
+{
+}
+
+void xsk_recv_done(struct xsk *xsk)
+{
+}
+
+int xsk_send(struct xsk *xsk, const void *data, size_t len,
+		const struct sockaddr_inx *peer)
+{
+	return -1;
+}
+
+bool xsk_flush(struct xsk *xsk)
+{
+	return false;
+}
+
+#endif /* HAVE_AF_XDP */
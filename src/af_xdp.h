@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __AF_XDP_H
+#define __AF_XDP_H
+
+#include "library.h"
+
+/**
+ * AF_XDP transport for the server ('--xdp <ifname>', Linux): an XDP
+ * program on the interface redirects UDP packets for the listen port
+ * into an AF_XDP socket per queue; the Ethernet/IP/UDP headers are
+ * parsed and built here. Anything the program lets pass (other queues,
+ * IP options or fragments, ...) still reaches the UDP socket, and
+ * replies to peers not seen through XDP yet go out through it too.
+ *
+ * No libbpf: the program is a few raw BPF instructions, loaded and
+ * attached (as a BPF link, detached when the process exits) with the
+ * bpf() system call.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+    #define HAVE_AF_XDP  1
+  #endif
+#endif
+
+struct xdp_prog;
+struct xsk;
+
+/* One received datagram, valid until xsk_recv_done(). */
+struct xsk_rx {
+	void *frame;
+	void *data;
+	size_t len;
+	struct sockaddr_inx peer;
+};
+
+struct xdp_prog *xdp_prog_attach(const char *ifname, const struct sockaddr_inx *loc_addr);
+void xdp_prog_detach(struct xdp_prog *prog);
+struct xsk *xsk_open(struct xdp_prog *prog, unsigned queue);
+void xsk_close(struct xsk *xsk);
+int xsk_fd(const struct xsk *xsk);
+unsigned xsk_recv(struct xsk *xsk, struct xsk_rx *rx, unsigned n);
+void xsk_learn(struct xsk *xsk, const struct xsk_rx *rx);
+void xsk_recv_done(struct xsk *xsk);
+int xsk_send(struct xsk *xsk, const void *data, size_t len,
+		const struct sockaddr_inx *peer);
+bool xsk_flush(struct xsk *xsk);
+
+#endif /* __AF_XDP_H */
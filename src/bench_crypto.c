@@ -0,0 +1,261 @@
+/*
+ * Crypto microbenchmark for minivtun.
+ *
+ * Measures datagram_encrypt()/datagram_decrypt() and their batch forms,
+ * padding included, for every cipher in cipher_pairs[] and a set of
+ * packet sizes. Results are printed as JSON on stdout. Ciphers that the
+ * crypto library does not run as minivtun sets it up (des, desx and rc4
+ * with OpenSSL 3) are listed as not available, as the daemon rejects
+ * them too.
+ *
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <openssl/opensslv.h>
+#include <openssl/crypto.h>
+
+#include "library.h"
+
+#define BENCH_MAX_BATCH  256
+#define BENCH_MAX_SIZES  16
+#define BENCH_MAX_PKT  (1024 * 8)
+/* Room for padding and AEAD nonce/tag around the largest packet. */
+#define BENCH_BUFFER_SIZE  (BENCH_MAX_PKT + 64)
+
+enum bench_op {
+	BENCH_ENCRYPT,
+	BENCH_DECRYPT,
+	BENCH_REJECT,
+};
+
+static const char *op_names[] = { "encrypt", "decrypt", "reject", };
+
+static unsigned batch_size = 32;
+static unsigned min_time_ms = 200;
+static bool first_result = true;
+
+static unsigned char *plain_bufs[BENCH_MAX_BATCH];
+static unsigned char *cipher_bufs[BENCH_MAX_BATCH];
+static unsigned char *out_bufs[BENCH_MAX_BATCH];
+static size_t cipher_lens[BENCH_MAX_BATCH];
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void fill_random(unsigned char *p, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		p[i] = (unsigned char)rand();
+}
+
+/* Run 'n' datagrams through one operation, once. */
+static void run_once(struct crypto_context *enc, struct crypto_context *dec,
+		enum bench_op op, bool batch, size_t size, unsigned n)
+{
+	struct crypto_datagram dg[BENCH_MAX_BATCH];
+	unsigned i;
+	size_t len;
+
+	switch (op) {
+	case BENCH_ENCRYPT:
+		if (batch) {
+			for (i = 0; i < n; i++) {
+				dg[i].in = plain_bufs[i];
+				dg[i].out = out_bufs[i];
+				dg[i].len = size;
+			}
+			datagram_encrypt_batch(enc, dg, n);
+		} else {
+			for (i = 0; i < n; i++) {
+				len = size;
+				datagram_encrypt(enc, plain_bufs[i], out_bufs[i], &len);
+			}
+		}
+		break;
+	case BENCH_DECRYPT:
+		if (batch) {
+			for (i = 0; i < n; i++) {
+				dg[i].in = cipher_bufs[i];
+				dg[i].out = out_bufs[i];
+				dg[i].len = cipher_lens[i];
+			}
+			datagram_decrypt_batch(dec, dg, n);
+		} else {
+			for (i = 0; i < n; i++) {
+				len = cipher_lens[i];
+				datagram_decrypt(dec, cipher_bufs[i], out_bufs[i], &len);
+			}
+		}
+		break;
+	case BENCH_REJECT:
+		/* Garbage datagrams: only as much work as it takes to drop them. */
+		for (i = 0; i < n; i++) {
+			len = size;
+			if (dec->aead)
+				datagram_decrypt(dec, plain_bufs[i], out_bufs[i], &len);
+			else
+				datagram_decrypt_head(dec, plain_bufs[i], out_bufs[i], &len, 20);
+		}
+		break;
+	}
+}
+
+static void print_result(const char *cipher, enum bench_op op, bool batch,
+		size_t size, double ns_per_packet, unsigned long packets)
+{
+	printf("%s\n    { \"cipher\": \"%s\", \"op\": \"%s\", \"mode\": \"%s\", "
+		   "\"batch\": %u, \"size\": %zu, \"packets\": %lu, "
+		   "\"ns_per_packet\": %.1f, \"gbps\": %.3f }",
+		   first_result ? "" : ",", cipher, op_names[op],
+		   batch ? "batch" : "single", batch ? batch_size : 1, size, packets,
+		   ns_per_packet, (double)size * 8 / ns_per_packet);
+	first_result = false;
+}
+
+static void bench_one(const char *cipher, struct crypto_context *enc,
+		struct crypto_context *dec, enum bench_op op, bool batch, size_t size)
+{
+	unsigned long packets = 0;
+	double t0, t1, limit = (double)min_time_ms * 1e6;
+
+	/* Warm up caches and the CPU clock. */
+	run_once(enc, dec, op, batch, size, batch_size);
+
+	t0 = now_ns();
+	do {
+		run_once(enc, dec, op, batch, size, batch_size);
+		packets += batch_size;
+		t1 = now_ns();
+	} while (t1 - t0 < limit);
+
+	print_result(cipher, op, batch, size, (t1 - t0) / (double)packets, packets);
+}
+
+static void bench_cipher(const char *name, const void *key,
+		const size_t *sizes, unsigned nr_sizes)
+{
+	const void *cptype = get_crypto_type(name);
+	struct crypto_context enc, dec;
+	unsigned i, s;
+
+	memset(&enc, 0x0, sizeof(enc));
+	memset(&dec, 0x0, sizeof(dec));
+	if (cptype == NULL || crypto_context_init(&enc, key, cptype, true) < 0 ||
+		crypto_context_init(&dec, key, cptype, false) < 0) {
+		printf("%s\n    { \"cipher\": \"%s\", \"available\": false }",
+			   first_result ? "" : ",", name);
+		first_result = false;
+		crypto_context_cleanup(&enc);
+		return;
+	}
+
+	for (s = 0; s < nr_sizes; s++) {
+		size_t size = sizes[s];
+
+		/* Valid ciphertexts for the decryption runs. */
+		for (i = 0; i < batch_size; i++) {
+			size_t len = size;
+			fill_random(plain_bufs[i], size);
+			datagram_encrypt(&enc, plain_bufs[i], cipher_bufs[i], &len);
+			cipher_lens[i] = len;
+		}
+
+		bench_one(name, &enc, &dec, BENCH_ENCRYPT, false, size);
+		bench_one(name, &enc, &dec, BENCH_ENCRYPT, true, size);
+		bench_one(name, &enc, &dec, BENCH_DECRYPT, false, size);
+		bench_one(name, &enc, &dec, BENCH_DECRYPT, true, size);
+		bench_one(name, &enc, &dec, BENCH_REJECT, false, size);
+	}
+
+	crypto_context_cleanup(&enc);
+	crypto_context_cleanup(&dec);
+}
+
+static void print_help(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -c <cipher>       only this cipher (default: all known ciphers)\n");
+	printf("  -s <size,...>     packet sizes in bytes, default: 64,512,1300\n");
+	printf("  -b <batch>        batch size, default: %u\n", batch_size);
+	printf("  -t <ms>           minimum run time of each measurement, default: %u\n", min_time_ms);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t sizes[BENCH_MAX_SIZES] = { 64, 512, 1300, };
+	unsigned nr_sizes = 3, i;
+	const char *only_cipher = NULL;
+	char key[CRYPTO_MAX_KEY_SIZE], *sp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:s:b:t:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			only_cipher = optarg;
+			break;
+		case 's':
+			nr_sizes = 0;
+			for (sp = strtok(optarg, ","); sp && nr_sizes < BENCH_MAX_SIZES;
+				 sp = strtok(NULL, ",")) {
+				size_t size = strtoul(sp, NULL, 10);
+				if (size == 0 || size > BENCH_MAX_PKT) {
+					fprintf(stderr, "*** Invalid packet size: %s.\n", sp);
+					exit(1);
+				}
+				sizes[nr_sizes++] = size;
+			}
+			break;
+		case 'b':
+			batch_size = (unsigned)strtoul(optarg, NULL, 10);
+			if (batch_size == 0 || batch_size > BENCH_MAX_BATCH) {
+				fprintf(stderr, "*** Batch size must be 1..%d.\n", BENCH_MAX_BATCH);
+				exit(1);
+			}
+			break;
+		case 't':
+			min_time_ms = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			print_help(argv[0]);
+			exit(0);
+		default:
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < BENCH_MAX_BATCH; i++) {
+		if (posix_memalign((void **)&plain_bufs[i], 64, BENCH_BUFFER_SIZE) ||
+			posix_memalign((void **)&cipher_bufs[i], 64, BENCH_BUFFER_SIZE) ||
+			posix_memalign((void **)&out_bufs[i], 64, BENCH_BUFFER_SIZE)) {
+			fprintf(stderr, "*** Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	srand(1);
+	fill_with_string_md5sum("minivtun-bench", key, CRYPTO_MAX_KEY_SIZE);
+
+	printf("{\n  \"crypto_library\": \"%s\",\n  \"batch_size\": %u,\n  \"results\": [",
+		   OpenSSL_version(OPENSSL_VERSION), batch_size);
+
+	for (i = 0; cipher_pairs[i].name; i++) {
+		if (only_cipher && strcasecmp(only_cipher, cipher_pairs[i].name) != 0)
+			continue;
+		bench_cipher(cipher_pairs[i].name, key, sizes, nr_sizes);
+		fflush(stdout);
+	}
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
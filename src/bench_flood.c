@@ -0,0 +1,191 @@
+/*
+ * Flood benchmark for minivtun.
+ *
+ * Sends random datagrams, which no key can authenticate, with sendmmsg()
+ * to a server port as fast as it can for a while, and prints what the
+ * server process spent on each one it received, as JSON: the user and
+ * system CPU time of the process (from /proc/<pid>/stat) over the UDP
+ * datagrams delivered in this network namespace (from /proc/net/snmp).
+ * The server has to be the only UDP receiver in the namespace (see
+ * bench_flood.sh).
+ *
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE  /* sendmmsg() */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "library.h"
+
+#define BENCH_MAX_PKT  8192
+#define BENCH_BATCH    64
+
+static unsigned size = 1300;
+static double duration_s = 2.0;
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* User and system CPU time of process 'pid', in clock ticks. */
+static int read_proc_cpu(int pid, unsigned long *utime, unsigned long *stime)
+{
+	char path[64], line[1024], *p;
+	FILE *fp;
+	int rc = -1;
+
+	sprintf(path, "/proc/%d/stat", pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	/* Fields 14 and 15, counting past the command name in brackets. */
+	if (fgets(line, sizeof(line), fp) && (p = strrchr(line, ')')) &&
+		sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   utime, stime) == 2)
+		rc = 0;
+	fclose(fp);
+	return rc;
+}
+
+/* UDP datagrams delivered to sockets in this network namespace. */
+static int read_udp_in(unsigned long *in_datagrams)
+{
+	char head[1024], vals[1024];
+	FILE *fp;
+	int rc = -1;
+
+	if ((fp = fopen("/proc/net/snmp", "r")) == NULL)
+		return -1;
+	/* "Udp: InDatagrams ..." comes first, then "Udp: <values>". */
+	while (fgets(head, sizeof(head), fp)) {
+		if (strncmp(head, "Udp: ", 5) == 0 && fgets(vals, sizeof(vals), fp)) {
+			if (sscanf(vals, "Udp: %lu", in_datagrams) == 1)
+				rc = 0;
+			break;
+		}
+	}
+	fclose(fp);
+	return rc;
+}
+
+static void print_help(const char *prog)
+{
+	printf("Usage: %s -s <ip:port> -p <server pid> [options]\n", prog);
+	printf("  -s <ip:port>      server address to flood\n");
+	printf("  -p <pid>          process ID of the server\n");
+	printf("  -z <bytes>        datagram size, default: %u\n", size);
+	printf("  -d <secs>         time to flood, default: %.1f\n", duration_s);
+}
+
+int main(int argc, char *argv[])
+{
+	static char bufs[BENCH_BATCH][BENCH_MAX_PKT];
+	struct mmsghdr msgs[BENCH_BATCH];
+	struct iovec iovs[BENCH_BATCH];
+	const char *server_pair = NULL;
+	struct sockaddr_inx peer;
+	unsigned long utime0, stime0, utime1, stime1, in0, in1, sent = 0, received;
+	double t0, ns_per_tick = 1e9 / sysconf(_SC_CLK_TCK);
+	int pid = 0, sockfd, opt, rc;
+	unsigned i, j;
+
+	while ((opt = getopt(argc, argv, "s:p:z:d:h")) != -1) {
+		switch (opt) {
+		case 's':
+			server_pair = optarg;
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'z':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			duration_s = strtod(optarg, NULL);
+			break;
+		case 'h':
+			print_help(argv[0]);
+			exit(0);
+		default:
+			print_help(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (!server_pair || pid <= 0) {
+		print_help(argv[0]);
+		exit(1);
+	}
+	if (size == 0 || size > BENCH_MAX_PKT) {
+		fprintf(stderr, "*** Datagram size must be 1..%d bytes.\n", BENCH_MAX_PKT);
+		exit(1);
+	}
+	if (get_sockaddr_inx_pair(server_pair, &peer) < 0) {
+		fprintf(stderr, "*** Cannot resolve address pair '%s'.\n", server_pair);
+		exit(1);
+	}
+	if ((sockfd = socket(peer.sa.sa_family, SOCK_DGRAM, 0)) < 0) {
+		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+		exit(1);
+	}
+
+	/* Fresh garbage per slot, so that no two datagrams of a batch match. */
+	srand(0x5eed);
+	memset(msgs, 0x0, sizeof(msgs));
+	for (i = 0; i < BENCH_BATCH; i++) {
+		for (j = 0; j < size; j++)
+			bufs[i][j] = (char)rand();
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &peer;
+		msgs[i].msg_hdr.msg_namelen = sizeof_sockaddr(&peer);
+	}
+
+	if (read_proc_cpu(pid, &utime0, &stime0) < 0 || read_udp_in(&in0) < 0) {
+		fprintf(stderr, "*** Cannot read the counters of process %d.\n", pid);
+		exit(1);
+	}
+	t0 = now_s();
+	while (now_s() - t0 < duration_s) {
+		/* Keep the first bytes apart between batches too. */
+		for (i = 0; i < BENCH_BATCH; i++)
+			*(unsigned long *)bufs[i] ^= sent + i;
+		if ((rc = sendmmsg(sockfd, msgs, BENCH_BATCH, 0)) < 0) {
+			if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+				continue;
+			fprintf(stderr, "*** sendmmsg() failed: %s.\n", strerror(errno));
+			exit(1);
+		}
+		sent += rc;
+	}
+	/* Let the server drain its socket buffer. */
+	usleep(200000);
+	if (read_proc_cpu(pid, &utime1, &stime1) < 0 || read_udp_in(&in1) < 0) {
+		fprintf(stderr, "*** Cannot read the counters of process %d.\n", pid);
+		exit(1);
+	}
+	close(sockfd);
+
+	received = in1 - in0;
+	printf("{ \"size\": %u, \"sent\": %lu, \"received\": %lu", size, sent, received);
+	if (received) {
+		printf(", \"user_ns_per_pkt\": %.0f, \"total_ns_per_pkt\": %.0f",
+			   (utime1 - utime0) * ns_per_tick / received,
+			   (utime1 - utime0 + stime1 - stime0) * ns_per_tick / received);
+	}
+	printf(" }\n");
+	return 0;
+}
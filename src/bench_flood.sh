@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Server CPU per datagram rejected by the key check, under a flood of
+# random datagrams, for each CBC and stream cipher. The server runs in a
+# network namespace of its own, bench_flood sends to it over loopback.
+# Needs root.
+#
+# Usage: ./bench_flood.sh [bench_flood options]
+#
+# For a before/after comparison, build and run it in both trees.
+#
+
+NS=mvbench-f
+PIDS=
+
+cleanup()
+{
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	PIDS=
+	ip netns del $NS 2>/dev/null
+}
+
+# run_one <cipher>
+run_one()
+{
+	ip netns add $NS || exit 1
+	ip -n $NS link set lo up
+	ip netns exec $NS ./minivtun -l 127.0.0.1:1414 -a 10.97.0.1/24 -e bench -t "$1" >/dev/null 2>&1 &
+	PIDS="$!"
+	sleep 0.5
+	# des and rc4 need the legacy provider of OpenSSL 3.
+	if ! kill -0 $PIDS 2>/dev/null; then
+		echo "\"$1\": null"
+		PIDS=
+		cleanup
+		return
+	fi
+	printf '"%s": ' "$1"
+	ip netns exec $NS ./bench_flood -s 127.0.0.1:1414 -p "$PIDS" $BENCH_ARGS
+	cleanup
+}
+
+trap cleanup EXIT INT TERM
+cd "$(dirname "$0")"
+BENCH_ARGS="$*"
+cleanup
+
+for cipher in aes-128 aes-256 des rc4; do
+	run_one $cipher
+done
@@ -0,0 +1,199 @@
+/*
+ * One-way latency probe for minivtun.
+ *
+ * A sender puts sequence numbers and CLOCK_MONOTONIC timestamps into
+ * UDP datagrams at a fixed rate, a receiver takes them off the other
+ * end of the tunnel and prints the p50/p99/max one-way delay as JSON.
+ * Both ends have to read the same clock: run them in two network
+ * namespaces of one host (see bench_latency.sh).
+ *
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
+
+#include "library.h"
+
+#define BENCH_MAX_PKT  1400
+
+struct probe {
+	uint32_t seq;
+	uint32_t count;
+	uint64_t sent_ns;
+};
+
+static unsigned count = 5000;
+static unsigned interval_us = 1000;
+static unsigned size = 64;
+static unsigned wait_ms = 1000;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int run_sender(const struct sockaddr_inx *peer)
+{
+	char buf[BENCH_MAX_PKT];
+	struct probe *pb = (struct probe *)buf;
+	uint64_t next;
+	unsigned i;
+	int sockfd;
+
+	if ((sockfd = socket(peer->sa.sa_family, SOCK_DGRAM, 0)) < 0) {
+		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+		return 1;
+	}
+
+	memset(buf, 0x0, sizeof(buf));
+	next = now_ns();
+	for (i = 0; i < count; i++) {
+		/* Sleep most of the gap, spin the rest for an even rate. */
+		while (now_ns() + 100000 < next)
+			usleep(50);
+		while (now_ns() < next)
+			;
+		pb->seq = i;
+		pb->count = count;
+		pb->sent_ns = now_ns();
+		if (sendto(sockfd, buf, size, 0, &peer->sa, sizeof_sockaddr(peer)) < 0) {
+			fprintf(stderr, "*** sendto() failed: %s.\n", strerror(errno));
+			close(sockfd);
+			return 1;
+		}
+		next += (uint64_t)interval_us * 1000;
+	}
+
+	close(sockfd);
+	return 0;
+}
+
+static int run_receiver(const struct sockaddr_inx *loc)
+{
+	char buf[BENCH_MAX_PKT];
+	struct probe *pb = (struct probe *)buf;
+	uint64_t *delays;
+	unsigned received = 0, expected = count;
+	struct pollfd pfd;
+	ssize_t rc;
+	int sockfd;
+
+	if ((delays = malloc(sizeof(*delays) * count)) == NULL) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return 1;
+	}
+	if ((sockfd = socket(loc->sa.sa_family, SOCK_DGRAM, 0)) < 0) {
+		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+		return 1;
+	}
+	if (bind(sockfd, &loc->sa, sizeof_sockaddr(loc)) < 0) {
+		fprintf(stderr, "*** bind() failed: %s.\n", strerror(errno));
+		return 1;
+	}
+
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	/* A few seconds for the first one to show up, then 'wait_ms' at most. */
+	while (received < expected &&
+		   poll(&pfd, 1, received ? (int)wait_ms : 5000 + (int)wait_ms) > 0) {
+		if ((rc = recv(sockfd, buf, sizeof(buf), 0)) < (ssize_t)sizeof(*pb))
+			continue;
+		expected = pb->count < count ? pb->count : count;
+		if (pb->seq < count)
+			delays[received++] = now_ns() - pb->sent_ns;
+	}
+	close(sockfd);
+
+	qsort(delays, received, sizeof(*delays), cmp_u64);
+	printf("{ \"packets\": %u, \"lost\": %u", received, expected - received);
+	if (received) {
+		printf(", \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f",
+			   delays[received / 2] / 1e3,
+			   delays[(size_t)received * 99 / 100] / 1e3,
+			   delays[received - 1] / 1e3);
+	}
+	printf(" }\n");
+
+	free(delays);
+	return 0;
+}
+
+static void print_help(const char *prog)
+{
+	printf("Usage: %s -l <ip:port> | -s <ip:port> [options]\n", prog);
+	printf("  -l <ip:port>      receive on this address and print the results\n");
+	printf("  -s <ip:port>      send probes to this address\n");
+	printf("  -n <count>        number of probes, default: %u\n", count);
+	printf("  -i <usecs>        interval between probes, default: %u\n", interval_us);
+	printf("  -z <bytes>        probe size, default: %u\n", size);
+	printf("  -w <ms>           receiver gives up after this long without probes, default: %u\n", wait_ms);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *listen_pair = NULL, *send_pair = NULL;
+	struct sockaddr_inx addr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:s:n:i:z:w:h")) != -1) {
+		switch (opt) {
+		case 'l':
+			listen_pair = optarg;
+			break;
+		case 's':
+			send_pair = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			interval_us = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			wait_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			print_help(argv[0]);
+			exit(0);
+		default:
+			print_help(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (count == 0 || size < sizeof(struct probe) || size > BENCH_MAX_PKT) {
+		fprintf(stderr, "*** Need at least one probe of %zu..%d bytes.\n",
+				sizeof(struct probe), BENCH_MAX_PKT);
+		exit(1);
+	}
+	if (!listen_pair == !send_pair) {
+		print_help(argv[0]);
+		exit(1);
+	}
+	if (get_sockaddr_inx_pair(listen_pair ? listen_pair : send_pair, &addr) < 0) {
+		fprintf(stderr, "*** Cannot resolve address pair '%s'.\n",
+				listen_pair ? listen_pair : send_pair);
+		exit(1);
+	}
+
+	return listen_pair ? run_receiver(&addr) : run_sender(&addr);
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# One-way latency through the tunnel, with and without '--busy-poll'.
+# Server and client run in two network namespaces joined by a veth pair,
+# bench_latency sends probes from the client side to the server side.
+# Needs root.
+#
+# Usage: ./bench_latency.sh [busy-poll usecs, default 2000] [bench_latency options]
+#
+# The busy-poll period must outlast the gap between probes (1000 usecs by
+# default, '-i'), else the loop is back in epoll_wait() by the time each
+# one comes and the spinning run measures nothing but the wake-up.
+#
+
+BUSY_POLL=${1:-2000}
+[ $# -gt 0 ] && shift
+
+NS_S=mvbench-s
+NS_C=mvbench-c
+PIDS=
+
+cleanup()
+{
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	PIDS=
+	ip netns del $NS_S 2>/dev/null
+	ip netns del $NS_C 2>/dev/null
+}
+
+setup()
+{
+	ip netns add $NS_S && ip netns add $NS_C || exit 1
+	ip link add mvbench0 netns $NS_S type veth peer name mvbench1 netns $NS_C || exit 1
+	ip -n $NS_S addr add 10.98.0.1/24 dev mvbench0
+	ip -n $NS_C addr add 10.98.0.2/24 dev mvbench1
+	ip -n $NS_S link set mvbench0 up
+	ip -n $NS_C link set mvbench1 up
+	ip -n $NS_C route add default via 10.98.0.1
+}
+
+# run_one <label> [minivtun options]
+run_one()
+{
+	label=$1
+	shift
+	setup
+	ip netns exec $NS_S ./minivtun -l 10.98.0.1:1414 -a 10.97.0.1/24 -e bench "$@" >/dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	sleep 0.5
+	ip netns exec $NS_C ./minivtun -r 10.98.0.1:1414 -a 10.97.0.2/24 -e bench "$@" >/dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	sleep 1.5
+	printf '"%s": ' "$label"
+	ip netns exec $NS_S ./bench_latency -l 10.97.0.1:5000 $BENCH_ARGS &
+	rpid=$!
+	sleep 0.2
+	ip netns exec $NS_C ./bench_latency -s 10.97.0.1:5000 $BENCH_ARGS
+	wait $rpid
+	cleanup
+}
+
+trap cleanup EXIT INT TERM
+cd "$(dirname "$0")"
+BENCH_ARGS="$*"
+cleanup
+
+run_one blocking
+run_one "busy_poll_${BUSY_POLL}us" -P "$BUSY_POLL"
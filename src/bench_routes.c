@@ -0,0 +1,293 @@
+/*
+ * Virtual route benchmark for minivtun.
+ *
+ * Fills an LPM trie (the server's '-v' routes) with N random IPv4 or
+ * IPv6 prefixes, mostly /24 or /48 with some shorter and longer ones as
+ * in a real table, and measures adding them and looking up random addresses and
+ * addresses inside the routes. Some lookups are checked against a
+ * linear scan for the longest match. Results are printed as JSON.
+ *
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "lpm.h"
+
+#define BENCH_MAX_SIZES  16
+#define BENCH_LOOKUPS  (1U << 20)
+#define BENCH_CHECKS  1000
+
+struct route {
+	uint8_t network[16];
+	unsigned prefix;
+};
+
+static unsigned lookup_rounds = 4;
+static bool first_result = true;
+static uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static uint32_t rand32(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return (uint32_t)(rand_state >> 32);
+}
+
+static void rand_bytes(uint8_t *p, unsigned len)
+{
+	uint32_t x;
+
+	for (; len; len -= 4, p += 4) {
+		x = rand32();
+		memcpy(p, &x, 4);
+	}
+}
+
+/* Bits of 'a' from 'prefix' on, cleared or set to those of 'b'. */
+static void merge_bits(uint8_t *a, const uint8_t *b, unsigned prefix, unsigned bytes)
+{
+	unsigned i;
+	uint8_t m;
+
+	for (i = 0; i < bytes; i++) {
+		if (prefix >= 8 * (i + 1))
+			continue;
+		m = prefix > 8 * i ? 0xff >> (prefix - 8 * i) : 0xff;
+		a[i] = (a[i] & ~m) | (b ? b[i] & m : 0);
+	}
+}
+
+static bool prefix_match(const uint8_t *a, const struct route *rt)
+{
+	unsigned i, n = rt->prefix;
+
+	for (i = 0; n >= 8; i++, n -= 8) {
+		if (a[i] != rt->network[i])
+			return false;
+	}
+	return n == 0 || ((a[i] ^ rt->network[i]) & (0xff << (8 - n))) == 0;
+}
+
+/**
+ * IPv4: 60% /24, 25% /16../23, 10% /25../32, 5% /8../15.
+ * IPv6: 60% /48, 25% /32../47, 10% /49../64, 5% /65../128.
+ */
+static void make_route(struct route *rt, unsigned bytes)
+{
+	unsigned r = rand32() % 100;
+
+	if (bytes == 4) {
+		if (r < 60)
+			rt->prefix = 24;
+		else if (r < 85)
+			rt->prefix = 16 + rand32() % 8;
+		else if (r < 95)
+			rt->prefix = 25 + rand32() % 8;
+		else
+			rt->prefix = 8 + rand32() % 8;
+	} else {
+		if (r < 60)
+			rt->prefix = 48;
+		else if (r < 85)
+			rt->prefix = 32 + rand32() % 16;
+		else if (r < 95)
+			rt->prefix = 49 + rand32() % 16;
+		else
+			rt->prefix = 65 + rand32() % 64;
+	}
+	rand_bytes(rt->network, bytes);
+	if (bytes == 16)
+		rt->network[0] = 0x20 | (rt->network[0] & 0x1f);  /* 2000::/3 */
+	merge_bits(rt->network, NULL, rt->prefix, bytes);
+}
+
+/**
+ * Value of the longest route that takes 'addr', the slow way. Of routes
+ * added twice, the last one counts, as in the trie.
+ */
+static unsigned linear_lookup(const struct route *routes, unsigned n, const uint8_t *addr)
+{
+	unsigned i, best = 0, best_prefix = 0;
+
+	for (i = 0; i < n; i++) {
+		if (prefix_match(addr, &routes[i]) &&
+			(best == 0 || routes[i].prefix >= best_prefix)) {
+			best = i + 1;
+			best_prefix = routes[i].prefix;
+		}
+	}
+	return best;
+}
+
+/* Number of the first BENCH_CHECKS lookups that the trie gets wrong. */
+static unsigned check_lookups(const struct route *routes, unsigned n,
+		const struct lpm *t, const uint8_t *addrs)
+{
+	unsigned i, bad = 0;
+
+	for (i = 0; i < BENCH_CHECKS; i++) {
+		if (lpm_lookup(t, &addrs[i * 16]) != linear_lookup(routes, n, &addrs[i * 16]))
+			bad++;
+	}
+	return bad;
+}
+
+static void print_result(const char *af_name, unsigned n, const char *op,
+		double ns_per_op, size_t memory)
+{
+	printf("%s\n    { \"af\": \"%s\", \"routes\": %u, \"op\": \"%s\"",
+		   first_result ? "" : ",", af_name, n, op);
+	if (ns_per_op >= 0)
+		printf(", \"ns_per_op\": %.1f", ns_per_op);
+	if (memory)
+		printf(", \"bytes\": %zu", memory);
+	printf(" }");
+	first_result = false;
+}
+
+static int bench_size(int af, unsigned n)
+{
+	const char *af_name = af == AF_INET6 ? "ipv6" : "ipv4";
+	unsigned bytes = af == AF_INET6 ? 16 : 4;
+	struct route *routes;
+	uint8_t *addrs;
+	struct lpm t;
+	unsigned long sum = 0;
+	unsigned i, r, bad = 0;
+	double t0;
+
+	/* Addresses 16 bytes apart, whatever the family. */
+	if ((routes = malloc(sizeof(*routes) * n)) == NULL ||
+		(addrs = calloc(BENCH_LOOKUPS, 16)) == NULL ||
+		lpm_init(&t, bytes * 8) < 0) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		make_route(&routes[i], bytes);
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		if (lpm_add(&t, routes[i].network, routes[i].prefix, i + 1) < 0) {
+			fprintf(stderr, "*** Out of memory.\n");
+			return -1;
+		}
+	}
+	if (lpm_build(&t) < 0) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return -1;
+	}
+	print_result(af_name, n, "build", (now_ns() - t0) / n, 0);
+	print_result(af_name, n, "memory", -1, lpm_memory(&t));
+
+	/* Random addresses, whatever route they hit (or none). */
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		rand_bytes(&addrs[i * 16], bytes);
+		if (bytes == 16)
+			addrs[i * 16] = 0x20 | (addrs[i * 16] & 0x1f);
+	}
+	t0 = now_ns();
+	for (r = 0; r < lookup_rounds; r++) {
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			sum += lpm_lookup(&t, &addrs[i * 16]);
+	}
+	print_result(af_name, n, "lookup_random",
+			(now_ns() - t0) / ((double)BENCH_LOOKUPS * lookup_rounds), 0);
+	bad += check_lookups(routes, n, &t, addrs);
+
+	/* Addresses inside the routes, down the deepest levels more often. */
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		const struct route *rt = &routes[rand32() % n];
+		uint8_t host[16];
+
+		rand_bytes(host, bytes);
+		memcpy(&addrs[i * 16], rt->network, bytes);
+		merge_bits(&addrs[i * 16], host, rt->prefix, bytes);
+	}
+	t0 = now_ns();
+	for (r = 0; r < lookup_rounds; r++) {
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			sum += lpm_lookup(&t, &addrs[i * 16]);
+	}
+	print_result(af_name, n, "lookup_routed",
+			(now_ns() - t0) / ((double)BENCH_LOOKUPS * lookup_rounds), 0);
+
+	bad += check_lookups(routes, n, &t, addrs);
+	if (bad)
+		fprintf(stderr, "*** %u of %u lookups do not match a linear scan.\n", bad,
+				BENCH_CHECKS * 2);
+	if (sum == 0)
+		fprintf(stderr, "*** No lookups matched.\n");
+
+	lpm_destroy(&t);
+	free(addrs);
+	free(routes);
+	return bad ? -1 : 0;
+}
+
+static void print_help(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -n <size,...>     numbers of routes, default: 10000,100000\n");
+	printf("  -r <rounds>       rounds of %u lookups, default: %u\n", BENCH_LOOKUPS, lookup_rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned sizes[BENCH_MAX_SIZES] = { 10000, 100000, };
+	unsigned nr_sizes = 2, i;
+	char *sp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_sizes = 0;
+			for (sp = strtok(optarg, ","); sp && nr_sizes < BENCH_MAX_SIZES;
+				 sp = strtok(NULL, ",")) {
+				if ((sizes[nr_sizes] = strtoul(sp, NULL, 10)) == 0 ||
+					sizes[nr_sizes] > LPM_VALUE_MAX) {
+					fprintf(stderr, "*** Invalid number of routes: %s.\n", sp);
+					exit(1);
+				}
+				nr_sizes++;
+			}
+			break;
+		case 'r':
+			if ((lookup_rounds = strtoul(optarg, NULL, 10)) == 0)
+				lookup_rounds = 1;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			exit(0);
+		default:
+			print_help(argv[0]);
+			exit(1);
+		}
+	}
+
+	printf("{\n  \"results\": [");
+	for (i = 0; i < nr_sizes; i++) {
+		if (bench_size(AF_INET, sizes[i]) < 0 || bench_size(AF_INET6, sizes[i]) < 0)
+			exit(1);
+	}
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
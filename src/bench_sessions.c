@@ -0,0 +1,235 @@
+/*
+ * Session table benchmark for minivtun.
+ *
+ * Fills a session store (the server's clients) with N sessions, each
+ * with a real address (a quarter of them IPv6), a virtual IPv4 and IPv6
+ * address and a timer on a wheel, as a server with that many online
+ * clients has them. Prints the memory that takes per session, both as
+ * counted by the store and as seen in the resident set of the process,
+ * and the cost of creating sessions, of looking them up by real and by
+ * virtual address, and of deleting them. Results are printed as JSON.
+ *
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "session.h"
+
+#define BENCH_MAX_SIZES  16
+
+struct bench_client {
+	struct sockaddr_inx real_addr;
+	struct in_addr virt_in;
+	struct in6_addr virt_in6;
+};
+
+static unsigned lookup_rounds = 4;
+static bool preallocate = false;
+static bool first_result = true;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Resident set of the process, in bytes. */
+static size_t rss_bytes(void)
+{
+	unsigned long size, resident = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+		return 0;
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* Distinct addresses: a counter scrambled by odd multipliers. */
+static void make_client(struct bench_client *c, unsigned i)
+{
+	uint32_t x = (i + 1) * 2654435761U, y = (i + 1) * 0x9e3779b1U;
+
+	memset(c, 0x0, sizeof(*c));
+	if (i % 4 == 3) {
+		c->real_addr.in6.sin6_family = AF_INET6;
+		c->real_addr.in6.sin6_addr.s6_addr[0] = 0x20;
+		c->real_addr.in6.sin6_addr.s6_addr[1] = 0x01;
+		memcpy(&c->real_addr.in6.sin6_addr.s6_addr[12], &x, 4);
+		c->real_addr.in6.sin6_port = htons(1024 + i % 60000);
+	} else {
+		c->real_addr.in.sin_family = AF_INET;
+		c->real_addr.in.sin_addr.s_addr = x;
+		c->real_addr.in.sin_port = htons(1024 + i % 60000);
+	}
+	c->virt_in.s_addr = y;
+	c->virt_in6.s6_addr[0] = 0xfd;
+	memcpy(&c->virt_in6.s6_addr[12], &y, 4);
+}
+
+static void print_result(unsigned n, const char *op, double ns_per_op,
+		size_t bytes, double per_session)
+{
+	printf("%s\n    { \"sessions\": %u, \"op\": \"%s\"",
+		   first_result ? "" : ",", n, op);
+	if (ns_per_op >= 0)
+		printf(", \"ns_per_op\": %.1f", ns_per_op);
+	if (bytes)
+		printf(", \"bytes\": %zu, \"bytes_per_session\": %.1f", bytes, per_session);
+	printf(" }");
+	first_result = false;
+}
+
+static int bench_size(unsigned n)
+{
+	struct session_store st;
+	struct timer_wheel tw;
+	struct bench_client *clients;
+	struct session *s;
+	struct in_addr no_subnet = { 0 };
+	unsigned long found = 0;
+	size_t rss0, rss1;
+	unsigned i, r, k;
+	double t0;
+
+	if ((clients = malloc(sizeof(*clients) * n)) == NULL) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		make_client(&clients[i], i);
+
+	rss0 = rss_bytes();
+	tw_init(&tw, 0);
+	t0 = now_ns();
+	/* No subnet array: all virtual addresses go to the hash table. */
+	if (session_store_init(&st, preallocate ? n : 0, 0x5eed, no_subnet, 0) < 0) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if ((s = session_new(&st, &clients[i].real_addr)) == NULL ||
+			session_set_virt(&st, s, AF_INET, &clients[i].virt_in) < 0 ||
+			session_set_virt(&st, s, AF_INET6, &clients[i].virt_in6) < 0) {
+			fprintf(stderr, "*** Out of memory.\n");
+			return -1;
+		}
+		s->last_recv = s->last_xmit = 0;
+		tw_add(&tw, &session_cold(&st, s)->timer, 1 + i % 600);
+	}
+	print_result(n, "create", (now_ns() - t0) / n, 0, 0);
+	rss1 = rss_bytes();
+	print_result(n, "memory", -1, session_memory(&st), (double)session_memory(&st) / n);
+	print_result(n, "memory_rss", -1, rss1 - rss0, (double)(rss1 - rss0) / n);
+
+	/* Random order, so that the cache sees what the server would. */
+	t0 = now_ns();
+	for (r = 0; r < lookup_rounds; r++) {
+		for (i = 0; i < n; i++) {
+			k = ((i + r) * 7919U) % n;
+			found += session_find_real(&st, &clients[k].real_addr) != NULL;
+		}
+	}
+	print_result(n, "lookup_real", (now_ns() - t0) / ((double)n * lookup_rounds), 0, 0);
+
+	t0 = now_ns();
+	for (r = 0; r < lookup_rounds; r++) {
+		for (i = 0; i < n; i++) {
+			k = ((i + r) * 7919U) % n;
+			found += session_find_virt(&st, AF_INET, &clients[k].virt_in) != NULL;
+		}
+	}
+	print_result(n, "lookup_virt4", (now_ns() - t0) / ((double)n * lookup_rounds), 0, 0);
+
+	t0 = now_ns();
+	for (r = 0; r < lookup_rounds; r++) {
+		for (i = 0; i < n; i++) {
+			k = ((i + r) * 7919U) % n;
+			found += session_find_virt(&st, AF_INET6, &clients[k].virt_in6) != NULL;
+		}
+	}
+	print_result(n, "lookup_virt6", (now_ns() - t0) / ((double)n * lookup_rounds), 0, 0);
+
+	if (found != (unsigned long)n * lookup_rounds * 3)
+		fprintf(stderr, "*** Lookups found %lu, expected %lu.\n", found,
+				(unsigned long)n * lookup_rounds * 3);
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		s = session_find_real(&st, &clients[i].real_addr);
+		tw_del(&tw, &session_cold(&st, s)->timer);
+		session_delete(&st, s);
+	}
+	print_result(n, "delete", (now_ns() - t0) / n, 0, 0);
+	if (session_count(&st) || session_virt_count(&st))
+		fprintf(stderr, "*** %u sessions and %u addresses left.\n",
+				session_count(&st), session_virt_count(&st));
+
+	session_store_destroy(&st);
+	free(clients);
+	return found == (unsigned long)n * lookup_rounds * 3 ? 0 : -1;
+}
+
+static void print_help(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -n <size,...>     numbers of sessions, default: 100000,1000000\n");
+	printf("  -r <rounds>       lookups per session, default: %u\n", lookup_rounds);
+	printf("  -C                set up room for all of them at start, as '--capacity'\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned sizes[BENCH_MAX_SIZES] = { 100000, 1000000, };
+	unsigned nr_sizes = 2, i;
+	char *sp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:Ch")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_sizes = 0;
+			for (sp = strtok(optarg, ","); sp && nr_sizes < BENCH_MAX_SIZES;
+				 sp = strtok(NULL, ",")) {
+				if ((sizes[nr_sizes] = strtoul(sp, NULL, 10)) == 0) {
+					fprintf(stderr, "*** Invalid number of sessions: %s.\n", sp);
+					exit(1);
+				}
+				nr_sizes++;
+			}
+			break;
+		case 'r':
+			if ((lookup_rounds = strtoul(optarg, NULL, 10)) == 0)
+				lookup_rounds = 1;
+			break;
+		case 'C':
+			preallocate = true;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			exit(0);
+		default:
+			print_help(argv[0]);
+			exit(1);
+		}
+	}
+
+	printf("{\n  \"results\": [");
+	for (i = 0; i < nr_sizes; i++) {
+		if (bench_size(sizes[i]) < 0)
+			exit(1);
+	}
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Address table benchmark for minivtun.
+ *
+ * Fills an addr_table (the server's client tables) with N random IPv4
+ * or IPv6 addresses and measures inserts, lookups that hit and miss,
+ * and removals. A second round times each insert and removal on its
+ * own for the slowest one, which shows what resizing costs. Results are
+ * printed as JSON.
+ *
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "addr_table.h"
+
+#define BENCH_MAX_SIZES  16
+
+static unsigned lookup_rounds = 4;
+static bool first_result = true;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Distinct addresses: a counter scrambled by an odd multiplier. */
+static void make_key(struct addr_key *key, uint16_t af, unsigned i)
+{
+	uint32_t x = (i + 1) * 2654435761U;
+	struct in6_addr in6;
+
+	if (af == AF_INET6) {
+		memset(&in6, 0x0, sizeof(in6));
+		in6.s6_addr[0] = 0xfd;
+		memcpy(&in6.s6_addr[12], &x, 4);
+		addr_key_set(key, AF_INET6, &in6, 0);
+	} else {
+		addr_key_set(key, AF_INET, &x, htons(1414));
+	}
+}
+
+/* Entry i + 1 of the table is keys[i]. */
+static bool match_key(const void *ctx, uint32_t value, const struct addr_key *key)
+{
+	const struct addr_key *keys = ctx;
+
+	return memcmp(&keys[value - 1], key, sizeof(*key)) == 0;
+}
+
+static void print_result(const char *af_name, unsigned n, const char *op,
+		double ns_per_op, double max_ns)
+{
+	printf("%s\n    { \"af\": \"%s\", \"entries\": %u, \"op\": \"%s\"",
+		   first_result ? "" : ",", af_name, n, op);
+	if (ns_per_op >= 0)
+		printf(", \"ns_per_op\": %.1f", ns_per_op);
+	if (max_ns >= 0)
+		printf(", \"max_ns\": %.0f", max_ns);
+	printf(" }");
+	first_result = false;
+}
+
+static int bench_size(uint16_t af, unsigned n)
+{
+	const char *af_name = af == AF_INET6 ? "ipv6" : "ipv4";
+	struct addr_table t;
+	struct addr_key *keys;
+	double t0, t1, t2, max_ns = 0;
+	unsigned long found = 0;
+	unsigned i, r;
+
+	if ((keys = malloc(sizeof(*keys) * (size_t)n * 2)) == NULL) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return -1;
+	}
+	/* The first n go in, the others are for missing lookups. */
+	for (i = 0; i < n * 2; i++)
+		make_key(&keys[i], af, i);
+	if (addr_table_init(&t, 16, 0x5eed, match_key, keys) < 0) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return -1;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		addr_table_insert(&t, &keys[i], i + 1);
+	print_result(af_name, n, "insert", (now_ns() - t0) / n, -1);
+
+	/* Random order, so that the cache sees what the server would. */
+	t0 = now_ns();
+	for (r = 0; r < lookup_rounds; r++) {
+		for (i = 0; i < n; i++)
+			found += addr_table_lookup(&t, &keys[((i + r) * 7919U) % n]) != 0;
+	}
+	print_result(af_name, n, "lookup_hit", (now_ns() - t0) / ((double)n * lookup_rounds), -1);
+
+	t0 = now_ns();
+	for (r = 0; r < lookup_rounds; r++) {
+		for (i = 0; i < n; i++)
+			found += addr_table_lookup(&t, &keys[n + i]) != 0;
+	}
+	print_result(af_name, n, "lookup_miss", (now_ns() - t0) / ((double)n * lookup_rounds), -1);
+
+	if (found != (unsigned long)n * lookup_rounds)
+		fprintf(stderr, "*** Lookups found %lu, expected %lu.\n", found,
+				(unsigned long)n * lookup_rounds);
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		addr_table_remove(&t, &keys[i]);
+	print_result(af_name, n, "remove", (now_ns() - t0) / n, -1);
+
+	/* Again with a clock read around each one, for the slowest. */
+	for (i = 0; i < n; i++) {
+		t1 = now_ns();
+		addr_table_insert(&t, &keys[i], i + 1);
+		t2 = now_ns();
+		if (t2 - t1 > max_ns)
+			max_ns = t2 - t1;
+	}
+	print_result(af_name, n, "insert_max", -1, max_ns);
+	max_ns = 0;
+	for (i = 0; i < n; i++) {
+		t1 = now_ns();
+		addr_table_remove(&t, &keys[i]);
+		t2 = now_ns();
+		if (t2 - t1 > max_ns)
+			max_ns = t2 - t1;
+	}
+	print_result(af_name, n, "remove_max", -1, max_ns);
+
+	addr_table_destroy(&t);
+	free(keys);
+	return 0;
+}
+
+static void print_help(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -n <size,...>     numbers of entries, default: 1000,100000,1000000\n");
+	printf("  -r <rounds>       lookups per entry, default: %u\n", lookup_rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned sizes[BENCH_MAX_SIZES] = { 1000, 100000, 1000000, };
+	unsigned nr_sizes = 3, i;
+	char *sp;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_sizes = 0;
+			for (sp = strtok(optarg, ","); sp && nr_sizes < BENCH_MAX_SIZES;
+				 sp = strtok(NULL, ",")) {
+				if ((sizes[nr_sizes] = strtoul(sp, NULL, 10)) == 0) {
+					fprintf(stderr, "*** Invalid number of entries: %s.\n", sp);
+					exit(1);
+				}
+				nr_sizes++;
+			}
+			break;
+		case 'r':
+			if ((lookup_rounds = strtoul(optarg, NULL, 10)) == 0)
+				lookup_rounds = 1;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			exit(0);
+		default:
+			print_help(argv[0]);
+			exit(1);
+		}
+	}
+
+	printf("{\n  \"results\": [");
+	for (i = 0; i < nr_sizes; i++) {
+		if (bench_size(AF_INET, sizes[i]) < 0 || bench_size(AF_INET6, sizes[i]) < 0)
+			exit(1);
+	}
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Worker scaling benchmark for minivtun.
+ *
+ * Fills a session store with N clients, as a server with that many
+ * online has them, then has 1, 2, 4, ... threads do what the workers
+ * do for each packet, as fast as they can for a while: a lookup of the
+ * client by virtual address, and the stamp of its 'last_recv' or
+ * 'last_xmit'. Once with one lock for all of them (what the server had),
+ * once with a lock per thread (struct lglock, what it has). Prints the
+ * lookups per second of all threads together, as JSON.
+ *
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "session.h"
+#include "lglock.h"
+
+#define BENCH_MAX_THREADS  64
+
+struct bench_thread {
+	pthread_t thread;
+	unsigned id;
+	unsigned long ops;
+	uint16_t port;     /* of the last one, so that it is copied at all */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct session_store sessions;
+static struct in_addr *virt_addrs;
+static unsigned nr_sessions = 100000;
+static unsigned max_threads;
+static double duration_s = 0.5;
+
+static bool use_lglock;
+static pthread_mutex_t one_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lglock lg;
+static volatile bool stop;
+static bool first_result = true;
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *bench_thread_run(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct sockaddr_inx real_addr;
+	struct session *s;
+	uint32_t x = (t->id + 1) * 2654435761U, now;
+	unsigned long ops = 0;
+	unsigned i;
+
+	memset(&real_addr, 0x0, sizeof(real_addr));
+	while (!stop) {
+		now = (uint32_t)time(NULL);
+		for (i = 0; i < 256; i++) {
+			x = x * 1103515245U + 12345U;
+			if (use_lglock)
+				lg_local_lock(&lg, t->id);
+			else
+				pthread_mutex_lock(&one_lock);
+			if ((s = session_find_virt(&sessions, AF_INET, &virt_addrs[x % nr_sessions]))) {
+				real_addr = s->real_addr;
+				session_stamp(i & 1 ? &s->last_recv : &s->last_xmit, now);
+				ops++;
+			}
+			if (use_lglock)
+				lg_local_unlock(&lg, t->id);
+			else
+				pthread_mutex_unlock(&one_lock);
+		}
+	}
+	t->ops = ops;
+	t->port = real_addr.in.sin_port;
+	return NULL;
+}
+
+static int bench_threads(unsigned nr, bool lglock)
+{
+	struct bench_thread threads[BENCH_MAX_THREADS];
+	unsigned long ops = 0;
+	double t0, t1;
+	unsigned i;
+
+	use_lglock = lglock;
+	stop = false;
+	if (lglock_init(&lg, nr) < 0) {
+		fprintf(stderr, "*** Out of memory.\n");
+		return -1;
+	}
+	t0 = now_s();
+	for (i = 0; i < nr; i++) {
+		threads[i].id = i;
+		threads[i].ops = 0;
+		if (pthread_create(&threads[i].thread, NULL, bench_thread_run, &threads[i])) {
+			fprintf(stderr, "*** pthread_create() failed.\n");
+			return -1;
+		}
+	}
+	usleep((useconds_t)(duration_s * 1e6));
+	stop = true;
+	for (i = 0; i < nr; i++) {
+		pthread_join(threads[i].thread, NULL);
+		ops += threads[i].ops;
+	}
+	t1 = now_s();
+	lglock_destroy(&lg);
+
+	printf("%s\n    { \"lock\": \"%s\", \"threads\": %u, \"lookups_per_sec\": %.0f }",
+		   first_result ? "" : ",", lglock ? "per_worker" : "global", nr,
+		   (double)ops / (t1 - t0));
+	first_result = false;
+	return 0;
+}
+
+static void print_help(const char *prog)
+{
+	printf("Usage: %s [options]\n", prog);
+	printf("  -n <sessions>     number of sessions, default: %u\n", nr_sessions);
+	printf("  -t <threads>      most threads, default: the number of CPUs\n");
+	printf("  -d <secs>         time per run, default: %.1f\n", duration_s);
+}
+
+int main(int argc, char *argv[])
+{
+	struct in_addr no_subnet = { 0 };
+	struct sockaddr_inx real_addr;
+	struct session *s;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
+	int opt;
+
+	max_threads = nr_cpus > 0 ? (unsigned)nr_cpus : 1;
+	while ((opt = getopt(argc, argv, "n:t:d:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			if ((nr_sessions = strtoul(optarg, NULL, 10)) == 0)
+				nr_sessions = 1;
+			break;
+		case 't':
+			if ((max_threads = strtoul(optarg, NULL, 10)) == 0)
+				max_threads = 1;
+			break;
+		case 'd':
+			duration_s = strtod(optarg, NULL);
+			break;
+		case 'h':
+			print_help(argv[0]);
+			exit(0);
+		default:
+			print_help(argv[0]);
+			exit(1);
+		}
+	}
+	if (max_threads > BENCH_MAX_THREADS)
+		max_threads = BENCH_MAX_THREADS;
+
+	if (session_store_init(&sessions, nr_sessions, 0x5eed, no_subnet, 0) < 0 ||
+		(virt_addrs = malloc(sizeof(*virt_addrs) * nr_sessions)) == NULL) {
+		fprintf(stderr, "*** Out of memory.\n");
+		exit(1);
+	}
+	memset(&real_addr, 0x0, sizeof(real_addr));
+	real_addr.in.sin_family = AF_INET;
+	for (i = 0; i < nr_sessions; i++) {
+		real_addr.in.sin_addr.s_addr = (i + 1) * 2654435761U;
+		real_addr.in.sin_port = htons(1024 + i % 60000);
+		virt_addrs[i].s_addr = (i + 1) * 0x9e3779b1U;
+		if ((s = session_new(&sessions, &real_addr)) == NULL ||
+			session_set_virt(&sessions, s, AF_INET, &virt_addrs[i]) < 0) {
+			fprintf(stderr, "*** Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	printf("{\n  \"sessions\": %u,\n  \"results\": [", nr_sessions);
+	for (i = 1; ; i *= 2) {
+		if (i > max_threads)
+			i = max_threads;
+		if (bench_threads(i, false) < 0 || bench_threads(i, true) < 0)
+			exit(1);
+		if (i == max_threads)
+			break;
+	}
+	printf("\n  ]\n}\n");
+
+	session_store_destroy(&sessions);
+	free(virt_addrs);
+	return 0;
+}
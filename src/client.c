@@ -19,6 +19,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include "event_loop.h"
 #include "minivtun.h"
 #include "client_route.h"
 
@@ -26,7 +27,22 @@
   #include "client_route.h"
 #endif
 
-static time_t last_recv = 0, last_keepalive = 0, current_ts = 0;
+static time_t last_recv = 0, current_ts = 0;
+/* Datagrams in a row that failed authentication, see AUTH_HINT_RUN. */
+static unsigned auth_failed = 0;
+static time_t auth_hinted = 0;
+
+/* Segments glued for the TUN device with '--offload'. */
+static struct tun_gro tun_gro;
+
+/* Packet buffers: the tunnel read slots and the decryption buffer. */
+static struct buf_pool pool;
+static struct minivtun_msg *nmsgs[NM_BATCH_MAX];
+static char *crypt_buffer;
+
+/* If the connected socket takes UDP GSO sends and gives GRO receives. */
+static bool sock_gso = false;
+static bool sock_gro = false;
 
 // This would be called by both network_receiving() and NE codes 
 struct minivtun_msg * _network_data_handler(char * data_buffer, size_t data_len, void * out_buffer, struct tun_pi * ppi)
@@ -39,16 +55,17 @@ struct minivtun_msg * _network_data_handler(char * data_buffer, size_t data_len,
 	// out_dlen = (size_t)rc;
 	out_dlen = data_len;
 	// netmsg_to_local(read_buffer, &out_data, &out_dlen);
-	netmsg_to_local(data_buffer, &out_data, &out_dlen);
-	nmsg = out_data;
-
-	if (out_dlen < MINIVTUN_MSG_BASIC_HLEN)
-		return 0;
-
-	/* Verify password. */
-	if (memcmp(nmsg->hdr.auth_key, config.crypto_key, 
-		sizeof(nmsg->hdr.auth_key)) != 0)
+	if (netmsg_to_local(data_buffer, &out_data, &out_dlen) != 0) {
+		if (++auth_failed >= AUTH_HINT_RUN && current_ts - auth_hinted >= AUTH_HINT_INTERVAL) {
+			auth_hinted = current_ts;
+			auth_failed = 0;
+			fprintf(stderr, "*** No datagram from the server passes authentication: "
+					"different key, or cipher type mismatch ('-t')?\n");
+		}
 		return 0;
+	}
+	auth_failed = 0;
+	nmsg = out_data;
 
 	last_recv = current_ts;
 
@@ -99,52 +116,77 @@ struct minivtun_msg * _network_data_handler(char * data_buffer, size_t data_len,
 
 #ifndef __APPLE_NETWORK_EXTENSION__
 
-// Handling packets received from Internet.
-static int network_receiving(int tunfd, int sockfd)
+// Take one datagram from the socket: 1 if done, 0 if there was none.
+static int network_receiving_one(int tunfd, int sockfd)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
+	/* Big enough for a coalesced run of datagrams (UDP GRO). */
+	static char read_buffer[UDP_GRO_BUFFER_SIZE];
+	union udp_gro_cmsg cm;
 	struct minivtun_msg *nmsg;
 	struct tun_pi pi;
 	// void *out_data;
 	// size_t ip_dlen, out_dlen;
-	struct sockaddr_in real_peer;
-	socklen_t real_peer_alen;
-	struct iovec iov[2];
+	struct sockaddr_inx real_peer;
+	struct iovec iov;
+	struct msghdr mh;
+	size_t rlen, seg, off, len;
 	int rc;
 
-	real_peer_alen = sizeof(real_peer);
-	rc = (int)recvfrom(sockfd, &read_buffer, NM_PI_BUFFER_SIZE, 0, (struct sockaddr *)&real_peer, &real_peer_alen);
+	iov.iov_base = read_buffer;
+	/* Whole, also from a server with a bigger '-m': dropped below. */
+	iov.iov_len = sizeof(read_buffer);
+	memset(&mh, 0x0, sizeof(mh));
+	mh.msg_name = &real_peer;
+	mh.msg_namelen = sizeof(real_peer);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (sock_gro) {
+		mh.msg_control = cm.buf;
+		mh.msg_controllen = sizeof(cm.buf);
+	}
+	rc = (int)recvmsg(sockfd, &mh, 0);
 
 #if DEBUG	
     printf("Read %d bytes from network\n", rc);
 #endif
 
-	if (rc <= 0)
-		return 0;
-
-	nmsg = _network_data_handler(read_buffer, rc, crypt_buffer, &pi);
+	if (rc < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+	if (rc == 0)
+		return 1;
+
+	/* Each datagram of a coalesced receive is handled on its own. */
+	rlen = (size_t)rc;
+	if ((seg = udp_gro_segment(&mh)) == 0 || seg > rlen)
+		seg = rlen;
+	for (off = 0; off < rlen; off += len) {
+		len = rlen - off < seg ? rlen - off : seg;
+		if (len > pool.size) {
+			fprintf(stderr, "*** Dropped a %zu-byte datagram, over the MTU.\n", len);
+			continue;
+		}
+		nmsg = _network_data_handler(read_buffer + off, len, crypt_buffer, &pi);
 
 #if DEBUG
-    if ( nmsg == 0 )
-	   printf("nmsg is NULL\n");
-	else
-	   dump_nmsg(nmsg);
+		if ( nmsg == 0 )
+		   printf("nmsg is NULL\n");
+		else
+		   dump_nmsg(nmsg);
 #endif	
 
-    if ( nmsg != 0 ) {
-  	    iov[0].iov_base = &pi;
-        iov[0].iov_len = sizeof(pi);
-    	iov[1].iov_base = (char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET;
-		iov[1].iov_len = ntohs(nmsg->ipdata.ip_dlen); // ip_dlen;
-		rc = (int)writev(tunfd, iov, 2);
+		if ( nmsg != 0 && config.tun_offload ) {
+			tun_gro_write(&tun_gro, tunfd, nmsg->ipdata.data, ntohs(nmsg->ipdata.ip_dlen));
+		} else if ( nmsg != 0 ) {
+			rc = (int)tun_write_ipdata(tunfd, nmsg, ntohs(nmsg->ipdata.ip_dlen));
 #if DEBUG
-        printf("write to tunnel. return %d\n", rc);
-		if ( rc < 0 )
-		   perror("writev");
+			printf("write to tunnel. return %d\n", rc);
+			if ( rc < 0 )
+			   perror("writev");
 #endif		
+		}
 	}
 
-	return 0;
+	return 1;
 //	out_data = crypt_buffer;
 //	out_dlen = (size_t)rc;
 //	netmsg_to_local(read_buffer, &out_data, &out_dlen);
@@ -196,114 +238,135 @@ static int network_receiving(int tunfd, int sockfd)
 //	return 0;
 }
 
-#endif // __APPLE_NETWORK_EXTENSION__
+// Handling packets received from Internet. Up to one batch each call,
+// EV_MORE if there may be more.
+static int network_receiving(int tunfd, int sockfd)
+{
+	unsigned i;
+	int rc = 0;
 
+	for (i = 0; i < config.batch_size; i++) {
+		if ((rc = network_receiving_one(tunfd, sockfd)) <= 0)
+			break;
+	}
 
-void _tunnel_data_handler(void * data_buffer, size_t data_len, uint16_t proto, void ** out_data, size_t * out_dlen)
-{
-	// char crypt_buffer[NM_PI_BUFFER_SIZE];
-	// void *out_data;
-	// size_t ip_dlen, out_dlen;
-	struct minivtun_msg nmsg;
-
-	nmsg.hdr.opcode = MINIVTUN_MSG_IPDATA;
-	memset(nmsg.hdr.rsv, 0x0, sizeof(nmsg.hdr.rsv));
-	memcpy(nmsg.hdr.auth_key, config.crypto_key, sizeof(nmsg.hdr.auth_key));
-	nmsg.ipdata.proto = htons(proto); // htons(get_ether_proto_from_pi(pi)); // pi->proto;
-	nmsg.ipdata.ip_dlen = htons(data_len); // htons(ip_dlen);
-	memcpy(nmsg.ipdata.data, data_buffer, data_len);
-	// nmsg.ipdata.ip_dlen = htons(ip_dlen);
-	// memcpy(nmsg.ipdata.data, pi + 1, ip_dlen);
-
-	/* Do encryption. */
-	// out_data = crypt_buffer;
-	// out_dlen = MINIVTUN_MSG_IPDATA_OFFSET + ip_dlen;
-	// local_to_netmsg(&nmsg, &out_data, &out_dlen);	
-	*out_dlen = MINIVTUN_MSG_IPDATA_OFFSET + data_len;
-	local_to_netmsg(&nmsg, out_data, out_dlen);
+	/* The batch is over, glued segments go out now. */
+	if (config.tun_offload)
+		tun_gro_flush(&tun_gro, tunfd);
+
+	if (i == config.batch_size)
+		return EV_MORE;
+	return i == 0 && rc == 0 ? EV_IDLE : rc;
 }
 
+#endif // __APPLE_NETWORK_EXTENSION__
 
-#ifndef __APPLE_NETWORK_EXTENSION__
 
-// Handling packets received from tunnel. That is, local applications send them to
-// outside.
-static int tunnel_receiving(int tunfd, int sockfd)
+/* Fill in an IPDATA message carrying 'data_len' bytes, returns its length. */
+static size_t tunnel_data_to_nmsg(void * data_buffer, size_t data_len, uint16_t proto, struct minivtun_msg * nmsg)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
-	struct tun_pi *pi = (void *)read_buffer;
-	// struct minivtun_msg nmsg;
-	void *out_data;
-	size_t ip_dlen, out_dlen;
-	int rc;
+	nmsg->hdr.opcode = MINIVTUN_MSG_IPDATA;
+	memset(nmsg->hdr.rsv, 0x0, sizeof(nmsg->hdr.rsv));
+	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
+	nmsg->ipdata.proto = htons(proto); // htons(get_ether_proto_from_pi(pi)); // pi->proto;
+	nmsg->ipdata.ip_dlen = htons(data_len); // htons(ip_dlen);
+	memcpy(nmsg->ipdata.data, data_buffer, data_len);
 
-	rc = (int)read(tunfd, pi, NM_PI_BUFFER_SIZE);
-	if (rc < sizeof(struct tun_pi))
-		return -1;
+	return MINIVTUN_MSG_IPDATA_OFFSET + data_len;
+}
 
-    //
-	ip_dlen = (size_t)rc - sizeof(struct tun_pi);
+void _tunnel_data_handler(void * data_buffer, size_t data_len, uint16_t proto, void ** out_data, size_t * out_dlen)
+{
+	struct minivtun_msg __nmsg;
+	/* Not encrypted: build it right in the output, '__nmsg' goes away on return. */
+	struct minivtun_msg *nmsg = enabled_encryption() ? &__nmsg : *out_data;
 
-	/* We only accept IPv4 or IPv6 frames. */
-	uint16_t proto = get_ether_proto_from_pi(pi);
+	*out_dlen = tunnel_data_to_nmsg(data_buffer, data_len, proto, nmsg);
+	local_to_netmsg(nmsg, out_data, out_dlen);
+}
 
-	if ( proto == ETH_P_IP ) {
-		if (ip_dlen < 20)
-			return 0;
-	} else if ( proto == ETH_P_IPV6 ) {
-		if (ip_dlen < 40)
-			return 0;
-	} else {
-		fprintf(stderr, "*** Invalid protocol: 0x%x.\n", proto);
-		return 0;
-	}
 
-//	nmsg.hdr.opcode = MINIVTUN_MSG_IPDATA;
-//	memset(nmsg.hdr.rsv, 0x0, sizeof(nmsg.hdr.rsv));
-//	memcpy(nmsg.hdr.auth_key, config.crypto_key, sizeof(nmsg.hdr.auth_key));
-//	nmsg.ipdata.proto = htons(get_ether_proto_from_pi(pi)); // pi->proto;
-//	nmsg.ipdata.ip_dlen = htons(ip_dlen);
-//	memcpy(nmsg.ipdata.data, pi + 1, ip_dlen);
+#ifndef __APPLE_NETWORK_EXTENSION__
 
-	/* Do encryption. */
-//	out_data = crypt_buffer;
-//	out_dlen = MINIVTUN_MSG_IPDATA_OFFSET + ip_dlen;
-//	local_to_netmsg(&nmsg, &out_data, &out_dlen);
+// Handling packets received from tunnel. That is, local applications send them to
+// outside. One burst each call, EV_MORE if there may be more.
+static int tunnel_receiving(int tunfd, int sockfd)
+{
+	static struct tun_offload tso;
+	struct crypto_datagram dg[NM_BATCH_MAX];
+	struct iovec iovs[NM_BATCH_MAX];
+	union udp_gso_cmsg cm;
+	struct msghdr mh;
+	unsigned n = 0, i, run;
+	ssize_t len = -1;
 
-    out_data = crypt_buffer;
+	/**
+	 * Packets are read in behind their message headers and encrypted
+	 * in place, a burst at a time: no copies on the way out.
+	 */
+	while (n < config.batch_size) {
+		if ((len = tun_read_to_nmsg(tunfd, config.tun_offload ? &tso : NULL,
+			nmsgs[n])) < 0)
+			break;
+		if (len == 0)
+			continue;
 
 #if DEBUG
-    printf("Read %d bytes from tunnel\n", rc);
+		printf("Read %zd bytes from tunnel\n", len);
 #endif
 
-    _tunnel_data_handler(pi+1, ip_dlen, proto, &out_data, &out_dlen);
+		dg[n].in = nmsgs[n];
+		dg[n].out = nmsgs[n];
+		dg[n].len = (size_t)len;
+		n++;
+	}
+
+	local_to_netmsg_batch(dg, n);
 
-	rc = (int)send(sockfd, out_data, out_dlen, 0);
+	for (i = 0; i < n; i++) {
+		iovs[i].iov_base = dg[i].out;
+		iovs[i].iov_len = dg[i].len;
 
 #if DEBUG
-    printf("tunnel -> network: %zu bytes. Write to network returned %d\n", out_dlen, rc);
-	for ( int i = 0; i < out_dlen; i++ )
-	    printf("0x%x, ", ((char *)out_data)[i]);
-	printf("\n");
+		printf("tunnel -> network: %zu bytes\n", dg[i].len);
+		hexdump(dg[i].out, dg[i].len);
 #endif	
+	}
 
+	/* One sendmsg() for each GSO run, or each datagram without GSO. */
+	for (i = 0; i < n; i += run) {
+		run = sock_gso ? udp_gso_run(&iovs[i], n - i) : 1;
+		memset(&mh, 0x0, sizeof(mh));
+		mh.msg_iov = &iovs[i];
+		mh.msg_iovlen = run;
+		if (run > 1)
+			udp_gso_set_segment(&mh, &cm, iovs[i].iov_len);
+		if (sendmsg(sockfd, &mh, 0) < 0 && run > 1 &&
+			(errno == EIO || errno == EINVAL)) {
+			fprintf(stderr, "*** UDP GSO send failed: %s, turned off.\n",
+					strerror(errno));
+			sock_gso = false;
+		}
+	}
 
 	/**
-	 * NOTICE: Don't update this on each tunnel packet
-	 * transmit. We always need to keep the local virtual IP
+	 * NOTICE: Don't restart the keep-alive timer on each tunnel
+	 * packet transmit. We always need to keep the local virtual IP
 	 * (-a local/...) alive.
 	 */
-	/* last_keepalive = current_ts; */
 
-	return 0;
+	if (len >= 0)
+		return EV_MORE;
+	return n ? 0 : EV_IDLE;
 }
 
 #endif // __APPLE_NETWORK_EXTENSION__
 
 void _keepalive_make(void ** out_msg, size_t * out_len)
 {
-	char in_data[64]; //, crypt_buffer[64];
-	struct minivtun_msg *nmsg = (struct minivtun_msg *)in_data;
+	struct minivtun_keepalive_msg in_data; //, crypt_buffer[64];
+	/* Not encrypted: build it right in the output, 'in_data' goes away on return. */
+	struct minivtun_keepalive_msg *nmsg = enabled_encryption() ? &in_data : *out_msg;
 
 	nmsg->hdr.opcode = MINIVTUN_MSG_KEEPALIVE;
 	memset(nmsg->hdr.rsv, 0x0, sizeof(nmsg->hdr.rsv));
@@ -323,7 +386,7 @@ void _keepalive_make(void ** out_msg, size_t * out_len)
 static int peer_keepalive(int sockfd)
 {
 	// char in_data[64], crypt_buffer[64];
-	char crypt_buffer[64];
+	char crypt_buffer[sizeof(struct minivtun_keepalive_msg)];
 	// struct minivtun_msg *nmsg = (struct minivtun_msg *)in_data;
 	void *out_msg;
 	size_t out_len;
@@ -344,11 +407,6 @@ static int peer_keepalive(int sockfd)
 	
 	rc = (int)send(sockfd, out_msg, out_len, 0);
 
-	/* Update 'last_keepalive' only when it's really sent out. */
-	if (rc > 0) {
-		last_keepalive = current_ts;
-	}
-
 	return rc;
 }
 
@@ -399,32 +457,110 @@ static int try_resolve_and_connect(const char *peer_addr_pair, struct sockaddr_i
 		return -EAGAIN;
 	}
 	set_nonblock(sockfd);
+	sock_gso = udp_gso_probe(sockfd);
+	sock_gro = udp_gro_enable(sockfd);
+	if (config.busy_poll_us && !socket_busy_poll(sockfd))
+		fprintf(stderr, "*** SO_BUSY_POLL failed: %s.\n", strerror(errno));
 
 	return sockfd;
 }
 
 
+static const char *peer_addr_pair_str;
+static struct ev_io sock_io, tun_io;
+static struct ev_timer keepalive_timer, reconnect_timer;
+
+static int on_sock_readable(struct ev_loop *loop, struct ev_io *io);
+
+static void client_reconnect(struct ev_loop *loop)
+{
+	struct sockaddr_inx peer_addr;
+	char s_peer_addr[50];
+	int sockfd;
+
+	/* Reopen the socket for a different local port. */
+	if (sock_io.fd >= 0) {
+		ev_io_del(loop, &sock_io);
+		close(sock_io.fd);
+		sock_io.fd = -1;
+	}
+	do {
+		if ((sockfd = try_resolve_and_connect(peer_addr_pair_str, &peer_addr)) < 0) {
+			fprintf(stderr, "Unable to connect to '%s', retrying.\n", peer_addr_pair_str);
+			sleep(5);
+		}
+	} while (sockfd < 0);
+
+	loop->now = ev_time();
+	current_ts = loop->now;
+	last_recv = current_ts;
+	if (ev_io_add(loop, &sock_io, sockfd, on_sock_readable, NULL) < 0) {
+		fprintf(stderr, "*** Cannot watch the socket: %s.\n", strerror(errno));
+		exit(1);
+	}
+	peer_keepalive(sockfd);
+
+	inet_ntop(peer_addr.sa.sa_family, addr_of_sockaddr(&peer_addr), s_peer_addr,
+			  sizeof(s_peer_addr));
+	printf("Reconnected to %s:%u.\n", s_peer_addr, ntohs(port_of_sockaddr(&peer_addr)));
+}
+
+static int on_sock_readable(struct ev_loop *loop, struct ev_io *io)
+{
+	int rc;
+
+	current_ts = loop->now;
+	rc = network_receiving(tun_io.fd, io->fd);
+	if (rc < 0) {
+		fprintf(stderr, "Connection went bad. About to reconnect.\n");
+		client_reconnect(loop);
+		return 0;
+	}
+	return rc;
+}
+
+static int on_tun_readable(struct ev_loop *loop, struct ev_io *io)
+{
+	current_ts = loop->now;
+	return tunnel_receiving(io->fd, sock_io.fd);
+}
+
+/* Packet transmission timed out, send keep-alive packet. */
+static void on_keepalive_timer(struct ev_loop *loop, struct ev_timer *timer)
+{
+	current_ts = loop->now;
+	if (sock_io.fd >= 0)
+		peer_keepalive(sock_io.fd);
+}
+
+/* Connection timed out (or never made), try reconnecting. */
+static void on_reconnect_timer(struct ev_loop *loop, struct ev_timer *timer)
+{
+	current_ts = loop->now;
+	if (sock_io.fd < 0 || current_ts - last_recv > config.reconnect_timeo)
+		client_reconnect(loop);
+}
+
 // The entry. Called from main() in minivtun.c directly after ifconfig interfaces
 //
 // @param peer_addr_pair:  <remote-host>:<port>
 int run_client(int tunfd, const char *peer_addr_pair)
 {
-	struct timeval timeo;
-	int sockfd = -1, rc;
-	fd_set rset;
+	struct ev_loop loop;
+	int sockfd = -1;
 	char s_peer_addr[50];
 	struct sockaddr_inx peer_addr;
+	unsigned i;
 
 	if ((sockfd = try_resolve_and_connect(peer_addr_pair, &peer_addr)) >= 0) {
 		/* DNS resolve OK, start service normally. */
-		last_recv = time(NULL);
 		inet_ntop(peer_addr.sa.sa_family, addr_of_sockaddr(&peer_addr),
 				  s_peer_addr, sizeof(s_peer_addr));
 		printf("Mini virtual tunnelling client to %s:%u, interface: %s, bind to address %s\n",
 				s_peer_addr, ntohs(port_of_sockaddr(&peer_addr)), config.devname, config.bind_to_addr);
 	} else if (sockfd == -EAGAIN && config.wait_dns) {
-		/* Resolve later (last_recv = 0). */
-		last_recv = 0;
+		/* Resolve later, on the first reconnect check. */
+		sockfd = -1;
 		printf("Mini virtual tunnelling client, interface: %s. \n", config.devname);
 		printf("WARNING: Connection to '%s' temporarily unavailable, "
 			   "to be tried later.\n", peer_addr_pair);
@@ -452,74 +588,41 @@ int run_client(int tunfd, const char *peer_addr_pair)
 		}
 	}
 
-	/* For triggering the first keep-alive packet to be sent. */
-	last_keepalive = 0;
+	/* Tunnel packets are taken in bursts until there are no more. */
+	set_nonblock(tunfd);
 
-	for (;;) {
-		FD_ZERO(&rset);
-		FD_SET(tunfd, &rset);
-		if (sockfd >= 0)
-			FD_SET(sockfd, &rset);
+	if (buf_pool_init(&pool, config.batch_size + 1, NM_BUFFER_SIZE, config.huge_pages) < 0) {
+		fprintf(stderr, "*** Cannot allocate packet buffers: %s.\n", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < config.batch_size; i++)
+		nmsgs[i] = buf_pool_get(&pool);
+	crypt_buffer = buf_pool_get(&pool);
+
+	peer_addr_pair_str = peer_addr_pair;
+	sock_io.fd = -1;
+	if (ev_loop_init(&loop) < 0 ||
+		ev_io_add(&loop, &tun_io, tunfd, on_tun_readable, NULL) < 0 ||
+		(sockfd >= 0 && ev_io_add(&loop, &sock_io, sockfd, on_sock_readable, NULL) < 0) ||
+		ev_timer_add(&loop, &keepalive_timer, (config.keepalive_timeo ? : 1) * 1000,
+			on_keepalive_timer, NULL) < 0 ||
+		ev_timer_add(&loop, &reconnect_timer, 1000, on_reconnect_timer, NULL) < 0) {
+		fprintf(stderr, "*** Cannot set up the event loop: %s.\n", strerror(errno));
+		return -1;
+	}
+	ev_loop_set_busy_poll(&loop, config.busy_poll_us);
+	current_ts = loop.now;
+	last_recv = current_ts;
 
-		timeo.tv_sec = 2;
-		timeo.tv_usec = 0;
+	/* The first keep-alive packet goes right away. */
+	if (sock_io.fd >= 0)
+		peer_keepalive(sock_io.fd);
 
-		rc = select((tunfd > sockfd ? tunfd : sockfd) + 1, &rset, NULL, NULL, &timeo);
-		if (rc < 0) {
-			fprintf(stderr, "*** select(): %s.\n", strerror(errno));
+	for (;;) {
+		if (ev_loop_run_once(&loop) < 0) {
+			fprintf(stderr, "*** epoll_wait(): %s.\n", strerror(errno));
 			return -1;
 		}
-
-		current_ts = time(NULL);
-		if (last_recv > current_ts)
-			last_recv = current_ts;
-		if (last_keepalive > current_ts)
-			last_keepalive = current_ts;
-
-		/* Packet transmission timed out, send keep-alive packet. */
-		if (current_ts - last_keepalive > config.keepalive_timeo) {
-			if (sockfd >= 0)
-				peer_keepalive(sockfd);
-		}
-
-		/* Connection timed out, try reconnecting. */
-		if (current_ts - last_recv > config.reconnect_timeo) {
-reconnect:
-			/* Reopen the socket for a different local port. */
-			if (sockfd >= 0)
-				close(sockfd);
-			do {
-				if ((sockfd = try_resolve_and_connect(peer_addr_pair, &peer_addr)) < 0) {
-					fprintf(stderr, "Unable to connect to '%s', retrying.\n", peer_addr_pair);
-					sleep(5);
-				}
-			} while (sockfd < 0);
-
-			last_keepalive = 0;
-			last_recv = current_ts;
-
-			inet_ntop(peer_addr.sa.sa_family, addr_of_sockaddr(&peer_addr), s_peer_addr,
-					  sizeof(s_peer_addr));
-			printf("Reconnected to %s:%u.\n", s_peer_addr, ntohs(port_of_sockaddr(&peer_addr)));
-			continue;
-		}
-
-		/* No result from select(), do nothing. */
-		if (rc == 0)
-			continue;
-
-		if (sockfd >= 0 && FD_ISSET(sockfd, &rset)) {
-			rc = network_receiving(tunfd, sockfd);
-			if (rc != 0) {
-				fprintf(stderr, "Connection went bad. About to reconnect.\n");
-				goto reconnect;
-			}
-		}
-
-		if (FD_ISSET(tunfd, &rset)) {
-			rc = tunnel_receiving(tunfd, sockfd);
-			assert(rc == 0);
-		}
 	}
 
 	return 0;
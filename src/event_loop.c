@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#ifdef __linux__
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
+#endif
+
+#include "event_loop.h"
+
+/* Max. events taken from one epoll_wait(). */
+#define EV_MAX_EVENTS  32
+
+time_t ev_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static uint64_t ev_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Spin instead of sleeping until 'idle_us' microseconds have passed
+ * without any handler finding work, 0 turns it off.
+ */
+void ev_loop_set_busy_poll(struct ev_loop *loop, unsigned idle_us)
+{
+	loop->busy_poll_us = idle_us;
+	loop->last_busy_us = ev_time_us();
+}
+
+static void ev_io_set_ready(struct ev_loop *loop, struct ev_io *io)
+{
+	if (!io->ready) {
+		io->ready = true;
+		list_add_tail(&io->ready_list, &loop->ready);
+	}
+}
+
+/**
+ * Call the handler of each ready fd once. The list is taken over first,
+ * a handler may add or remove fds (including its own) meanwhile.
+ */
+static void ev_dispatch(struct ev_loop *loop)
+{
+	struct list_head round;
+	struct ev_io *io;
+	bool busy = false;
+	int rc;
+
+	if (list_empty(&loop->ready))
+		return;
+	round.next = loop->ready.next;
+	round.prev = loop->ready.prev;
+	round.next->prev = &round;
+	round.prev->next = &round;
+	INIT_LIST_HEAD(&loop->ready);
+
+	while (!list_empty(&round)) {
+		io = list_first_entry(&round, struct ev_io, ready_list);
+		list_del(&io->ready_list);
+		io->ready = false;
+		if ((rc = io->handler(loop, io)) == EV_MORE)
+			ev_io_set_ready(loop, io);
+		if (rc != EV_IDLE)
+			busy = true;
+	}
+
+	if (busy && loop->busy_poll_us)
+		loop->last_busy_us = ev_time_us();
+}
+
+/**
+ * In a busy poll round every fd is tried. True if this is one: busy
+ * polling is on and its idle period hasn't run out.
+ */
+static bool ev_busy_poll_round(struct ev_loop *loop)
+{
+	struct ev_io *io;
+
+	if (loop->busy_poll_us == 0 ||
+		ev_time_us() - loop->last_busy_us >= loop->busy_poll_us)
+		return false;
+	list_for_each_entry (io, &loop->ios, list) {
+		if (io->spin)
+			ev_io_set_ready(loop, io);
+	}
+	return true;
+}
+
+#ifdef __linux__
+
+int ev_loop_init(struct ev_loop *loop)
+{
+	if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+	INIT_LIST_HEAD(&loop->ios);
+	INIT_LIST_HEAD(&loop->ready);
+	INIT_LIST_HEAD(&loop->timers);
+	loop->now = ev_time();
+	loop->busy_poll_us = 0;
+	return 0;
+}
+
+int ev_io_add(struct ev_loop *loop, struct ev_io *io, int fd,
+		ev_io_handler_t handler, void *data)
+{
+	struct epoll_event ev;
+
+	io->fd = fd;
+	io->handler = handler;
+	io->data = data;
+	io->ready = false;
+	io->spin = true;
+
+	memset(&ev, 0x0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = io;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+	list_add_tail(&io->list, &loop->ios);
+
+	/* Edge-triggered: whatever is queued already must be drained now. */
+	ev_io_set_ready(loop, io);
+	return 0;
+}
+
+void ev_io_del(struct ev_loop *loop, struct ev_io *io)
+{
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+	list_del(&io->list);
+	if (io->ready) {
+		list_del(&io->ready_list);
+		io->ready = false;
+	}
+}
+
+static int ev_timer_expired(struct ev_loop *loop, struct ev_io *io)
+{
+	struct ev_timer *timer = io->data;
+	uint64_t expirations;
+
+	/* Overruns are not caught up on, a late timer fires once. */
+	if (read(io->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return EV_IDLE;
+	timer->handler(loop, timer);
+	/* Not traffic, doesn't keep busy polling on. */
+	return EV_IDLE;
+}
+
+int ev_timer_add(struct ev_loop *loop, struct ev_timer *timer,
+		unsigned interval_ms, ev_timer_handler_t handler, void *data)
+{
+	struct itimerspec its;
+	int fd;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		return -1;
+
+	timer->interval_ms = interval_ms;
+	timer->handler = handler;
+	timer->data = data;
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0 ||
+		ev_io_add(loop, &timer->io, fd, ev_timer_expired, timer) < 0) {
+		close(fd);
+		return -1;
+	}
+	timer->io.spin = false;
+	list_add_tail(&timer->list, &loop->timers);
+	return 0;
+}
+
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *timer)
+{
+	ev_io_del(loop, &timer->io);
+	close(timer->io.fd);
+	list_del(&timer->list);
+}
+
+int ev_loop_run_once(struct ev_loop *loop)
+{
+	struct epoll_event events[EV_MAX_EVENTS];
+	int nfds, i;
+
+	/* Don't block while some fds still have work left, or when spinning. */
+	nfds = epoll_wait(loop->epfd, events, EV_MAX_EVENTS,
+			list_empty(&loop->ready) && !ev_busy_poll_round(loop) ? -1 : 0);
+	if (nfds < 0) {
+		if (errno != EINTR)
+			return -1;
+		nfds = 0;
+	}
+
+	loop->now = ev_time();
+
+	for (i = 0; i < nfds; i++)
+		ev_io_set_ready(loop, events[i].data.ptr);
+
+	ev_dispatch(loop);
+	return 0;
+}
+
+void ev_loop_close(struct ev_loop *loop)
+{
+	struct ev_timer *timer, *__timer;
+
+	list_for_each_entry_safe (timer, __timer, &loop->timers, list)
+		ev_timer_del(loop, timer);
+	close(loop->epfd);
+	loop->epfd = -1;
+}
+
+#else /* !__linux__ */
+
+/**
+ * select() fallback, level-triggered. Timers are kept as deadlines
+ * on the monotonic clock and fired from the loop itself.
+ */
+
+static void timespec_add_ms(struct timespec *ts, unsigned ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static long timespec_diff_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (long)(a->tv_sec - b->tv_sec) * 1000 +
+		(a->tv_nsec - b->tv_nsec) / 1000000L;
+}
+
+int ev_loop_init(struct ev_loop *loop)
+{
+	loop->epfd = -1;
+	INIT_LIST_HEAD(&loop->ios);
+	INIT_LIST_HEAD(&loop->ready);
+	INIT_LIST_HEAD(&loop->timers);
+	loop->now = ev_time();
+	loop->busy_poll_us = 0;
+	return 0;
+}
+
+int ev_io_add(struct ev_loop *loop, struct ev_io *io, int fd,
+		ev_io_handler_t handler, void *data)
+{
+	if (fd >= FD_SETSIZE)
+		return -1;
+	io->fd = fd;
+	io->handler = handler;
+	io->data = data;
+	io->ready = false;
+	io->spin = true;
+	list_add_tail(&io->list, &loop->ios);
+	ev_io_set_ready(loop, io);
+	return 0;
+}
+
+void ev_io_del(struct ev_loop *loop, struct ev_io *io)
+{
+	list_del(&io->list);
+	if (io->ready) {
+		list_del(&io->ready_list);
+		io->ready = false;
+	}
+}
+
+int ev_timer_add(struct ev_loop *loop, struct ev_timer *timer,
+		unsigned interval_ms, ev_timer_handler_t handler, void *data)
+{
+	timer->interval_ms = interval_ms;
+	timer->handler = handler;
+	timer->data = data;
+	clock_gettime(CLOCK_MONOTONIC, &timer->expiry);
+	timespec_add_ms(&timer->expiry, interval_ms);
+	list_add_tail(&timer->list, &loop->timers);
+	return 0;
+}
+
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *timer)
+{
+	list_del(&timer->list);
+}
+
+int ev_loop_run_once(struct ev_loop *loop)
+{
+	struct ev_timer *timer, *__timer;
+	struct ev_io *io;
+	struct timespec now;
+	struct timeval timeo, *ptimeo = NULL;
+	long wait_ms = -1, ms;
+	fd_set rset;
+	int maxfd = -1, rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	list_for_each_entry (timer, &loop->timers, list) {
+		ms = timespec_diff_ms(&timer->expiry, &now);
+		if (ms < 0)
+			ms = 0;
+		if (wait_ms < 0 || ms < wait_ms)
+			wait_ms = ms;
+	}
+	if (!list_empty(&loop->ready) || ev_busy_poll_round(loop))
+		wait_ms = 0;
+	if (wait_ms >= 0) {
+		timeo.tv_sec = wait_ms / 1000;
+		timeo.tv_usec = (wait_ms % 1000) * 1000;
+		ptimeo = &timeo;
+	}
+
+	FD_ZERO(&rset);
+	list_for_each_entry (io, &loop->ios, list) {
+		FD_SET(io->fd, &rset);
+		if (io->fd > maxfd)
+			maxfd = io->fd;
+	}
+
+	rc = select(maxfd + 1, &rset, NULL, NULL, ptimeo);
+	if (rc < 0) {
+		if (errno != EINTR)
+			return -1;
+		FD_ZERO(&rset);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	loop->now = now.tv_sec;
+
+	list_for_each_entry (io, &loop->ios, list) {
+		if (FD_ISSET(io->fd, &rset))
+			ev_io_set_ready(loop, io);
+	}
+
+	list_for_each_entry_safe (timer, __timer, &loop->timers, list) {
+		if (timespec_diff_ms(&timer->expiry, &now) > 0)
+			continue;
+		/* A late timer fires once, then goes on from now. */
+		timer->expiry = now;
+		timespec_add_ms(&timer->expiry, timer->interval_ms);
+		timer->handler(loop, timer);
+	}
+
+	ev_dispatch(loop);
+	return 0;
+}
+
+void ev_loop_close(struct ev_loop *loop)
+{
+	INIT_LIST_HEAD(&loop->timers);
+}
+
+#endif /* __linux__ */
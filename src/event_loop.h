@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "list.h"
+#include "library.h"
+
+/**
+ * Event loop shared by the server and the client: edge-triggered epoll
+ * with timerfd timers on Linux, select() and a monotonic clock anywhere
+ * else.
+ *
+ * An fd that turns readable is put on a ready list and its handler gets
+ * called once per round. The handler processes at most one budget of
+ * work (e.g. one batch of packets) and returns EV_MORE if it stopped
+ * before seeing EAGAIN, which keeps the fd on the ready list for the
+ * next round; fds are served in turn this way. Any other return value
+ * takes it off the list until it becomes readable again.
+ *
+ * With busy polling the loop doesn't sleep while there is traffic: in
+ * each round every fd (timers aside) gets its handler called for a
+ * non-blocking read, and the loop only blocks again once none of them
+ * found anything to do ('EV_IDLE') for the idle period given.
+ */
+
+#define EV_MORE  1
+/* Nothing was there to be done, see ev_loop_set_busy_poll(). */
+#define EV_IDLE  2
+
+struct ev_loop;
+struct ev_io;
+struct ev_timer;
+
+typedef int (*ev_io_handler_t)(struct ev_loop *loop, struct ev_io *io);
+typedef void (*ev_timer_handler_t)(struct ev_loop *loop, struct ev_timer *timer);
+
+struct ev_io {
+	int fd;
+	ev_io_handler_t handler;
+	void *data;
+	bool ready;
+	bool spin;                /* polled in busy poll rounds */
+	struct list_head list;
+	struct list_head ready_list;
+};
+
+struct ev_timer {
+	struct ev_io io;          /* the timerfd, not used by the fallback */
+	unsigned interval_ms;
+	ev_timer_handler_t handler;
+	void *data;
+	struct timespec expiry;   /* for the fallback only */
+	struct list_head list;
+};
+
+struct ev_loop {
+	int epfd;
+	struct list_head ios;
+	struct list_head ready;
+	struct list_head timers;
+	/* Monotonic seconds, updated once in each round. */
+	time_t now;
+	/* Busy poll idle period, 0 if off, and the last round with work done. */
+	unsigned busy_poll_us;
+	uint64_t last_busy_us;
+};
+
+int ev_loop_init(struct ev_loop *loop);
+void ev_loop_close(struct ev_loop *loop);
+int ev_io_add(struct ev_loop *loop, struct ev_io *io, int fd,
+		ev_io_handler_t handler, void *data);
+void ev_io_del(struct ev_loop *loop, struct ev_io *io);
+int ev_timer_add(struct ev_loop *loop, struct ev_timer *timer,
+		unsigned interval_ms, ev_timer_handler_t handler, void *data);
+void ev_timer_del(struct ev_loop *loop, struct ev_timer *timer);
+void ev_loop_set_busy_poll(struct ev_loop *loop, unsigned idle_us);
+int ev_loop_run_once(struct ev_loop *loop);
+time_t ev_time(void);
+
+#endif /* __EVENT_LOOP_H */
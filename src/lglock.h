@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __LGLOCK_H
+#define __LGLOCK_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "library.h"
+
+/**
+ * Local/global lock, for tables that a few threads look things up in
+ * all the time and that seldom change: each thread has a lock of its
+ * own (on a cache line of its own) that it takes to read, so readers
+ * never wait on one another, nor bounce a line between them; a writer
+ * takes the locks of all of them, always in the same order.
+ */
+struct lglock_slot {
+	pthread_mutex_t lock;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct lglock {
+	struct lglock_slot *slots;
+	unsigned nr;
+};
+
+/* For 'nr' readers, known by the numbers 0..nr-1. */
+static inline int lglock_init(struct lglock *lg, unsigned nr)
+{
+	unsigned i;
+	int rc;
+
+	if ((rc = posix_memalign((void **)&lg->slots, CACHE_LINE_SIZE,
+			sizeof(*lg->slots) * nr))) {
+		errno = rc;
+		return -1;
+	}
+	for (i = 0; i < nr; i++)
+		pthread_mutex_init(&lg->slots[i].lock, NULL);
+	lg->nr = nr;
+	return 0;
+}
+
+static inline void lglock_destroy(struct lglock *lg)
+{
+	unsigned i;
+
+	for (i = 0; i < lg->nr; i++)
+		pthread_mutex_destroy(&lg->slots[i].lock);
+	free(lg->slots);
+	lg->slots = NULL;
+	lg->nr = 0;
+}
+
+static inline void lg_local_lock(struct lglock *lg, unsigned i)
+{
+	pthread_mutex_lock(&lg->slots[i].lock);
+}
+
+static inline void lg_local_unlock(struct lglock *lg, unsigned i)
+{
+	pthread_mutex_unlock(&lg->slots[i].lock);
+}
+
+/* Not to be taken while holding a local one. */
+static inline void lg_global_lock(struct lglock *lg)
+{
+	unsigned i;
+
+	for (i = 0; i < lg->nr; i++)
+		pthread_mutex_lock(&lg->slots[i].lock);
+}
+
+static inline void lg_global_unlock(struct lglock *lg)
+{
+	unsigned i;
+
+	for (i = lg->nr; i > 0; i--)
+		pthread_mutex_unlock(&lg->slots[i - 1].lock);
+}
+
+#endif /* __LGLOCK_H */
@@ -14,9 +14,13 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
 #include <openssl/evp.h>
 #include <openssl/md5.h>
+#include <openssl/rand.h>
+#include <openssl/objects.h>
 #include <sys/types.h>
 #include <netdb.h>
 
@@ -28,6 +32,12 @@ struct name_cipher_pair cipher_pairs[] = {
 	{ "des", EVP_des_cbc, },
 	{ "desx", EVP_desx_cbc, },
 	{ "rc4", EVP_rc4, },
+	{ "aes-128-gcm", EVP_aes_128_gcm, },
+	{ "aes-256-gcm", EVP_aes_256_gcm, },
+#if !defined(OPENSSL_NO_CHACHA) && !defined(OPENSSL_NO_POLY1305) && \
+	OPENSSL_VERSION_NUMBER >= 0x10100000L
+	{ "chacha20-poly1305", EVP_chacha20_poly1305, },
+#endif
 	{ NULL, NULL, },
 };
 
@@ -69,50 +79,420 @@ static const char crypto_ivec_initdata[CRYPTO_MAX_BLOCK_SIZE] = {
 		} \
 	} while(0)
 
-void datagram_encrypt(const void *key, const void *cptype, void *in,
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
+
+/**
+ * Multi-buffer AES-CBC encryption with AES-NI.
+ * CBC encryption is serial within a datagram, each block waiting for the
+ * previous one to leave the AES pipeline. Interleaving the blocks of
+ * AESNI_LANES independent datagrams keeps the pipeline full instead.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_LANES  8
+#define AESNI_EACH_LANE(op)  op(0) op(1) op(2) op(3) op(4) op(5) op(6) op(7)
+
+struct aesni_key {
+	__m128i rk[15];
+	int rounds;
+};
+
+static bool cpu_has_aesni(void)
+{
+	unsigned a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return false;
+	return (c & bit_AES) && (d & bit_SSE2);
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i aes128_key_assist(__m128i t1, __m128i t2)
+{
+	__m128i t3;
+
+	t2 = _mm_shuffle_epi32(t2, 0xff);
+	t3 = _mm_slli_si128(t1, 0x4);
+	t1 = _mm_xor_si128(t1, t3);
+	t3 = _mm_slli_si128(t3, 0x4);
+	t1 = _mm_xor_si128(t1, t3);
+	t3 = _mm_slli_si128(t3, 0x4);
+	t1 = _mm_xor_si128(t1, t3);
+	return _mm_xor_si128(t1, t2);
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i aes256_key_assist_2(__m128i t1, __m128i t3)
+{
+	__m128i t2, t4;
+
+	t4 = _mm_aeskeygenassist_si128(t1, 0x0);
+	t2 = _mm_shuffle_epi32(t4, 0xaa);
+	t4 = _mm_slli_si128(t3, 0x4);
+	t3 = _mm_xor_si128(t3, t4);
+	t4 = _mm_slli_si128(t4, 0x4);
+	t3 = _mm_xor_si128(t3, t4);
+	t4 = _mm_slli_si128(t4, 0x4);
+	t3 = _mm_xor_si128(t3, t4);
+	return _mm_xor_si128(t3, t2);
+}
+
+__attribute__((target("aes,sse2")))
+static void aesni_expand_key(struct aesni_key *k, const void *key, int bits)
+{
+	__m128i *rk = k->rk;
+
+#define AES128_ROUND_KEY(i, rcon) \
+	rk[i] = aes128_key_assist(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+#define AES256_ROUND_KEYS(i, rcon) \
+	do { \
+		rk[i] = aes128_key_assist(rk[i - 2], _mm_aeskeygenassist_si128(rk[i - 1], rcon)); \
+		if (i + 1 < 15) \
+			rk[i + 1] = aes256_key_assist_2(rk[i], rk[i - 1]); \
+	} while (0)
+
+	if (bits == 128) {
+		k->rounds = 10;
+		rk[0] = _mm_loadu_si128((const __m128i *)key);
+		AES128_ROUND_KEY(1, 0x01);
+		AES128_ROUND_KEY(2, 0x02);
+		AES128_ROUND_KEY(3, 0x04);
+		AES128_ROUND_KEY(4, 0x08);
+		AES128_ROUND_KEY(5, 0x10);
+		AES128_ROUND_KEY(6, 0x20);
+		AES128_ROUND_KEY(7, 0x40);
+		AES128_ROUND_KEY(8, 0x80);
+		AES128_ROUND_KEY(9, 0x1b);
+		AES128_ROUND_KEY(10, 0x36);
+	} else {
+		k->rounds = 14;
+		rk[0] = _mm_loadu_si128((const __m128i *)key);
+		rk[1] = _mm_loadu_si128((const __m128i *)key + 1);
+		AES256_ROUND_KEYS(2, 0x01);
+		AES256_ROUND_KEYS(4, 0x02);
+		AES256_ROUND_KEYS(6, 0x04);
+		AES256_ROUND_KEYS(8, 0x08);
+		AES256_ROUND_KEYS(10, 0x10);
+		AES256_ROUND_KEYS(12, 0x20);
+		AES256_ROUND_KEYS(14, 0x40);
+	}
+
+#undef AES128_ROUND_KEY
+#undef AES256_ROUND_KEYS
+}
+
+/**
+ * Encrypt 'n' padded datagrams with CBC, all starting from 'iv'.
+ * Each lane carries one datagram; a finished lane picks up the next one.
+ * Idle lanes spin on a scratch block so that the round loop stays
+ * branch-free.
+ */
+__attribute__((target("aes,sse2")))
+static void aesni_cbc_encrypt_mb(const struct aesni_key *k,
+		struct crypto_datagram *dg, unsigned n, const void *iv)
+{
+	const __m128i *in[AESNI_LANES];
+	__m128i *out[AESNI_LANES], st[AESNI_LANES], scratch[AESNI_LANES];
+	size_t left[AESNI_LANES];
+	__m128i iv0 = _mm_loadu_si128((const __m128i *)iv);
+	unsigned next = 0, busy = 0, l;
+	int r;
+
+	/* Idle lanes run over zeros, not over whatever was on the stack. */
+	for (l = 0; l < AESNI_LANES; l++) {
+		left[l] = 0;
+		st[l] = _mm_setzero_si128();
+		scratch[l] = _mm_setzero_si128();
+	}
+
+	for (;;) {
+		size_t step = (size_t)-1;
+
+		/* Feed idle lanes with pending datagrams. */
+		for (l = 0; l < AESNI_LANES; l++) {
+			if (left[l] == 0 && next < n) {
+				in[l] = dg[next].in;
+				out[l] = dg[next].out;
+				left[l] = dg[next].len / 16;
+				st[l] = iv0;
+				next++;
+				if (left[l])
+					busy++;
+			}
+			if (left[l] == 0) {
+				in[l] = &scratch[l];
+				out[l] = &scratch[l];
+			} else if (left[l] < step) {
+				step = left[l];
+			}
+		}
+		if (busy == 0) {
+			if (next < n)
+				continue;
+			break;
+		}
+
+		/* All busy lanes have at least 'step' blocks to go. */
+		for (; step > 0; step--) {
+			__m128i rk;
+
+#define LANE_WHITEN(l)  st[l] = _mm_xor_si128(_mm_xor_si128( \
+				_mm_loadu_si128(in[l]), st[l]), rk);
+#define LANE_ENC(l)  st[l] = _mm_aesenc_si128(st[l], rk);
+#define LANE_ENCLAST(l)  st[l] = _mm_aesenclast_si128(st[l], rk);
+			/* Unrolled by hand to keep all lanes in registers. */
+			rk = k->rk[0];
+			AESNI_EACH_LANE(LANE_WHITEN)
+			for (r = 1; r < k->rounds; r++) {
+				rk = k->rk[r];
+				AESNI_EACH_LANE(LANE_ENC)
+			}
+			rk = k->rk[k->rounds];
+			AESNI_EACH_LANE(LANE_ENCLAST)
+#undef LANE_WHITEN
+#undef LANE_ENC
+#undef LANE_ENCLAST
+
+			for (l = 0; l < AESNI_LANES; l++) {
+				_mm_storeu_si128(out[l], st[l]);
+				if (left[l]) {
+					in[l]++;
+					out[l]++;
+					if (--left[l] == 0)
+						busy--;
+				}
+			}
+		}
+	}
+}
+
+static void *aesni_key_new(const EVP_CIPHER *cipher, const void *key)
+{
+	struct aesni_key *k;
+	int bits;
+
+	switch (EVP_CIPHER_nid(cipher)) {
+	case NID_aes_128_cbc:
+		bits = 128;
+		break;
+	case NID_aes_256_cbc:
+		bits = 256;
+		break;
+	default:
+		return NULL;
+	}
+	if (!cpu_has_aesni())
+		return NULL;
+	if (posix_memalign((void **)&k, 16, sizeof(*k)) != 0)
+		return NULL;
+	aesni_expand_key(k, key, bits);
+	return k;
+}
+
+#else
+
+static void *aesni_key_new(const EVP_CIPHER *cipher, const void *key)
+{
+	return NULL;
+}
+
+#endif
+
+int crypto_context_init(struct crypto_context *cc, const void *key,
+		const void *cptype, bool encrypt)
+{
+	const EVP_CIPHER *cipher = cptype;
+	size_t iv_len = EVP_CIPHER_iv_length(cipher);
+
+	cc->cptype = cptype;
+	cc->key = key;
+	cc->pad_size = iv_len ? iv_len : 16;
+	cc->rekey = (EVP_CIPHER_mode(cipher) == EVP_CIPH_STREAM_CIPHER);
+	cc->aead = !!(EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER);
+
+	/* Random nonce base, so that peers sharing the key never collide. */
+	if (cc->aead && RAND_bytes(cc->nonce, sizeof(cc->nonce)) != 1)
+		return -EIO;
+
+	if ((cc->ctx = EVP_CIPHER_CTX_new()) == NULL)
+		return -ENOMEM;
+	if (!EVP_CipherInit_ex(cc->ctx, cipher, NULL, key,
+		(const unsigned char *)crypto_ivec_initdata, encrypt ? 1 : 0)) {
+		/* Cipher not provided by the loaded crypto library. */
+		EVP_CIPHER_CTX_free(cc->ctx);
+		cc->ctx = NULL;
+		return -EINVAL;
+	}
+	EVP_CIPHER_CTX_set_padding(cc->ctx, 0);
+
+	/* CBC decryption already runs in parallel within OpenSSL. */
+	cc->mb_key = encrypt ? aesni_key_new(cipher, key) : NULL;
+
+	return 0;
+}
+
+void crypto_context_cleanup(struct crypto_context *cc)
+{
+	if (cc->ctx) {
+		EVP_CIPHER_CTX_free(cc->ctx);
+		cc->ctx = NULL;
+	}
+	free(cc->mb_key);
+	cc->mb_key = NULL;
+}
+
+/**
+ * AEAD datagram: nonce (12 bytes) | ciphertext | tag (16 bytes).
+ * The nonce is the random base with the low 64 bits counting up.
+ */
+static void datagram_seal(struct crypto_context *cc, void *in,
+		void *out, size_t *dlen)
+{
+	unsigned char *nonce = out, *ct = nonce + CRYPTO_AEAD_NONCE_LEN;
+	int outl = 0, outl2 = 0, i;
+
+	for (i = CRYPTO_AEAD_NONCE_LEN - 1; i >= CRYPTO_AEAD_NONCE_LEN - 8; i--) {
+		if (++cc->nonce[i])
+			break;
+	}
+	memcpy(nonce, cc->nonce, CRYPTO_AEAD_NONCE_LEN);
+
+	assert(EVP_EncryptInit_ex(cc->ctx, NULL, NULL, NULL, nonce));
+	assert(EVP_EncryptUpdate(cc->ctx, ct, &outl, in, (int)*dlen));
+	assert(EVP_EncryptFinal_ex(cc->ctx, ct + outl, &outl2));
+	outl += outl2;
+	assert(EVP_CIPHER_CTX_ctrl(cc->ctx, EVP_CTRL_AEAD_GET_TAG,
+		CRYPTO_AEAD_TAG_LEN, ct + outl));
+
+	*dlen = CRYPTO_AEAD_NONCE_LEN + (size_t)outl + CRYPTO_AEAD_TAG_LEN;
+}
+
+static int datagram_open(struct crypto_context *cc, void *in,
+		void *out, size_t *dlen)
+{
+	unsigned char *nonce = in, *ct = nonce + CRYPTO_AEAD_NONCE_LEN;
+	int ct_len, outl = 0, outl2 = 0;
+
+	if (*dlen < CRYPTO_AEAD_OVERHEAD)
+		return -1;
+	ct_len = (int)(*dlen - CRYPTO_AEAD_OVERHEAD);
+
+	if (!EVP_DecryptInit_ex(cc->ctx, NULL, NULL, NULL, nonce) ||
+		!EVP_DecryptUpdate(cc->ctx, out, &outl, ct, ct_len) ||
+		!EVP_CIPHER_CTX_ctrl(cc->ctx, EVP_CTRL_AEAD_SET_TAG,
+			CRYPTO_AEAD_TAG_LEN, ct + ct_len) ||
+		EVP_DecryptFinal_ex(cc->ctx, (unsigned char *)out + outl, &outl2) <= 0)
+		return -1;
+
+	*dlen = (size_t)(outl + outl2);
+	return 0;
+}
+
+void datagram_encrypt(struct crypto_context *cc, void *in,
 		void *out, size_t *dlen)
 {
-	size_t iv_len = EVP_CIPHER_iv_length((const EVP_CIPHER *)cptype);
-	EVP_CIPHER_CTX * ctx;
-	unsigned char iv[CRYPTO_MAX_KEY_SIZE];
 	int outl = 0, outl2 = 0;
 
-	if (iv_len == 0)
-		iv_len = 16;
+	if (cc->aead) {
+		datagram_seal(cc, in, out, dlen);
+		return;
+	}
 
-	memcpy(iv, crypto_ivec_initdata, iv_len);
-	CRYPTO_DATA_PADDING(in, dlen, iv_len);
-	ctx = EVP_CIPHER_CTX_new();
-	assert(EVP_EncryptInit_ex(ctx, cptype, NULL, key, iv));
-	EVP_CIPHER_CTX_set_padding(ctx, 0);
-	assert(EVP_EncryptUpdate(ctx, out, &outl, in, (int)*dlen));
-	assert(EVP_EncryptFinal_ex(ctx, (unsigned char *)out + outl, &outl2));
-	EVP_CIPHER_CTX_free(ctx);
+	CRYPTO_DATA_PADDING(in, dlen, cc->pad_size);
+	/* Only reset the chaining state, the key schedule is kept. */
+	assert(EVP_EncryptInit_ex(cc->ctx, NULL, NULL, cc->rekey ? cc->key : NULL,
+		(const unsigned char *)crypto_ivec_initdata));
+	assert(EVP_EncryptUpdate(cc->ctx, out, &outl, in, (int)*dlen));
+	assert(EVP_EncryptFinal_ex(cc->ctx, (unsigned char *)out + outl, &outl2));
 
 	*dlen = (size_t)(outl + outl2);
 }
 
-void datagram_decrypt(const void *key, const void *cptype, void *in,
+/* Returns -1 if the datagram fails authentication (AEAD only). */
+int datagram_decrypt(struct crypto_context *cc, void *in,
 		void *out, size_t *dlen)
 {
-	size_t iv_len = EVP_CIPHER_iv_length((const EVP_CIPHER *)cptype);
-	EVP_CIPHER_CTX * ctx;
-	unsigned char iv[CRYPTO_MAX_KEY_SIZE];
 	int outl = 0, outl2 = 0;
 
-	if (iv_len == 0)
-		iv_len = 16;
+	if (cc->aead)
+		return datagram_open(cc, in, out, dlen);
 
-	memcpy(iv, crypto_ivec_initdata, iv_len);
-	CRYPTO_DATA_PADDING(in, dlen, iv_len);
-	ctx = EVP_CIPHER_CTX_new();
-	assert(EVP_DecryptInit_ex(ctx, cptype, NULL, key, iv));
-	EVP_CIPHER_CTX_set_padding(ctx, 0);
-	assert(EVP_DecryptUpdate(ctx, out, &outl, in, (int)*dlen));
-	assert(EVP_DecryptFinal_ex(ctx, (unsigned char *)out + outl, &outl2));
-	EVP_CIPHER_CTX_free(ctx);
+	CRYPTO_DATA_PADDING(in, dlen, cc->pad_size);
+	assert(EVP_DecryptInit_ex(cc->ctx, NULL, NULL, cc->rekey ? cc->key : NULL,
+		(const unsigned char *)crypto_ivec_initdata));
+	assert(EVP_DecryptUpdate(cc->ctx, out, &outl, in, (int)*dlen));
+	assert(EVP_DecryptFinal_ex(cc->ctx, (unsigned char *)out + outl, &outl2));
 
 	*dlen = (size_t)(outl + outl2);
+	return 0;
+}
+
+/**
+ * Decrypt only the leading blocks covering 'hlen' bytes, so that a header
+ * can be verified before paying for the whole datagram. Returns the number
+ * of bytes decrypted; datagram_decrypt_finish() continues from there with
+ * the chaining state kept in the context. Not for AEAD ciphers.
+ */
+size_t datagram_decrypt_head(struct crypto_context *cc, void *in,
+		void *out, size_t *dlen, size_t hlen)
+{
+	size_t head_len = (hlen + cc->pad_size - 1) / cc->pad_size * cc->pad_size;
+	int outl = 0;
+
+	CRYPTO_DATA_PADDING(in, dlen, cc->pad_size);
+	if (head_len > *dlen)
+		head_len = *dlen;
+
+	assert(EVP_DecryptInit_ex(cc->ctx, NULL, NULL, cc->rekey ? cc->key : NULL,
+		(const unsigned char *)crypto_ivec_initdata));
+	assert(EVP_DecryptUpdate(cc->ctx, out, &outl, in, (int)head_len));
+
+	return (size_t)outl;
+}
+
+void datagram_decrypt_finish(struct crypto_context *cc, void *in,
+		void *out, size_t *dlen, size_t done)
+{
+	int outl = 0, outl2 = 0;
+
+	assert(EVP_DecryptUpdate(cc->ctx, (unsigned char *)out + done, &outl,
+		(unsigned char *)in + done, (int)(*dlen - done)));
+	assert(EVP_DecryptFinal_ex(cc->ctx, (unsigned char *)out + done + outl, &outl2));
+
+	*dlen = done + (size_t)(outl + outl2);
+}
+
+/**
+ * Encrypt a burst of independent datagrams. Equivalent to calling
+ * datagram_encrypt() on each, but AES-CBC runs them interleaved.
+ */
+void datagram_encrypt_batch(struct crypto_context *cc,
+		struct crypto_datagram *dg, unsigned n)
+{
+	unsigned i;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (cc->mb_key && n > 1) {
+		for (i = 0; i < n; i++)
+			CRYPTO_DATA_PADDING(dg[i].in, &dg[i].len, cc->pad_size);
+		aesni_cbc_encrypt_mb(cc->mb_key, dg, n, crypto_ivec_initdata);
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+		datagram_encrypt(cc, dg[i].in, dg[i].out, &dg[i].len);
+}
+
+void datagram_decrypt_batch(struct crypto_context *cc,
+		struct crypto_datagram *dg, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		dg[i].rc = datagram_decrypt(cc, dg[i].in, dg[i].out, &dg[i].len);
 }
 
 void fill_with_string_md5sum(const char *in, void *out, size_t outlen)
@@ -195,6 +575,218 @@ int get_sockaddr_inx_pair(const char *pair, struct sockaddr_inx *sa)
 	return 0;
 }
 
+#ifndef __linux__
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags, struct timespec *timeout)
+{
+	unsigned int i;
+	ssize_t rc;
+
+	for (i = 0; i < vlen; i++) {
+		if ((rc = recvmsg(sockfd, &msgvec[i].msg_hdr, flags)) < 0)
+			break;
+		msgvec[i].msg_len = (unsigned int)rc;
+	}
+	return i > 0 ? (int)i : -1;
+}
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	unsigned int i;
+	ssize_t rc;
+
+	for (i = 0; i < vlen; i++) {
+		if ((rc = sendmsg(sockfd, &msgvec[i].msg_hdr, flags)) < 0)
+			break;
+		msgvec[i].msg_len = (unsigned int)rc;
+	}
+	return i > 0 ? (int)i : -1;
+}
+#endif
+
+/* If the socket can send with UDP_SEGMENT. */
+bool udp_gso_probe(int sockfd)
+{
+#ifdef UDP_SEGMENT
+	/* Size 0 turns GSO off by default, only the cmsg enables it. */
+	int gso_size = 0;
+	return setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
+#else
+	return false;
+#endif
+}
+
+/* How many of the leading datagrams in 'iov' make one GSO send. */
+unsigned udp_gso_run(const struct iovec *iov, unsigned n)
+{
+	size_t size, total;
+	unsigned i;
+
+	if (n == 0)
+		return 0;
+	size = total = iov[0].iov_len;
+	for (i = 1; i < n && i < UDP_GSO_MAX_SEGS; i++) {
+		if (iov[i].iov_len > size || total + iov[i].iov_len > UDP_GSO_MAX_BYTES)
+			break;
+		total += iov[i].iov_len;
+		/* A shorter one ends the run. */
+		if (iov[i].iov_len < size)
+			return i + 1;
+	}
+	return i;
+}
+
+void udp_gso_set_segment(struct msghdr *mh, union udp_gso_cmsg *cm, size_t gso_size)
+{
+#ifdef UDP_SEGMENT
+	struct cmsghdr *cmsg;
+	uint16_t size = (uint16_t)gso_size;
+
+	mh->msg_control = cm->buf;
+	mh->msg_controllen = sizeof(cm->buf);
+	cmsg = CMSG_FIRSTHDR(mh);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+	memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+#endif
+}
+
+/* Ask for coalesced receives, false if the kernel can't do them. */
+bool udp_gro_enable(int sockfd)
+{
+#ifdef UDP_GRO
+	int on = 1;
+	return setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Segment size of a coalesced receive, taken from the cmsg in 'mh';
+ * 0 if it is a plain datagram.
+ */
+size_t udp_gro_segment(struct msghdr *mh)
+{
+#ifdef UDP_GRO
+	struct cmsghdr *cmsg;
+	int size;
+
+	if (mh->msg_controllen == 0)
+		return 0;
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+			return size > 0 ? (size_t)size : 0;
+		}
+	}
+#endif
+	return 0;
+}
+
+bool socket_busy_poll(int sockfd)
+{
+#ifdef SO_BUSY_POLL
+	int usecs = SOCKET_BUSY_POLL_US;
+  #ifdef SO_PREFER_BUSY_POLL
+	int on = 1;
+	/* Only a hint, older kernels don't have it. */
+	setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+  #endif
+	return setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0;
+#else
+	errno = ENOTSUP;
+	return false;
+#endif
+}
+
+int buf_pool_init(struct buf_pool *bp, unsigned nr, size_t size, bool huge)
+{
+	unsigned i;
+
+	memset(bp, 0x0, sizeof(*bp));
+	bp->size = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+	bp->map_len = bp->size * nr;
+	bp->base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (huge) {
+		/* Whole huge pages (2M on most systems) or the mapping fails. */
+		size_t hlen = (bp->map_len + (1UL << 21) - 1) & ~((1UL << 21) - 1);
+		bp->base = mmap(NULL, hlen, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (bp->base != MAP_FAILED) {
+			bp->map_len = hlen;
+			bp->huge = true;
+		} else {
+			fprintf(stderr, "*** No huge pages for the buffer pool (%s), using normal pages.\n",
+					strerror(errno));
+		}
+	}
+#endif
+	if (bp->base == MAP_FAILED &&
+		(bp->base = mmap(NULL, bp->map_len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		bp->base = NULL;
+		return -1;
+	}
+
+	if ((bp->free = malloc(sizeof(*bp->free) * nr)) == NULL) {
+		buf_pool_destroy(bp);
+		return -1;
+	}
+	/* Handed out from the start of the mapping. */
+	for (i = 0; i < nr; i++)
+		bp->free[i] = bp->base + (size_t)(nr - 1 - i) * bp->size;
+	bp->nr = bp->nr_free = nr;
+
+	return 0;
+}
+
+void buf_pool_destroy(struct buf_pool *bp)
+{
+	if (bp->base)
+		munmap(bp->base, bp->map_len);
+	free(bp->free);
+	memset(bp, 0x0, sizeof(*bp));
+}
+
+uint32_t ip_csum_partial(const void *data, size_t len, uint32_t sum)
+{
+	const uint8_t *p = data;
+	uint64_t acc = sum;
+	uint32_t w32;
+	uint16_t w16 = 0;
+
+	for (; len >= 4; p += 4, len -= 4) {
+		memcpy(&w32, p, 4);
+		acc += w32;
+	}
+	if (len >= 2) {
+		memcpy(&w16, p, 2);
+		acc += w16;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		w16 = 0;
+		memcpy(&w16, p, 1);
+		acc += w16;
+	}
+
+	while (acc >> 32)
+		acc = (acc & 0xffffffffULL) + (acc >> 32);
+	return (uint32_t)acc;
+}
+
+/* Folded and inverted, ready for the checksum field. */
+uint16_t ip_csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
 void do_daemonize(void)
 {
 	pid_t pid;
@@ -11,6 +11,8 @@
 #include <stddef.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #define __be32 uint32_t
@@ -171,6 +173,9 @@ static inline bool is_valid_unicast_in6(struct in6_addr *in6)
 		    pi->proto = htonl(AF_INET6);
 	}
 
+	/* utun always prepends the 4-byte header. */
+	#define TUN_HAS_PI  1
+
 #elif defined (__linux__)
 
 	// #include <linux/if.h>
@@ -197,6 +202,9 @@ static inline bool is_valid_unicast_in6(struct in6_addr *in6)
 		 pi->flags = 0;
          pi->proto = htons(ether_proto);
 	}
+
+	/* Opened with IFF_NO_PI, the protocol is told by the IP version. */
+	#define TUN_HAS_PI  0
 	
 #else
 
@@ -204,30 +212,89 @@ static inline bool is_valid_unicast_in6(struct in6_addr *in6)
 
 #endif
 
+#define TUN_PI_LEN  (TUN_HAS_PI ? sizeof(struct tun_pi) : 0)
+
+/* Ethernet protocol type of an IP packet, by its version nibble. */
+static inline uint16_t get_ether_proto_from_ipdata(const void *data)
+{
+	switch (*(const __u8 *)data >> 4) {
+	case 4:
+		return ETH_P_IP;
+	case 6:
+		return ETH_P_IPV6;
+	default:
+		return 0;
+	}
+}
+
 /* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
 
 #define CRYPTO_DEFAULT_ALGORITHM  "aes-128"
 #define CRYPTO_MAX_KEY_SIZE  32
 #define CRYPTO_MAX_BLOCK_SIZE  32
+#define CRYPTO_AEAD_NONCE_LEN  12
+#define CRYPTO_AEAD_TAG_LEN  16
+/* Bytes an AEAD cipher adds to each datagram: nonce ahead, tag behind. */
+#define CRYPTO_AEAD_OVERHEAD  (CRYPTO_AEAD_NONCE_LEN + CRYPTO_AEAD_TAG_LEN)
 
 struct name_cipher_pair {
 	const char *name;
 	const void *cipher;
 };
 
+/**
+ * Long-lived cipher state for one direction. The key schedule is set up
+ * once; each datagram only resets the IV (stream ciphers are re-keyed).
+ * AEAD ciphers use a fresh nonce per datagram, sent in front of it.
+ */
+struct crypto_context {
+	const void *cptype;
+	const void *key;
+	void *ctx;          /* EVP_CIPHER_CTX */
+	size_t pad_size;    /* data are padded to multiples of this */
+	bool rekey;
+	bool aead;
+	unsigned char nonce[CRYPTO_AEAD_NONCE_LEN];
+	void *mb_key;       /* round keys for the multi-buffer AES kernel */
+};
+
+/* One entry of a batch for datagram_{en,de}crypt_batch(). */
+struct crypto_datagram {
+	void *in;
+	void *out;
+	size_t len;
+	int rc;             /* decryption: -1 if not authentic */
+};
+
+static inline bool crypto_is_aead(const struct crypto_context *cc)
+{
+	return cc->aead;
+}
+
 extern struct name_cipher_pair cipher_pairs[];
 const void *get_crypto_type(const char *name);
-void datagram_encrypt(const void *key, const void *cptype, void *in,
+int crypto_context_init(struct crypto_context *cc, const void *key,
+		const void *cptype, bool encrypt);
+void crypto_context_cleanup(struct crypto_context *cc);
+void datagram_encrypt(struct crypto_context *cc, void *in,
 		void *out, size_t *dlen);
-void datagram_decrypt(const void *key, const void *cptype, void *in,
+int datagram_decrypt(struct crypto_context *cc, void *in,
 		void *out, size_t *dlen);
+size_t datagram_decrypt_head(struct crypto_context *cc, void *in,
+		void *out, size_t *dlen, size_t hlen);
+void datagram_decrypt_finish(struct crypto_context *cc, void *in,
+		void *out, size_t *dlen, size_t done);
+void datagram_encrypt_batch(struct crypto_context *cc,
+		struct crypto_datagram *dg, unsigned n);
+void datagram_decrypt_batch(struct crypto_context *cc,
+		struct crypto_datagram *dg, unsigned n);
 void fill_with_string_md5sum(const char *in, void *out, size_t outlen);
 
 /* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-= */
 
 static inline int set_nonblock(int sockfd)
 {
-	if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFD, 0)|O_NONBLOCK) == -1)
+	if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0)|O_NONBLOCK) == -1)
 		return -1;
 	return 0;
 }
@@ -242,5 +309,93 @@ static inline void hexdump(void *d, size_t len)
 
 void do_daemonize(void);
 
+#ifndef __linux__
+/* One-datagram-a-time fallbacks of the Linux batched socket calls. */
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+		int flags, struct timespec *timeout);
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+#endif
+
+/**
+ * UDP GSO: a run of datagrams to one peer goes out with one sendmsg(),
+ * the kernel (or the NIC) cuts it at the first datagram's size. Only the
+ * last datagram of a run may be shorter.
+ */
+#define UDP_GSO_MAX_SEGS  64
+#define UDP_GSO_MAX_BYTES  65000
+
+union udp_gso_cmsg {
+	char buf[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr align;
+};
+
+bool udp_gso_probe(int sockfd);
+unsigned udp_gso_run(const struct iovec *iov, unsigned n);
+void udp_gso_set_segment(struct msghdr *mh, union udp_gso_cmsg *cm, size_t gso_size);
+
+/**
+ * UDP GRO: the kernel may hand a run of datagrams from one peer over in
+ * a single receive, glued together; a cmsg tells the size they are to
+ * be cut at (all equal but the last one). The receive buffer must take
+ * a whole run, UDP_GRO_BUFFER_SIZE.
+ */
+#define UDP_GRO_BUFFER_SIZE  65536
+/**
+ * Receive slots of that size per recvmmsg(), whatever '--batch' is: a
+ * slot takes dozens of datagrams, and each costs 64K of memory.
+ */
+#define UDP_GRO_SLOTS_MAX  16
+
+union udp_gro_cmsg {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+};
+
+bool udp_gro_enable(int sockfd);
+size_t udp_gro_segment(struct msghdr *mh);
+
+/**
+ * Busy polling of a socket's device queue for each read, for up to
+ * SOCKET_BUSY_POLL_US microseconds; see '--busy-poll'.
+ */
+#define SOCKET_BUSY_POLL_US  50
+
+bool socket_busy_poll(int sockfd);
+
+/* Internet checksum: 16-bit one's complement sum, in memory byte order. */
+uint32_t ip_csum_partial(const void *data, size_t len, uint32_t sum);
+uint16_t ip_csum_fold(uint32_t sum);
+
+/**
+ * A fixed pool of packet buffers, 'size' bytes each rounded up to whole
+ * cache lines, all carved out of one mapping: of huge pages if asked for
+ * (and the system has some). Buffers are handed between the read, crypto
+ * and write stages by pointer, never copied or freed on the way.
+ */
+#define CACHE_LINE_SIZE  64
+
+struct buf_pool {
+	char *base;
+	size_t size;       /* of each buffer */
+	size_t map_len;
+	unsigned nr;
+	unsigned nr_free;
+	void **free;       /* stack of the free ones */
+	bool huge;         /* backed by huge pages */
+};
+
+int buf_pool_init(struct buf_pool *bp, unsigned nr, size_t size, bool huge);
+void buf_pool_destroy(struct buf_pool *bp);
+
+/* NULL if all buffers are taken. */
+static inline void *buf_pool_get(struct buf_pool *bp)
+{
+	return bp->nr_free ? bp->free[--bp->nr_free] : NULL;
+}
+
 #endif /* __LIBRARY_H */
 
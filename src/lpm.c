@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lpm.h"
+
+int lpm_init(struct lpm *t, unsigned key_bits)
+{
+	memset(t, 0x0, sizeof(*t));
+	t->key_bits = key_bits;
+	return 0;
+}
+
+static void lpm_clear(struct lpm *t)
+{
+	free(t->root);
+	free(t->pool);
+	t->root = NULL;
+	t->pool = NULL;
+	t->pool_len = t->pool_cap = 0;
+}
+
+void lpm_destroy(struct lpm *t)
+{
+	lpm_clear(t);
+	free(t->prefixes);
+	memset(t, 0x0, sizeof(*t));
+}
+
+/**
+ * Add the 'len' bits long prefix of 'key' with 'value', for the next
+ * lpm_build(). Adding one that is there already replaces its value.
+ */
+int lpm_add(struct lpm *t, const void *key, unsigned len, unsigned value)
+{
+	struct lpm_prefix *prefixes, *p;
+	unsigned cap;
+
+	if (len > t->key_bits || value == 0 || value > LPM_VALUE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (t->nr_prefixes >= t->prefixes_cap) {
+		cap = t->prefixes_cap ? t->prefixes_cap * 2 : 16;
+		if ((prefixes = realloc(t->prefixes, sizeof(*prefixes) * cap)) == NULL)
+			return -1;
+		t->prefixes = prefixes;
+		t->prefixes_cap = cap;
+	}
+
+	p = &t->prefixes[t->nr_prefixes];
+	memset(p->key, 0x0, sizeof(p->key));
+	memcpy(p->key, key, (len + 7) / 8);
+	if (len % 8)
+		p->key[len / 8] &= 0xff << (8 - len % 8);
+	p->len = len;
+	p->value = value;
+	p->seq = t->nr_prefixes++;
+
+	return 0;
+}
+
+/**
+ * By key, then by length: the prefixes that start with any other one
+ * come right after it, and shorter ones before longer ones.
+ */
+static int lpm_prefix_cmp(const void *a, const void *b)
+{
+	const struct lpm_prefix *p1 = a, *p2 = b;
+	int rc;
+
+	if ((rc = memcmp(p1->key, p2->key, sizeof(p1->key))))
+		return rc;
+	if (p1->len != p2->len)
+		return p1->len < p2->len ? -1 : 1;
+	return p1->seq < p2->seq ? -1 : p1->seq > p2->seq;
+}
+
+/* The 'stride' bits of 'key' from bit 'b' on, a multiple of 8. */
+static inline unsigned lpm_index(const uint8_t *key, unsigned b, unsigned stride)
+{
+	return stride == 16 ? (key[b / 8] << 8) | key[b / 8 + 1] : key[b / 8];
+}
+
+/* An entry for a node of 'tbl', or the value if all entries are the same. */
+static int lpm_node_new(struct lpm *t, const uint32_t *tbl, uint32_t *ent)
+{
+	struct lpm_node *node;
+	unsigned i, runs = 1;
+	size_t len, cap;
+	void *p;
+
+	for (i = 1; i < LPM_NODE_SIZE; i++)
+		runs += tbl[i] != tbl[i - 1];
+	if (runs == 1) {
+		*ent = tbl[0];
+		return 0;
+	}
+
+	/* In words of the pool. */
+	len = (offsetof(struct lpm_node, runs) + sizeof(uint32_t) * runs +
+			sizeof(*t->pool) - 1) / sizeof(*t->pool);
+	if (t->pool_len + len > t->pool_cap) {
+		cap = t->pool_cap ? t->pool_cap * 2 : 1024;
+		while (cap < t->pool_len + len)
+			cap *= 2;
+		if (cap > LPM_VALUE_MAX || (p = realloc(t->pool, sizeof(*t->pool) * cap)) == NULL)
+			return -1;
+		t->pool = p;
+		t->pool_cap = cap;
+	}
+
+	node = (struct lpm_node *)&t->pool[t->pool_len];
+	memset(node, 0x0, offsetof(struct lpm_node, runs));
+	for (i = 0, runs = 0; i < LPM_NODE_SIZE; i++) {
+		if (i % 64 == 0)
+			node->base[i / 64] = runs;
+		if (i == 0 || tbl[i] != tbl[i - 1]) {
+			node->bits[i / 64] |= 1ULL << (i % 64);
+			node->runs[runs++] = tbl[i];
+		}
+	}
+	*ent = LPM_NODE | t->pool_len;
+	t->pool_len += len;
+	return 0;
+}
+
+/**
+ * Fill in 'tbl', the 2^stride entries for bits 'b' on, from the sorted
+ * prefixes 'p[0..n)' that all start with what leads there and are longer
+ * than 'b'. Each entry holds what it had (the longest shorter prefix) or
+ * the longest of these that covers it, or a link to a node built for the
+ * ones that go further.
+ */
+static int lpm_fill(struct lpm *t, uint32_t *tbl, unsigned b, unsigned stride,
+		const struct lpm_prefix *p, unsigned n)
+{
+	unsigned end = b + stride, i, j, idx, span, k;
+	uint32_t sub[LPM_NODE_SIZE];
+
+	/* The ones ending here, each after those it is in. */
+	for (i = 0; i < n; i++) {
+		if (p[i].len > end)
+			continue;
+		span = 1U << (end - p[i].len);
+		idx = lpm_index(p[i].key, b, stride) & ~(span - 1);
+		for (k = 0; k < span; k++)
+			tbl[idx + k] = p[i].value;
+	}
+
+	/* The ones going further, a node per entry that they fall in. */
+	for (i = 0; i < n; i = j) {
+		if (p[i].len <= end) {
+			j = i + 1;
+			continue;
+		}
+		idx = lpm_index(p[i].key, b, stride);
+		for (j = i + 1; j < n && lpm_index(p[j].key, b, stride) == idx; j++)
+			;
+		for (k = 0; k < LPM_NODE_SIZE; k++)
+			sub[k] = tbl[idx];
+		if (lpm_fill(t, sub, end, LPM_STRIDE, &p[i], j - i) < 0 ||
+			lpm_node_new(t, sub, &tbl[idx]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* (Re)build the trie from all prefixes added so far. */
+int lpm_build(struct lpm *t)
+{
+	unsigned i, j;
+
+	lpm_clear(t);
+	if ((t->root = calloc((size_t)1 << LPM_ROOT_BITS, sizeof(*t->root))) == NULL)
+		return -1;
+
+	qsort(t->prefixes, t->nr_prefixes, sizeof(*t->prefixes), lpm_prefix_cmp);
+	/* Of equal ones, only the last added. */
+	for (i = j = 0; i < t->nr_prefixes; i++) {
+		if (j && t->prefixes[i].len == t->prefixes[j - 1].len &&
+			memcmp(t->prefixes[i].key, t->prefixes[j - 1].key, sizeof(t->prefixes[i].key)) == 0)
+			j--;
+		t->prefixes[j] = t->prefixes[i];
+		t->prefixes[j].seq = j;
+		j++;
+	}
+	t->nr_prefixes = j;
+
+	if (lpm_fill(t, t->root, 0, LPM_ROOT_BITS, t->prefixes, t->nr_prefixes) < 0) {
+		lpm_clear(t);
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
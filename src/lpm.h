@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __LPM_H
+#define __LPM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Longest prefix match over IPv4 or IPv6 addresses (keys in network byte
+ * order), as a multibit trie in the style of poptrie: a flat root table
+ * indexed by the first 16 bits of the address, then a node for each
+ * further byte, made only where longer prefixes need one. An entry holds
+ * either the value of the longest prefix that covers it or a link to the
+ * next node. A node keeps its 256 entries run-length compressed: a bitmap
+ * of where the runs start, followed by the value of each run, found by
+ * counting the bits up to the byte looked up; one with a few runs fits
+ * in a cache line. So a lookup takes one step per byte at most, whatever
+ * the number of prefixes: 3 for IPv4, 15 for IPv6.
+ *
+ * Prefixes are added with lpm_add() and take effect at lpm_build(),
+ * which builds the trie over again. Values are 1..LPM_VALUE_MAX, 0 is
+ * for no match. The trie must not be rebuilt while being looked up.
+ */
+
+#define LPM_ROOT_BITS  16
+#define LPM_STRIDE  8
+#define LPM_NODE_SIZE  (1U << LPM_STRIDE)
+
+/* Entry: a node link (its offset in 'pool') or a value. */
+#define LPM_NODE  0x80000000U
+#define LPM_VALUE_MAX  (LPM_NODE - 1)
+
+struct lpm_node {
+	uint64_t bits[LPM_NODE_SIZE / 64];  /* entries that start a run */
+	uint8_t base[LPM_NODE_SIZE / 64];   /* runs before each word of 'bits' */
+	uint32_t runs[];
+};
+
+struct lpm_prefix {
+	uint8_t key[16];
+	uint32_t len;
+	uint32_t value;
+	uint32_t seq;        /* order added, the last of equal ones counts */
+};
+
+struct lpm {
+	unsigned key_bits;   /* 32 or 128 */
+	struct lpm_prefix *prefixes;
+	unsigned nr_prefixes;
+	unsigned prefixes_cap;
+	/* Built by lpm_build(): nodes are in 'pool', 8-byte aligned. */
+	uint32_t *root;
+	uint64_t *pool;
+	size_t pool_len;
+	size_t pool_cap;
+};
+
+int lpm_init(struct lpm *t, unsigned key_bits);
+void lpm_destroy(struct lpm *t);
+int lpm_add(struct lpm *t, const void *key, unsigned len, unsigned value);
+int lpm_build(struct lpm *t);
+
+static inline unsigned lpm_lookup(const struct lpm *t, const void *key)
+{
+	const uint8_t *k = key;
+	const struct lpm_node *n;
+	unsigned i = LPM_ROOT_BITS / 8, w;
+	uint32_t e;
+
+	if (t->root == NULL)
+		return 0;
+	e = t->root[(k[0] << 8) | k[1]];
+	while (e & LPM_NODE) {
+		n = (const struct lpm_node *)&t->pool[e & ~LPM_NODE];
+		w = k[i] / 64;
+		e = n->runs[n->base[w] +
+				__builtin_popcountll(n->bits[w] & (~0ULL >> (63 - k[i] % 64))) - 1];
+		i++;
+	}
+	return e;
+}
+
+/* Bytes taken by the built trie. */
+static inline size_t lpm_memory(const struct lpm *t)
+{
+	return ((size_t)1 << LPM_ROOT_BITS) * sizeof(*t->root) +
+			t->pool_cap * sizeof(*t->pool);
+}
+
+#endif /* __LPM_H */
@@ -36,9 +36,40 @@ struct minivtun_config config = {
 	.wait_dns = false,
 	.send_all_traffic = false,
 	.bind_to_addr = "",
-	.bind_if = ""
+	.bind_if = "",
+	.batch_size = NM_BATCH_DEFAULT,
+	.workers = 1,
+	.io_uring = false,
+	.tun_offload = false,
+	.xdp_ifname = NULL,
+	.busy_poll_us = 0,
+	.huge_pages = false,
+	.capacity = 0,
 };
 
+__thread struct crypto_context crypto_enc, crypto_dec;
+
+/**
+ * Set up the long-lived cipher contexts once the key and type are known,
+ * in each thread that encrypts or decrypts.
+ */
+int init_crypto_contexts(void)
+{
+	int rc;
+
+	crypto_context_cleanup(&crypto_enc);
+	crypto_context_cleanup(&crypto_dec);
+	if ((rc = crypto_context_init(&crypto_enc, config.crypto_key,
+		config.crypto_type, true)) < 0)
+		return rc;
+	if ((rc = crypto_context_init(&crypto_dec, config.crypto_key,
+		config.crypto_type, false)) < 0) {
+		crypto_context_cleanup(&crypto_enc);
+		return rc;
+	}
+	return 0;
+}
+
 #if !defined( __APPLE_NETWORK_EXTENSION__ ) && !defined( __ANDROID_VPN_SERVICE__ )
 
 #ifdef __APPLE__
@@ -65,6 +96,14 @@ static struct option long_opts[] = {
 	{ "help", no_argument, 0, 'h', },
 	{ "send-all-traffic", no_argument, 0, 'f' },
 	{ "bind-to-addr", required_argument, 0, 'b' },
+	{ "batch", required_argument, 0, 'B' },
+	{ "workers", required_argument, 0, 'W' },
+	{ "io-uring", no_argument, 0, 'U' },
+	{ "offload", no_argument, 0, 'O' },
+	{ "xdp", required_argument, 0, 'X' },
+	{ "busy-poll", required_argument, 0, 'P' },
+	{ "huge-pages", no_argument, 0, 'H' },
+	{ "capacity", required_argument, 0, 'C' },
 	{ 0, 0, 0, 0, },
 };
 
@@ -89,11 +128,20 @@ static void print_help(int argc, char *argv[])
 	printf("  -e, --key <encryption_key>          shared password for data encryption\n");
 	printf("  -t, --type <encryption_type>        encryption type\n");
 	printf("  -v, --route <network/prefix=gateway>\n");
-	printf("                                      route a network to a client address, can be multiple\n");
+	printf("                                      route an IPv4 or IPv6 network to a client address, can be multiple\n");
 	printf("  -w, --wait-dns                      wait for DNS resolve ready after service started.\n");
 	printf("  -d, --daemon                        run as daemon process\n");
 	printf("  -f, --send-all-traffic              send all traffic through the tunnel\n");
-	printf("  -b, --bind-to-addr <addr>           bind to specified address. If omitted, would be bound to the address with the first default route.");
+	printf("  -b, --bind-to-addr <addr>           bind to specified address. If omitted, would be bound to the address with the first default route.\n");
+	printf("  -B, --batch <n>                     packets handled per system call, default: %u, max: %u\n",
+		   config.batch_size, NM_BATCH_MAX);
+	printf("  -W, --workers <n>                   server threads, each with a TUN queue and a socket, default: 1\n");
+	printf("  -U, --io-uring                      server I/O through io_uring, falls back to epoll if unavailable\n");
+	printf("  -O, --offload                       TSO on the virtual interface, super-packets are segmented here (Linux)\n");
+	printf("  -X, --xdp <ifname>                  server datagrams through AF_XDP sockets on this interface (Linux)\n");
+	printf("  -P, --busy-poll <usecs>             spin on the tunnel and socket, block after <usecs> without traffic\n");
+	printf("  -H, --huge-pages                    put the packet buffers on huge pages\n");
+	printf("  -C, --capacity <clients>            (server only) set up room for this many clients at start\n");
 	printf("  -h, --help                          print this help\n");
 	printf("Supported encryption types:\n");
 	printf("  ");
@@ -105,11 +153,15 @@ static void print_help(int argc, char *argv[])
 /**
  *  Allocate a new tun/tap device
  *
+ *  With '--workers' above 1 the device is multi-queue: each call with the
+ *  same name opens one more queue of it.
+ *  With '--offload' it takes virtio-net headers and does TSO, see tun_offload.h.
+ *
  *  @param dev   The tun device name would be used. It contains real cloned device name on return.
  *
  *  @return      Opened cloned tun device fd if all succeeded, otherwise a negative error code.
  */
-static int tun_alloc(char *dev)
+int tun_alloc(char *dev)
 {
 	int fd = -1, err;
 
@@ -182,13 +234,21 @@ static int tun_alloc(char *dev)
 	}
 
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TUN;
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	if (config.workers > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (config.tun_offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 	if (dev[0])
 		strncpy(ifr.ifr_name, dev, IFNAMSIZ);
 	if ((err = ioctl(fd, TUNSETIFF, (void *) &ifr)) < 0) {
 		close(fd);
 		return err;
 	}
+	if (config.tun_offload && (err = tun_offload_enable(fd)) < 0) {
+		close(fd);
+		return err;
+	}
 	strcpy(dev, ifr.ifr_name);
 #endif
 
@@ -198,13 +258,14 @@ static int tun_alloc(char *dev)
 static void parse_virtual_route(const char *arg)
 {
 	char expr[80], *net, *pfx, *gw;
-	struct in_addr network, gateway;
+	struct in6_addr network, gateway;
+	int af, gw_af;
 	unsigned prefix = 0;
 
 	strncpy(expr, arg, sizeof(expr));
 	expr[sizeof(expr) - 1] = '\0';
 
-	/* 192.168.0.0/16=10.7.0.1 */
+	/* 192.168.0.0/16=10.7.0.1, fd08::/32=fd00::33 */
 	net = expr;
 	if ((pfx = strchr(net, '/')) == NULL) {
 		fprintf(stderr, "*** Not a valid route expression '%s'.\n", arg);
@@ -217,13 +278,17 @@ static void parse_virtual_route(const char *arg)
 	}
 	*(gw++) = '\0';
 
-	if (!inet_pton(AF_INET, net, &network) ||
-		!inet_pton(AF_INET, gw, &gateway) || sscanf(pfx, "%u", &prefix) != 1) {
+	/* Either family for the gateway, whichever address the client has. */
+	af = strchr(net, ':') ? AF_INET6 : AF_INET;
+	gw_af = strchr(gw, ':') ? AF_INET6 : AF_INET;
+	if (!inet_pton(af, net, &network) ||
+		!inet_pton(gw_af, gw, &gateway) || sscanf(pfx, "%u", &prefix) != 1) {
 		fprintf(stderr, "*** Not a valid route expression '%s'.\n", arg);
 		exit(1);
 	}
 
-	vt_route_add(&network, prefix, &gateway);
+	if (vt_route_add(af, &network, prefix, gw_af, &gateway) < 0)
+		exit(1);
 }
 
 static int try_resolve_addr_pair(const char *addr_pair)
@@ -249,7 +314,7 @@ int main(int argc, char *argv[])
 	char cmd[128];
 	int tunfd, opt;
 
-	while ((opt = getopt_long(argc, argv, "r:l:R:a:A:m:k:n:p:e:t:v:b:dwhf",
+	while ((opt = getopt_long(argc, argv, "r:l:R:a:A:m:k:n:p:e:t:v:b:B:W:UOX:P:HC:dwhf",
 			long_opts, NULL)) != -1) {
 
 		switch (opt) {
@@ -270,6 +335,10 @@ int main(int argc, char *argv[])
 			break;
 		case 'm':
 			config.tun_mtu = (unsigned)strtoul(optarg, NULL, 10);
+			if (config.tun_mtu < 68 || config.tun_mtu > NM_MTU_MAX) {
+				fprintf(stderr, "*** MTU must be 68..%u.\n", (unsigned)NM_MTU_MAX);
+				exit(1);
+			}
 			break;
 		case 'k':
 			config.keepalive_timeo = (unsigned)strtoul(optarg, NULL, 10);
@@ -306,6 +375,42 @@ int main(int argc, char *argv[])
 		case 'b':
 			strncpy(config.bind_to_addr, optarg, sizeof(config.bind_to_addr) - 1);
 			break;
+		case 'B':
+			config.batch_size = (unsigned)strtoul(optarg, NULL, 10);
+			if (config.batch_size == 0 || config.batch_size > NM_BATCH_MAX) {
+				fprintf(stderr, "*** Batch size must be 1..%u.\n", NM_BATCH_MAX);
+				exit(1);
+			}
+			break;
+		case 'U':
+			config.io_uring = true;
+			break;
+		case 'O':
+			config.tun_offload = true;
+			break;
+		case 'X':
+			config.xdp_ifname = optarg;
+			break;
+		case 'P':
+			config.busy_poll_us = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			config.huge_pages = true;
+			break;
+		case 'C':
+			config.capacity = (unsigned)strtoul(optarg, NULL, 10);
+			if (config.capacity > NM_CAPACITY_MAX) {
+				fprintf(stderr, "*** Capacity must be 0..%u.\n", NM_CAPACITY_MAX);
+				exit(1);
+			}
+			break;
+		case 'W':
+			config.workers = (unsigned)strtoul(optarg, NULL, 10);
+			if (config.workers == 0 || config.workers > NM_WORKERS_MAX) {
+				fprintf(stderr, "*** Number of workers must be 1..%u.\n", NM_WORKERS_MAX);
+				exit(1);
+			}
+			break;
 		case '?':
 			exit(1);
 		}
@@ -361,11 +466,12 @@ int main(int argc, char *argv[])
 #else
 			sprintf(cmd, "ifconfig %s %s pointopoint %s", config.devname, s_lip, s_rip);
 #endif
-			vt_route_add(&__network, 0, &vaddr);
+			vt_route_add(AF_INET, &__network, 0, AF_INET, &vaddr);
 		} 
 		// If it is local_ip/prefix format of -r option
 		else if (sscanf(s_rip, "%d", &pfxlen) == 1 && pfxlen > 0 && pfxlen < 31 ) {
 			uint32_t mask = ~((1 << (32 - pfxlen)) - 1);
+			config.local_tun_prefix = pfxlen;
 #ifdef __APPLE__
 			uint32_t network = ntohl(vaddr.s_addr) & mask;
 			sprintf(s_rip, "%u.%u.%u.%u", network >> 24, (network >> 16) & 0xff,
@@ -441,6 +547,10 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "*** No such encryption type defined: %s.\n", crypto_type);
 			exit(1);
 		}
+		if (init_crypto_contexts() < 0) {
+			fprintf(stderr, "*** Encryption type not supported by the crypto library: %s.\n", crypto_type);
+			exit(1);
+		}
 	} else {
 		memset(config.crypto_key, 0x0, CRYPTO_MAX_KEY_SIZE);
 		fprintf(stderr, "*** WARNING: Transmission will not be encrypted.\n");
@@ -469,6 +579,10 @@ void set_config_params(const char * crypto_key)
      config.crypto_passwd = strdup(crypto_key);
 	 fill_with_string_md5sum(config.crypto_passwd, config.crypto_key, CRYPTO_MAX_KEY_SIZE);
      config.crypto_type = get_crypto_type(CRYPTO_DEFAULT_ALGORITHM);	 
+     if (init_crypto_contexts() < 0) {
+		fprintf(stderr, "*** Cannot set up the cipher contexts for %s.\n", CRYPTO_DEFAULT_ALGORITHM);
+		exit(1);
+	 }
 }
 
 #endif // __APPLE_NETWORK_EXTENSION__
@@ -8,8 +8,13 @@
 #define __MINIVTUN_H
 
 #include "library.h"
+#include "tun_offload.h"
 
 #include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 extern struct minivtun_config config;
 
@@ -26,13 +31,28 @@ struct minivtun_config {
 	char crypto_key[CRYPTO_MAX_KEY_SIZE];
 	const void *crypto_type;
 	struct in_addr local_tun_in;
+	unsigned local_tun_prefix;  /* 0 for a point-to-point address */
 	struct in6_addr local_tun_in6;
 
 	int send_all_traffic;
 	char bind_to_addr[64];
 	char bind_if[IFNAMSIZ];
+
+	unsigned batch_size;
+	unsigned workers;
+	bool io_uring;
+	bool tun_offload;
+	const char *xdp_ifname;
+	unsigned busy_poll_us;
+	bool huge_pages;
+	unsigned capacity;
 };
 
+/* Cipher contexts of the calling thread, see init_crypto_contexts(). */
+extern __thread struct crypto_context crypto_enc, crypto_dec;
+
+int init_crypto_contexts(void);
+
 enum {
 	MINIVTUN_MSG_KEEPALIVE,
 	MINIVTUN_MSG_IPDATA,
@@ -41,6 +61,23 @@ enum {
 
 #define NM_PI_BUFFER_SIZE  (1024 * 8)
 
+/**
+ * Max. packets taken from the tunnel per wakeup and encrypted as a batch,
+ * also datagrams per recvmmsg()/sendmmsg(): 'config.batch_size', up to
+ * NM_BATCH_MAX.
+ */
+#define NM_BATCH_DEFAULT  32
+#define NM_BATCH_MAX  256
+
+/* Max. server worker threads, see '--workers'. */
+#define NM_WORKERS_MAX  64
+
+/* Max. clients to set up room for at start, see '--capacity'. */
+#define NM_CAPACITY_MAX  (1U << 24)
+
+/* Kept free behind a message for cipher padding or the AEAD tag. */
+#define NM_CRYPTO_TAILROOM  32
+
 struct minivtun_msg {
 	struct {
 		__u8 opcode;
@@ -63,29 +100,229 @@ struct minivtun_msg {
 
 #define MINIVTUN_MSG_BASIC_HLEN  (sizeof(((struct minivtun_msg *)0)->hdr))
 #define MINIVTUN_MSG_IPDATA_OFFSET  (offsetof(struct minivtun_msg, ipdata.data))
+#define MINIVTUN_MSG_AUTH_OFFSET  (offsetof(struct minivtun_msg, hdr.auth_key))
+#define MINIVTUN_MSG_AUTH_KEY_LEN  (sizeof(((struct minivtun_msg *)0)->hdr.auth_key))
+
+/* A keep-alive message on its own, with room for the cipher padding. */
+struct minivtun_keepalive_msg {
+	typeof(((struct minivtun_msg *)0)->hdr) hdr;
+	typeof(((struct minivtun_msg *)0)->keepalive) keepalive;
+	char tailroom[NM_CRYPTO_TAILROOM];
+} __attribute__((packed));
+
+/* Largest '--mtu' that a message can carry. */
+#define NM_MTU_MAX  (NM_PI_BUFFER_SIZE - NM_CRYPTO_TAILROOM)
+
+/**
+ * Packet buffers (from a struct buf_pool) take one message: the header
+ * in front of an IP packet of up to 'tun_mtu' bytes, and the crypto
+ * tailroom behind it. A datagram fits the same size.
+ */
+#define NM_BUFFER_SIZE  (MINIVTUN_MSG_IPDATA_OFFSET + config.tun_mtu + NM_CRYPTO_TAILROOM)
+
+/* Max. bytes read from the tunnel into a message, see tun_read_to_nmsg(). */
+#define TUN_READ_MAX  (config.tun_mtu + TUN_PI_LEN)
 
 #define enabled_encryption()  (config.crypto_passwd[0])
 
+/**
+ * AEAD and CBC datagrams cannot be told apart on the wire, so a peer
+ * with another '-t' (or key) only ever fails authentication. After a
+ * run of this many failures from one peer the log says so, once in
+ * AUTH_HINT_INTERVAL seconds at most.
+ */
+#define AUTH_HINT_RUN  16
+#define AUTH_HINT_INTERVAL  30
+
+#if defined(__APPLE_NETWORK_EXTENSION__) || defined(__ANDROID_VPN_SERVICE__)
+/**
+ * The host app calls the handlers on threads of its own choosing, so
+ * each of them sets up its cipher contexts on first use.
+ */
+static inline void crypto_contexts_ensure(void)
+{
+	if (enabled_encryption() && crypto_enc.ctx == NULL && init_crypto_contexts() < 0) {
+		fprintf(stderr, "*** Cannot set up the cipher contexts.\n");
+		exit(1);
+	}
+}
+#else
+/* Set up by each thread at start. */
+static inline void crypto_contexts_ensure(void)
+{
+}
+#endif
+
+/**
+ * With an AEAD cipher the tag authenticates the datagram, so 'auth_key'
+ * is not transmitted: the wire carries nonce | E(opcode, rsv, body) | tag.
+ * Passing *out == in encrypts in place, '*out' may move forward then.
+ */
 static inline void local_to_netmsg(void *in, void **out, size_t *dlen)
 {
-	if (enabled_encryption()) {
-		datagram_encrypt(config.crypto_key, config.crypto_type, in, *out, dlen);
+	crypto_contexts_ensure();
+	if (enabled_encryption() && crypto_is_aead(&crypto_enc)) {
+		/* Move opcode and rsv[] right in front of the body. */
+		char *p = (char *)in + MINIVTUN_MSG_AUTH_KEY_LEN;
+		memcpy(p, in, MINIVTUN_MSG_AUTH_OFFSET);
+		*dlen -= MINIVTUN_MSG_AUTH_KEY_LEN;
+		/* In place: the nonce goes into what was 'auth_key'. */
+		if (*out == in)
+			*out = p - CRYPTO_AEAD_NONCE_LEN;
+		datagram_encrypt(&crypto_enc, p, *out, dlen);
+	} else if (enabled_encryption()) {
+		datagram_encrypt(&crypto_enc, in, *out, dlen);
 	} else {
 		*out = in;
 	}
 }
-static inline void netmsg_to_local(void *in, void **out, size_t *dlen)
+
+/* Same as local_to_netmsg() on each of 'dg[]', with 'out' pre-assigned. */
+static inline void local_to_netmsg_batch(struct crypto_datagram *dg, unsigned n)
+{
+	unsigned i;
+
+	crypto_contexts_ensure();
+	if (enabled_encryption() && !crypto_is_aead(&crypto_enc)) {
+		datagram_encrypt_batch(&crypto_enc, dg, n);
+	} else {
+		for (i = 0; i < n; i++)
+			local_to_netmsg(dg[i].in, &dg[i].out, &dg[i].len);
+	}
+}
+
+/* Returns 0 for an authentic message, -1 if it should be dropped. */
+static inline int netmsg_to_local(void *in, void **out, size_t *dlen)
 {
+	struct minivtun_msg *nmsg;
+	size_t done;
+
+	crypto_contexts_ensure();
+	if (enabled_encryption() && crypto_is_aead(&crypto_dec)) {
+		char *p = (char *)*out + MINIVTUN_MSG_AUTH_KEY_LEN;
+		if (datagram_decrypt(&crypto_dec, in, p, dlen) < 0 ||
+			*dlen < MINIVTUN_MSG_AUTH_OFFSET)
+			return -1;
+		nmsg = *out;
+		memcpy(nmsg, p, MINIVTUN_MSG_AUTH_OFFSET);
+		memset(nmsg->hdr.auth_key, 0x0, MINIVTUN_MSG_AUTH_KEY_LEN);
+		*dlen += MINIVTUN_MSG_AUTH_KEY_LEN;
+		return 0;
+	}
+
 	if (enabled_encryption()) {
-		datagram_decrypt(config.crypto_key, config.crypto_type, in, *out, dlen);
+		/* Decrypt just enough to check the header, garbage stops here. */
+		done = datagram_decrypt_head(&crypto_dec, in, *out, dlen,
+				MINIVTUN_MSG_BASIC_HLEN);
 	} else {
 		*out = in;
+		done = *dlen;
+	}
+	nmsg = *out;
+
+	if (done < MINIVTUN_MSG_BASIC_HLEN)
+		return -1;
+
+	/* Verify password. */
+	if (memcmp(nmsg->hdr.auth_key, config.crypto_key,
+		MINIVTUN_MSG_AUTH_KEY_LEN) != 0)
+		return -1;
+
+	if (enabled_encryption())
+		datagram_decrypt_finish(&crypto_dec, in, *out, dlen, done);
+
+	return 0;
+}
+
+/* Where a tunnel read for 'nmsg' lands: TUN_READ_MAX bytes at most. */
+#define tun_read_buffer(nmsg)  ((nmsg)->ipdata.data - TUN_PI_LEN)
+
+/**
+ * Fill in the message header in front of a packet that has been read
+ * with tun_read_buffer(), so it can be encrypted in place. Returns the
+ * message length, or 0 if the packet is to be dropped.
+ */
+static inline ssize_t tun_nmsg_fill(struct minivtun_msg *nmsg, size_t rlen)
+{
+	char *p = tun_read_buffer(nmsg);
+	size_t ip_dlen;
+	uint16_t proto;
+
+	if (rlen <= TUN_PI_LEN)
+		return 0;
+	ip_dlen = rlen - TUN_PI_LEN;
+
+#if TUN_HAS_PI
+	/* The header overlaps 'ipdata.proto' and 'ipdata.ip_dlen'. */
+	proto = get_ether_proto_from_pi((struct tun_pi *)p);
+#else
+	proto = get_ether_proto_from_ipdata(p);
+#endif
+
+	/* We only accept IPv4 or IPv6 frames. */
+	if (proto == ETH_P_IP) {
+		if (ip_dlen < 20)
+			return 0;
+	} else if (proto == ETH_P_IPV6) {
+		if (ip_dlen < 40)
+			return 0;
+	} else {
+		fprintf(stderr, "*** Invalid protocol: 0x%x.\n", proto);
+		return 0;
+	}
+
+	nmsg->hdr.opcode = MINIVTUN_MSG_IPDATA;
+	memset(nmsg->hdr.rsv, 0x0, sizeof(nmsg->hdr.rsv));
+	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
+	nmsg->ipdata.proto = htons(proto);
+	nmsg->ipdata.ip_dlen = htons(ip_dlen);
+
+	return (ssize_t)(MINIVTUN_MSG_IPDATA_OFFSET + ip_dlen);
+}
+
+/**
+ * Read one packet from the tunnel straight into 'nmsg->ipdata.data',
+ * see tun_nmsg_fill(). With '--offload' it goes through the reader 'to'
+ * instead, which may cut it from a super-packet. Returns -1 if there
+ * was nothing to read.
+ */
+static inline ssize_t tun_read_to_nmsg(int tunfd, struct tun_offload *to,
+		struct minivtun_msg *nmsg)
+{
+	ssize_t rc;
+
+	if (to) {
+		if ((rc = tun_offload_read(to, tunfd, nmsg->ipdata.data,
+			TUN_READ_MAX - TUN_PI_LEN)) < 0)
+			return -1;
+		return rc ? tun_nmsg_fill(nmsg, TUN_PI_LEN + (size_t)rc) : 0;
 	}
+
+	if ((rc = read(tunfd, tun_read_buffer(nmsg), TUN_READ_MAX)) < 0)
+		return -1;
+	return tun_nmsg_fill(nmsg, (size_t)rc);
+}
+
+/* Write the IP packet carried in 'nmsg' to the tunnel with one write(). */
+static inline ssize_t tun_write_ipdata(int tunfd, struct minivtun_msg *nmsg, size_t ip_dlen)
+{
+#if TUN_HAS_PI
+	/* Reuse 'ipdata.proto' and 'ipdata.ip_dlen' for the header. */
+	struct tun_pi *pi = (struct tun_pi *)(nmsg->ipdata.data - sizeof(struct tun_pi));
+	set_pi_with_ether_proto(pi, ntohs(nmsg->ipdata.proto));
+	return write(tunfd, pi, sizeof(struct tun_pi) + ip_dlen);
+#else
+	if (config.tun_offload)
+		return tun_offload_write(tunfd, nmsg->ipdata.data, ip_dlen);
+	return write(tunfd, nmsg->ipdata.data, ip_dlen);
+#endif
 }
 
+int tun_alloc(char *dev);
 int run_client(int tunfd, const char *peer_addr_pair);
 int run_server(int tunfd, const char *loc_addr_pair);
-int vt_route_add(struct in_addr *network, unsigned prefix, struct in_addr *gateway);
+int vt_route_add(int af, const void *network, unsigned prefix,
+		int gw_af, const void *gateway);
 
 #if DEBUG
 static inline void dump_nmsg(struct minivtun_msg * nmsg)
@@ -4,6 +4,9 @@
  * https://github.com/rssnsj/minivtun
  */
 
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE  /* recvmmsg(), sendmmsg() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -18,146 +21,281 @@
 #include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <poll.h>
+#ifdef __linux__
+  #include <sched.h>
+#endif
 
 #include "list.h"
 #include "jhash.h"
+#include "addr_table.h"
+#include "session.h"
+#include "lglock.h"
+#include "lpm.h"
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "uring.h"
+#include "af_xdp.h"
 #include "minivtun.h"
 
-/* Timestamp for each loop. */
-static time_t current_ts = 0;
+/* Timestamp for each loop, of the worker thread. */
+static __thread time_t current_ts = 0;
+/* Number of the worker thread. */
+static __thread unsigned current_worker = 0;
 static uint32_t hash_initval = 0;
 
 /**
- * Pseudo route table for binding client side subnets
- * to corresponding connected virtual addresses.
+ * With '--workers N' each worker thread has a TUN queue, a SO_REUSEPORT
+ * socket and an event loop of its own. The client tables below are
+ * shared by all of them, so a client is found whichever worker its
+ * packets come through. Each worker looks things up under a lock of
+ * its own in 'tables_lock' (tables_read_lock()), so workers never wait
+ * on one another for that; changes take the locks of all of them
+ * (tables_write_lock()), and come with new clients and addresses, and
+ * with the timers, not with each packet.
  */
-struct vt_route {
-	struct in_addr network;
-	struct in_addr netmask;
-	struct in_addr gateway;
-};
-#define VIRTUAL_ROUTE_MAX  (32)
-static struct vt_route *vt_routes[VIRTUAL_ROUTE_MAX];
-static unsigned vt_routes_len = 0; 
+static struct lglock tables_lock;
 
-int vt_route_add(struct in_addr *network, unsigned prefix, struct in_addr *gateway)
+static inline void tables_read_lock(void)
 {
-	struct vt_route *rt;
-	uint32_t mask;
-
-	if (prefix == 0) {
-		mask = 0;
-	} else {
-		mask = ~((1U << (32 - prefix)) - 1) & 0xffffffff;
-	}
-
-	if (vt_routes_len >= VIRTUAL_ROUTE_MAX) {
-		fprintf(stderr, "*** Virtual route table is full.\n");
-		return -1;
-	}
-
-	rt = malloc(sizeof(struct vt_route));
-	rt->netmask.s_addr = htonl(mask);
-	rt->network.s_addr = network->s_addr & rt->netmask.s_addr;
-	rt->gateway = *gateway;
-	vt_routes[vt_routes_len++] = rt;
-
-	return 0;
+	lg_local_lock(&tables_lock, current_worker);
 }
 
-static struct in_addr *vt_route_lookup(const struct in_addr *addr)
+static inline void tables_read_unlock(void)
 {
-	unsigned i;
+	lg_local_unlock(&tables_lock, current_worker);
+}
 
-	for (i = 0; i < vt_routes_len; i++) {
-		struct vt_route *rt = vt_routes[i];
-		
-		printf("0x%08x,0x%08x,0x%08x\n", addr->s_addr, rt->netmask.s_addr, rt->network.s_addr);
-		if ((addr->s_addr & rt->netmask.s_addr) == rt->network.s_addr)
-			return &rt->gateway;
-	}
+static inline void tables_write_lock(void)
+{
+	lg_global_lock(&tables_lock);
+}
 
-	return NULL;
+static inline void tables_write_unlock(void)
+{
+	lg_global_unlock(&tables_lock);
 }
 
-/* -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- */
+struct server_worker {
+	unsigned id;
+	pthread_t thread;
+	int tunfd;
+	int sockfd;
+	struct ev_loop loop;
+	struct ev_io sock_io, tun_io;
+	struct ev_timer walk_timer;
+
+	/**
+	 * Datagrams to the network are queued here while a loop round
+	 * runs and go out with one sendmmsg() at its end, in UDP GSO runs
+	 * per peer if 'gso'. The payloads are not copied, they must stay
+	 * untouched until udp_tx_flush().
+	 */
+	struct mmsghdr tx_msgs[NM_BATCH_MAX];
+	struct iovec tx_iovs[NM_BATCH_MAX];
+	struct sockaddr_inx tx_addrs[NM_BATCH_MAX];
+	union udp_gso_cmsg tx_cmsgs[NM_BATCH_MAX];
+	unsigned tx_len;
+	bool gso;
+
+	/**
+	 * Packet buffers: a pool of them is taken at start, split into the
+	 * receive slots of the socket and the tunnel ('config.batch_size'
+	 * each) and the decryption buffer.
+	 */
+	struct buf_pool pool;
+	char *read_buffers[NM_BATCH_MAX];
+	struct sockaddr_inx real_peers[NM_BATCH_MAX];
+	/**
+	 * With UDP GRO the socket is read into these instead, a run per
+	 * slot: 'gro_slots' buffers of UDP_GRO_BUFFER_SIZE from a pool of
+	 * their own.
+	 */
+	bool gro;
+	struct buf_pool gro_pool;
+	unsigned gro_slots;
+	char *gro_buffers[UDP_GRO_SLOTS_MAX];
+	union udp_gro_cmsg rx_cmsgs[NM_BATCH_MAX];
+	struct minivtun_msg *nmsgs[NM_BATCH_MAX];
+	char *crypt_buffer;
+	/* Super-packet reader and writer of the TUN queue with '--offload', else NULL. */
+	struct tun_offload *tso;
+	struct tun_gro *tun_gro;
+
+	/* AF_XDP socket of this worker's queue with '--xdp', else NULL. */
+	struct xsk *xsk;
+	struct ev_io xsk_io;
+
+#ifdef HAVE_IO_URING
+	/* The io_uring engine, see server_worker_run_uring(). */
+	bool use_uring;
+	struct uring ring;
+	char *write_buffers[NM_BATCH_MAX];
+	struct msghdr rx_hdrs[NM_BATCH_MAX];
+	struct iovec rx_iovs[NM_BATCH_MAX];
+	/* Failed tunnel reads, whose slots read no more (logged once). */
+	unsigned long tun_read_errors;
+#endif
 
-struct ra_entry {
-	struct list_head list;
-	struct sockaddr_inx real_addr;
-	time_t last_recv;
-	time_t last_xmit;
-	int refs;
+	/* Counters of the batched network I/O, shown with each state walk. */
+	struct {
+		unsigned long rx_calls;
+		unsigned long rx_packets;
+		unsigned long rx_full;
+		unsigned long rx_drops;
+		unsigned long rx_oversize; /* truncated to the buffer ('-m') */
+		unsigned long tx_calls;
+		unsigned long tx_packets;
+		unsigned long tx_drops;
+	} io_stats;
 };
 
-/* Hash table for dedicated clients (real addresses). */
-#define RA_SET_HASH_SIZE  (1 << 3)
-#define RA_SET_LIMIT_EACH_WALK  (10)
-static struct list_head ra_set_hbase[RA_SET_HASH_SIZE];
-static unsigned ra_set_len;
+static struct server_worker *workers;
+static unsigned workers_len;
+static struct xdp_prog *xdp_prog;
 
-static inline uint32_t real_addr_hash(const struct sockaddr_inx *sa)
-{
-	if (sa->sa.sa_family == AF_INET6) {
-		return jhash_2words(sa->sa.sa_family, sa->in6.sin6_port,
-			jhash2((uint32_t *)&sa->in6.sin6_addr, 4, hash_initval));
-	} else {
-		return jhash_3words(sa->sa.sa_family, sa->in.sin_port,
-			sa->in.sin_addr.s_addr, hash_initval);
-	}
-}
+#ifdef HAVE_IO_URING
+  #define server_worker_uses_uring(w)  ((w)->use_uring)
+#else
+  #define server_worker_uses_uring(w)  false
+#endif
 
-static struct ra_entry *ra_get_or_create(const struct sockaddr_inx *sa)
+/**
+ * Cut the queue into sendmmsg() messages. With GSO the datagrams are
+ * grouped by peer (keeping their order) and each run of them makes one
+ * message; otherwise it is one message per datagram, in queue order.
+ */
+static unsigned udp_tx_build(struct server_worker *w, struct iovec *iovs,
+		unsigned *segs)
 {
-	struct list_head *chain = &ra_set_hbase[
-		real_addr_hash(sa) & (RA_SET_HASH_SIZE - 1)];
-	struct ra_entry *re;
-	char s_real_addr[50];
+	bool taken[NM_BATCH_MAX];
+	unsigned nr_iovs = 0, nr_msgs = 0, i, j, k, run;
+	struct msghdr *mh;
+
+	memset(taken, 0x0, sizeof(taken[0]) * w->tx_len);
+	for (i = 0; i < w->tx_len; i++) {
+		if (taken[i])
+			continue;
+
+		k = nr_iovs;
+		iovs[nr_iovs++] = w->tx_iovs[i];
+		for (j = i + 1; w->gso && j < w->tx_len; j++) {
+			if (!taken[j] && is_sockaddr_equal(&w->tx_addrs[j], &w->tx_addrs[i])) {
+				iovs[nr_iovs++] = w->tx_iovs[j];
+				taken[j] = true;
+			}
+		}
 
-	list_for_each_entry (re, chain, list) {
-		if (is_sockaddr_equal(&re->real_addr, sa)) {
-			re->refs++;
-			return re;
+		for (; k < nr_iovs; k += run) {
+			run = w->gso ? udp_gso_run(&iovs[k], nr_iovs - k) : 1;
+			mh = &w->tx_msgs[nr_msgs].msg_hdr;
+			memset(mh, 0x0, sizeof(*mh));
+			mh->msg_name = &w->tx_addrs[i];
+			mh->msg_namelen = sizeof_sockaddr(&w->tx_addrs[i]);
+			mh->msg_iov = &iovs[k];
+			mh->msg_iovlen = run;
+			if (run > 1)
+				udp_gso_set_segment(mh, &w->tx_cmsgs[nr_msgs], iovs[k].iov_len);
+			segs[nr_msgs++] = run;
 		}
 	}
 
-	if ((re = malloc(sizeof(*re))) == NULL) {
-		fprintf(stderr, "*** [%s] malloc(): %s.\n", __FUNCTION__,
-				strerror(errno));
-		return NULL;
-	}
+	return nr_msgs;
+}
 
-	re->real_addr = *sa;
-	re->refs = 1;
-	list_add_tail(&re->list, chain);
-	ra_set_len++;
+static void udp_tx_flush(struct server_worker *w)
+{
+	struct iovec iovs[NM_BATCH_MAX];
+	unsigned segs[NM_BATCH_MAX];
+	unsigned nr_msgs, sent = 0, i;
+	int rc;
 
-	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
-			  s_real_addr, sizeof(s_real_addr));
-	printf("New client [%s:%u]\n", s_real_addr, port_of_sockaddr(&re->real_addr));
+	if (w->xsk && xsk_flush(w->xsk))
+		w->io_stats.tx_calls++;
+	if (w->tx_len == 0)
+		return;
+	nr_msgs = udp_tx_build(w, iovs, segs);
 
-	return re;
+	while (sent < nr_msgs) {
+		rc = sendmmsg(w->sockfd, w->tx_msgs + sent, nr_msgs - sent, 0);
+		w->io_stats.tx_calls++;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Socket buffer full: drop what is left. */
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				for (; sent < nr_msgs; sent++)
+					w->io_stats.tx_drops += segs[sent];
+				break;
+			}
+			/* The device can't take GSO after all, stop using it. */
+			if (segs[sent] > 1 && (errno == EIO || errno == EINVAL)) {
+				fprintf(stderr, "*** UDP GSO send failed: %s, turned off.\n",
+						strerror(errno));
+				w->gso = false;
+			}
+			/* Skip the failing message, try the others. */
+			w->io_stats.tx_drops += segs[sent];
+			sent++;
+			continue;
+		}
+		for (i = 0; i < (unsigned)rc; i++)
+			w->io_stats.tx_packets += segs[sent + i];
+		sent += (unsigned)rc;
+	}
+	w->tx_len = 0;
 }
 
-static inline void ra_put_no_free(struct ra_entry *re)
+static void udp_tx_queue(struct server_worker *w, void *data, size_t len,
+		const struct sockaddr_inx *addr)
 {
-	assert(re->refs > 0);
-	re->refs--;
+	/* Copied into the TX ring at once if the peer is reachable that way. */
+	if (w->xsk && xsk_send(w->xsk, data, len, addr) == 0) {
+		w->io_stats.tx_packets++;
+		return;
+	}
+
+	if (w->tx_len >= config.batch_size)
+		udp_tx_flush(w);
+
+	w->tx_addrs[w->tx_len] = *addr;
+	w->tx_iovs[w->tx_len].iov_base = data;
+	w->tx_iovs[w->tx_len].iov_len = len;
+	w->tx_len++;
 }
 
-static inline void ra_entry_release(struct ra_entry *re)
+/* Counters of all workers summed up, read without locking. */
+static void io_stats_dump(void)
 {
-	char s_real_addr[50];
-
-	assert(re->refs == 0);
-	list_del(&re->list);
-	ra_set_len--;
+	unsigned long rx_calls = 0, rx_packets = 0, rx_full = 0, rx_drops = 0, rx_oversize = 0;
+	unsigned long tx_calls = 0, tx_packets = 0, tx_drops = 0;
+#ifdef HAVE_IO_URING
+	unsigned long tun_read_errors = 0;
+#endif
+	unsigned i;
 
-	inet_ntop(re->real_addr.sa.sa_family, addr_of_sockaddr(&re->real_addr),
-			  s_real_addr, sizeof(s_real_addr));
-	printf("Recycled client [%s:%u]\n", s_real_addr, ntohs(port_of_sockaddr(&re->real_addr)));
+	for (i = 0; i < workers_len; i++) {
+		rx_calls += workers[i].io_stats.rx_calls;
+		rx_packets += workers[i].io_stats.rx_packets;
+		rx_full += workers[i].io_stats.rx_full;
+		rx_drops += workers[i].io_stats.rx_drops;
+		rx_oversize += workers[i].io_stats.rx_oversize;
+		tx_calls += workers[i].io_stats.tx_calls;
+		tx_packets += workers[i].io_stats.tx_packets;
+		tx_drops += workers[i].io_stats.tx_drops;
+	}
 
-	free(re);
+	printf("Batching: rx %lu datagrams / %lu calls (%.1f avg, %lu full, "
+		   "%lu dropped, %lu over MTU), tx %lu datagrams / %lu calls (%lu dropped)\n",
+		   rx_packets, rx_calls, rx_calls ? (double)rx_packets / rx_calls : 0.0,
+		   rx_full, rx_drops, rx_oversize, tx_packets, tx_calls, tx_drops);
+#ifdef HAVE_IO_URING
+	for (i = 0; i < workers_len; i++)
+		tun_read_errors += workers[i].tun_read_errors;
+	if (tun_read_errors)
+		printf("TUN: %lu reads failed, their slots stopped reading\n", tun_read_errors);
+#endif
 }
 
 struct tun_addr {
@@ -167,246 +305,368 @@ struct tun_addr {
 		struct in6_addr in6;
 	};
 };
-struct tun_client {
-	struct list_head list;
-	struct tun_addr virt_addr;
-	struct ra_entry *ra;
-	time_t last_recv;
-	time_t last_xmit;
-};
 
-/* Hash table of virtual address in tunnel. */
-#define VA_MAP_HASH_SIZE  (1 << 4)
-#define VA_MAP_LIMIT_EACH_WALK  (10)
-static struct list_head va_map_hbase[VA_MAP_HASH_SIZE];
-static unsigned va_map_len;
+/**
+ * Pseudo route table for binding client side subnets
+ * to corresponding connected virtual addresses: the
+ * prefixes are in an LPM trie per address family (see
+ * lpm.h) whose values are indexes + 1 in 'vt_gateways'.
+ * Set up before the server starts, read-only after that.
+ */
+static struct lpm vt_lpm4 = { .key_bits = 32, }, vt_lpm6 = { .key_bits = 128, };
+static struct tun_addr *vt_gateways;
+static unsigned vt_gateways_len = 0, vt_gateways_cap = 0;
 
-static inline void init_va_ra_maps(void)
+/* A route to a network of family 'af' through a client address of 'gw_af'. */
+int vt_route_add(int af, const void *network, unsigned prefix,
+		int gw_af, const void *gateway)
 {
-	int i;
+	struct lpm *lpm = af == AF_INET6 ? &vt_lpm6 : &vt_lpm4;
+	struct tun_addr *gateways, *gw;
+	unsigned cap;
 
-	for (i = 0; i < VA_MAP_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&va_map_hbase[i]);
-	va_map_len = 0;
+	if (prefix > lpm->key_bits) {
+		fprintf(stderr, "*** Invalid prefix length %u.\n", prefix);
+		return -1;
+	}
 
-	for (i = 0; i < RA_SET_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&ra_set_hbase[i]);
-	ra_set_len = 0;
+	if (vt_gateways_len >= vt_gateways_cap) {
+		cap = vt_gateways_cap ? vt_gateways_cap * 2 : 16;
+		if (cap > LPM_VALUE_MAX ||
+			(gateways = realloc(vt_gateways, sizeof(*gateways) * cap)) == NULL) {
+			fprintf(stderr, "*** Virtual route table is full.\n");
+			return -1;
+		}
+		vt_gateways = gateways;
+		vt_gateways_cap = cap;
+	}
+	gw = &vt_gateways[vt_gateways_len];
+	memset(gw, 0x0, sizeof(*gw));
+	gw->af = gw_af;
+	if (gw_af == AF_INET6)
+		gw->in6 = *(const struct in6_addr *)gateway;
+	else
+		gw->in = *(const struct in_addr *)gateway;
+	if (lpm_add(lpm, network, prefix, vt_gateways_len + 1) < 0) {
+		fprintf(stderr, "*** [%s] lpm_add(): %s.\n", __FUNCTION__, strerror(errno));
+		return -1;
+	}
+	vt_gateways_len++;
+
+	return 0;
 }
 
-static inline uint32_t tun_addr_hash(const struct tun_addr *addr)
+/* Make the routes added so far take effect. */
+static void vt_routes_build(void)
 {
-	if (addr->af == AF_INET) {
-		return jhash_2words(addr->af, addr->in.s_addr, hash_initval);
-	} else if (addr->af == AF_INET6) {
-		const __be32 *aa = (void *)&addr->in6;
-		return jhash_2words(aa[2], aa[3],
-			jhash_3words(addr->af, aa[0], aa[1], hash_initval));
-	} else {
-		abort();
-		return 0;
+	if ((vt_lpm4.nr_prefixes && lpm_build(&vt_lpm4) < 0) ||
+		(vt_lpm6.nr_prefixes && lpm_build(&vt_lpm6) < 0)) {
+		fprintf(stderr, "*** [%s] lpm_build(): %s.\n", __FUNCTION__, strerror(errno));
+		exit(1);
 	}
 }
 
-static inline int tun_addr_comp(
-		const struct tun_addr *a1, const struct tun_addr *a2)
+static const struct tun_addr *vt_route_lookup(const struct tun_addr *addr)
 {
-	if (a1->af != a2->af)
-		return 1;
+	const struct lpm *lpm = addr->af == AF_INET6 ? &vt_lpm6 : &vt_lpm4;
+	unsigned v;
 
-	if (a1->af == AF_INET) {
-		if (a1->in.s_addr == a2->in.s_addr) {
-			return 0;
-		} else {
-			return 1;
-		}
-	} else if (a1->af == AF_INET6) {
-		if (is_in6_equal(&a1->in6, &a2->in6)) {
-			return 0;
-		} else {
-			return 1;
-		}
-	} else {
-		abort();
-		return 0;
+	if ((v = lpm_lookup(lpm, &addr->in)) == 0)
+		return NULL;
+	return &vt_gateways[v - 1];
+}
+
+/* -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- */
+
+/**
+ * Clients, a session each (see session.h). A session has a timer on the
+ * wheel, set to the time it is to be recycled or sent a keep-alive,
+ * whichever comes first. It is not moved on each packet: when it fires,
+ * the session is checked and the timer set again to the deadline it has
+ * by then.
+ */
+static struct session_store sessions;
+static struct timer_wheel session_wheel;
+static unsigned long allocations_at_start;
+
+/* Clock of the session records. */
+#define session_now()  ((uint32_t)current_ts)
+
+/**
+ * Seconds that the real address holding a virtual one must have been
+ * quiet for a data packet from another real address to take it over
+ * (the client's NAT mapping changed).
+ */
+#define SESSION_ROAM_QUIET  2
+
+/* Time to recycle it, or to send a keep-alive, whichever comes first. */
+static time_t session_deadline(const struct session *s)
+{
+	time_t recv_end = current_ts - (uint32_t)(session_now() - s->last_recv) +
+			config.reconnect_timeo + 1;
+	time_t xmit_end = current_ts - (uint32_t)(session_now() - s->last_xmit) +
+			config.keepalive_timeo + 1;
+
+	return recv_end < xmit_end ? recv_end : xmit_end;
+}
+
+/**
+ * With '--capacity', the sessions and the tables are set up for that
+ * many clients at start, see session_store_init().
+ */
+static inline void init_sessions(void)
+{
+	if (session_store_init(&sessions, config.capacity, hash_initval,
+			config.local_tun_in, config.local_tun_prefix) < 0) {
+		fprintf(stderr, "*** [%s] session_store_init(): %s.\n", __FUNCTION__,
+				strerror(errno));
+		exit(1);
 	}
+	allocations_at_start = session_allocations(&sessions);
+
+	tw_init(&session_wheel, ev_time());
 }
 
-#if 0
-static inline void tun_client_dump(struct tun_client *ce)
+static inline void tun_addr_key(struct addr_key *key, const struct tun_addr *addr)
 {
-	char s_virt_addr[50] = "", s_real_addr[50] = "";
+	addr_key_set(key, addr->af, &addr->in, 0);
+}
 
-	inet_ntop(ce->virt_addr.af, &ce->virt_addr.in, s_virt_addr,
-			  sizeof(s_virt_addr));
-	inet_ntop(ce->ra->real_addr.sa.sa_family, addr_of_sockaddr(&ce->ra->real_addr),
-			  s_real_addr, sizeof(s_real_addr));
-	printf("[%s] (%s:%u), last_recv: %lu, last_xmit: %lu\n", s_virt_addr,
-			s_real_addr, ntohs(port_of_sockaddr(&ce->ra->real_addr)),
-			(unsigned long)ce->last_recv, (unsigned long)ce->last_xmit);
+static inline struct session *session_of_virt(const struct tun_addr *vaddr)
+{
+	return session_find_virt(&sessions, vaddr->af, &vaddr->in);
 }
-#endif
 
-static inline void tun_client_release(struct tun_client *ce)
+/* Authentication failures in a row from one peer, of the worker thread. */
+static __thread struct {
+	struct sockaddr_inx peer;
+	unsigned failed;
+	time_t hinted;
+} auth_fails;
+
+static void auth_failure_note(const struct sockaddr_inx *peer)
 {
-	char s_virt_addr[50], s_real_addr[50];
+	char s_addr[INET6_ADDRSTRLEN];
 
-	inet_ntop(ce->virt_addr.af, &ce->virt_addr.in, s_virt_addr,
-			  sizeof(s_virt_addr));
-	inet_ntop(ce->ra->real_addr.sa.sa_family, addr_of_sockaddr(&ce->ra->real_addr),
-			  s_real_addr, sizeof(s_real_addr));
-	printf("Recycled virtual address [%s] at [%s:%u].\n", s_virt_addr, s_real_addr,
-			ntohs(port_of_sockaddr(&ce->ra->real_addr)));
+	if (!is_sockaddr_equal(peer, &auth_fails.peer)) {
+		auth_fails.peer = *peer;
+		auth_fails.failed = 0;
+	}
+	if (++auth_fails.failed < AUTH_HINT_RUN ||
+		current_ts - auth_fails.hinted < AUTH_HINT_INTERVAL)
+		return;
+	auth_fails.hinted = current_ts;
+	auth_fails.failed = 0;
+
+	inet_ntop(peer->sa.sa_family, addr_of_sockaddr(peer), s_addr, sizeof(s_addr));
+	fprintf(stderr, "*** No datagram from [%s:%u] passes authentication: "
+			"different key, or cipher type mismatch ('-t')?\n",
+			s_addr, ntohs(port_of_sockaddr(peer)));
+}
 
-	ra_put_no_free(ce->ra);
+static void session_real_ntop(const struct session *s, char *buf, size_t len)
+{
+	char s_addr[INET6_ADDRSTRLEN];
 
-	list_del(&ce->list);
-	va_map_len--;
+	inet_ntop(s->real_addr.sa.sa_family, addr_of_sockaddr(&s->real_addr),
+			  s_addr, sizeof(s_addr));
+	snprintf(buf, len, "%s:%u", s_addr, ntohs(port_of_sockaddr(&s->real_addr)));
+}
 
-	free(ce);
+/**
+ * Destinations reached through a '-v' route, mapped to the session of
+ * the gateway: a small direct-mapped cache in front of the route lookup,
+ * so that traffic fanning out over a routed subnet keeps no state per
+ * address. Entries only hold for the generation they were made in, which
+ * goes up whenever a virtual address is bound, unbound or recycled. One
+ * per worker, as it is filled in on lookups.
+ */
+#define VT_CACHE_SIZE  (1 << 10)
+struct vt_cache_entry {
+	struct addr_key dest;
+	unsigned gen;
+	struct session *s;
+};
+static __thread struct vt_cache_entry vt_cache[VT_CACHE_SIZE];
+static unsigned vt_cache_gen = 1;
+
+/* Session of the gateway that 'dest' is routed through, if it is online. */
+static struct session *vt_route_dest(const struct tun_addr *dest)
+{
+	const struct tun_addr *gw;
+	struct vt_cache_entry *vc;
+	struct session *s;
+	struct addr_key key;
+
+	tun_addr_key(&key, dest);
+	vc = &vt_cache[jhash2((const uint32_t *)&key, sizeof(key) / 4, hash_initval) &
+			(VT_CACHE_SIZE - 1)];
+	if (vc->gen == vt_cache_gen && memcmp(&vc->dest, &key, sizeof(key)) == 0)
+		return vc->s;
+
+	if ((gw = vt_route_lookup(dest)) == NULL || (s = session_of_virt(gw)) == NULL)
+		return NULL;
+	vc->dest = key;
+	vc->gen = vt_cache_gen;
+	vc->s = s;
+	return s;
 }
 
-static struct tun_client *tun_client_try_get(const struct tun_addr *vaddr)
+/**
+ * Session of the client that a packet from 'vaddr' comes from: the one
+ * with that address, else the gateway of a route it is in ('*routed').
+ */
+static struct session *session_of_source(const struct tun_addr *vaddr, bool *routed)
 {
-	struct list_head *chain = &va_map_hbase[
-		tun_addr_hash(vaddr) & (VA_MAP_HASH_SIZE - 1)];
-	struct tun_client *ce;
+	struct session *s;
 
-	list_for_each_entry (ce, chain, list) {
-		if (tun_addr_comp(&ce->virt_addr, vaddr) == 0)
-			return ce;
-	}
-	return NULL;
+	*routed = false;
+	if ((s = session_of_virt(vaddr)) == NULL && (s = vt_route_dest(vaddr)))
+		*routed = true;
+	return s;
 }
 
-static struct tun_client *tun_client_get_or_create(
-		const struct tun_addr *vaddr, const struct sockaddr_inx *raddr)
+static struct session *session_get_or_create(const struct sockaddr_inx *sa)
 {
-	struct list_head *chain = &va_map_hbase[
-		tun_addr_hash(vaddr) & (VA_MAP_HASH_SIZE - 1)];
-	struct tun_client *ce, *__ce;
-	char s_virt_addr[50], s_real_addr[50];
+	struct session *s;
+	char s_real_addr[64];
 
-	list_for_each_entry_safe (ce, __ce, chain, list) {
-		if (tun_addr_comp(&ce->virt_addr, vaddr) == 0) {
-			if (!is_sockaddr_equal(&ce->ra->real_addr, raddr)) {
-				/* Real address changed, reassign a new entry for it. */
-				ra_put_no_free(ce->ra);
-				if ((ce->ra = ra_get_or_create(raddr)) == NULL) {
-					tun_client_release(ce);
-					return NULL;
-				}
-			}
-			return ce;
-		}
-	}
+	if ((s = session_find_real(&sessions, sa)))
+		return s;
 
-	/* Not found, always create new entry. */
-	if ((ce = malloc(sizeof(*ce))) == NULL) {
-		fprintf(stderr, "*** [%s] malloc(): %s.\n", __FUNCTION__,
+	if ((s = session_new(&sessions, sa)) == NULL) {
+		fprintf(stderr, "*** [%s] session_new(): %s.\n", __FUNCTION__,
 				strerror(errno));
 		return NULL;
 	}
+	s->last_recv = session_now();
+	s->last_xmit = session_now();
+	tw_add(&session_wheel, &session_cold(&sessions, s)->timer, session_deadline(s));
 
-	ce->virt_addr = *vaddr;
+	session_real_ntop(s, s_real_addr, sizeof(s_real_addr));
+	printf("New client [%s]\n", s_real_addr);
 
-	/* Get real_addr entry before adding to list. */
-	if ((ce->ra = ra_get_or_create(raddr)) == NULL) {
-		free(ce);
-		return NULL;
+	return s;
+}
+
+static void session_unbind_virt(struct session *s, int af)
+{
+	char s_virt_addr[INET6_ADDRSTRLEN], s_real_addr[64];
+
+	if (!session_has_virt(s, af))
+		return;
+	inet_ntop(af, af == AF_INET6 ? (void *)&s->virt_in6 : (void *)&s->virt_in,
+			  s_virt_addr, sizeof(s_virt_addr));
+	session_real_ntop(s, s_real_addr, sizeof(s_real_addr));
+	printf("Recycled virtual address [%s] at [%s].\n", s_virt_addr, s_real_addr);
+
+	session_clear_virt(&sessions, s, af);
+	vt_cache_gen++;
+}
+
+/**
+ * Make 'vaddr' a virtual address of 's'. With 'replace' (the client
+ * told it in a keep-alive, or it roamed), it takes the place of the one
+ * 's' has of that family, and is taken from the session that holds it
+ * if there is one (the client came back from another real address).
+ * Without, it is only bound if neither 's' has an address of that
+ * family nor another session has this one.
+ */
+static void session_bind_virt(struct session *s, const struct tun_addr *vaddr,
+		bool replace)
+{
+	struct session *old = session_of_virt(vaddr);
+	char s_virt_addr[INET6_ADDRSTRLEN], s_real_addr[64];
+
+	if (old == s || (!replace && (old || session_has_virt(s, vaddr->af))))
+		return;
+	if (old)
+		session_unbind_virt(old, vaddr->af);
+	session_unbind_virt(s, vaddr->af);
+
+	if (session_set_virt(&sessions, s, vaddr->af, &vaddr->in) < 0) {
+		fprintf(stderr, "*** [%s] session_set_virt(): %s.\n", __FUNCTION__,
+				strerror(errno));
+		return;
 	}
-	list_add_tail(&ce->list, chain);
-	va_map_len++;
+	vt_cache_gen++;
 
-	inet_ntop(ce->virt_addr.af, &ce->virt_addr.in, s_virt_addr,
-			  sizeof(s_virt_addr));
-	inet_ntop(ce->ra->real_addr.sa.sa_family, addr_of_sockaddr(&ce->ra->real_addr),
-			  s_real_addr, sizeof(s_real_addr));
-	printf("New virtual address [%s] at [%s:%u].\n", s_virt_addr, s_real_addr,
-			ntohs(port_of_sockaddr(&ce->ra->real_addr)));
+	inet_ntop(vaddr->af, &vaddr->in, s_virt_addr, sizeof(s_virt_addr));
+	session_real_ntop(s, s_real_addr, sizeof(s_real_addr));
+	printf("New virtual address [%s] at [%s].\n", s_virt_addr, s_real_addr);
+}
+
+/* Its timer must be off the wheel or on a list of due ones. */
+static void session_release(struct session *s)
+{
+	char s_real_addr[64];
 
-	return ce;
+	session_unbind_virt(s, AF_INET);
+	session_unbind_virt(s, AF_INET6);
+	tw_del(&session_wheel, &session_cold(&sessions, s)->timer);
+
+	session_real_ntop(s, s_real_addr, sizeof(s_real_addr));
+	printf("Recycled client [%s]\n", s_real_addr);
+
+	session_delete(&sessions, s);
 }
 
 /**
  * Send keep-alive packet to the corresponding client
- * with information stored in 're'.
+ * with information stored in 's'.
  */
-static int ra_entry_keepalive(struct ra_entry *re, int sockfd)
+static int session_keepalive(struct session *s, int sockfd)
 {
-	char in_data[64], crypt_buffer[64];
-	struct minivtun_msg *nmsg = (struct minivtun_msg *)in_data;
+	struct minivtun_keepalive_msg msg;
+	char crypt_buffer[64];
 	void *out_msg;
 	size_t out_len;
 	int rc;
 
-	nmsg->hdr.opcode = MINIVTUN_MSG_KEEPALIVE;
-	memset(nmsg->hdr.rsv, 0x0, sizeof(nmsg->hdr.rsv));
-	memcpy(nmsg->hdr.auth_key, config.crypto_key, sizeof(nmsg->hdr.auth_key));
-	nmsg->keepalive.loc_tun_in = config.local_tun_in;
-	nmsg->keepalive.loc_tun_in6 = config.local_tun_in6;
+	msg.hdr.opcode = MINIVTUN_MSG_KEEPALIVE;
+	memset(msg.hdr.rsv, 0x0, sizeof(msg.hdr.rsv));
+	memcpy(msg.hdr.auth_key, config.crypto_key, sizeof(msg.hdr.auth_key));
+	msg.keepalive.loc_tun_in = config.local_tun_in;
+	msg.keepalive.loc_tun_in6 = config.local_tun_in6;
 
 	out_msg = crypt_buffer;
-	out_len = MINIVTUN_MSG_BASIC_HLEN + sizeof(nmsg->keepalive);
-	local_to_netmsg(nmsg, &out_msg, &out_len);
+	out_len = MINIVTUN_MSG_BASIC_HLEN + sizeof(msg.keepalive);
+	local_to_netmsg(&msg, &out_msg, &out_len);
 
-	rc = (int)sendto(sockfd, out_msg, out_len, 0, (struct sockaddr *)&re->real_addr,
-				sizeof_sockaddr(&re->real_addr));
+	rc = (int)sendto(sockfd, out_msg, out_len, 0, (struct sockaddr *)&s->real_addr,
+				sizeof_sockaddr(&s->real_addr));
 
 	/* Update 'last_xmit' only when it's really sent out. */
 	if (rc > 0) {
-		re->last_xmit = current_ts;
+		s->last_xmit = session_now();
 	}
 
 	return rc;
 }
 
-static void va_ra_walk_continue(int sockfd)
+/**
+ * Recycle the sessions that timed out and send keep-alives to the ones
+ * that need them, visiting only those whose timers are due.
+ */
+static void session_timers_run(int sockfd)
 {
-	static unsigned va_index = 0, ra_index = 0;
-	unsigned va_walk_max = VA_MAP_LIMIT_EACH_WALK, va_count = 0;
-	unsigned ra_walk_max = RA_SET_LIMIT_EACH_WALK, ra_count = 0;
-	unsigned __va_index = va_index, __ra_index = ra_index;
-	struct tun_client *ce, *__ce;
-	struct ra_entry *re, *__re;
-
-	if (va_walk_max > va_map_len)
-		va_walk_max = va_map_len;
-	if (ra_walk_max > ra_set_len)
-		ra_walk_max = ra_set_len;
-
-	/* Recycle timeout virtual address entries. */
-	if (va_walk_max > 0) {
-		do {
-			list_for_each_entry_safe (ce, __ce, &va_map_hbase[va_index], list) {
-				//tun_client_dump(ce);
-				if (current_ts - ce->last_recv > config.reconnect_timeo) {
-					tun_client_release(ce);
-				}
-				va_count++;
-			}
-			va_index = (va_index + 1) & (VA_MAP_HASH_SIZE - 1);
-		} while (va_count < va_walk_max && va_index != __va_index);
-	}
-
-	/* Recycle or keep-alive real client addresses. */
-	if (ra_walk_max > 0) {
-		do {
-			list_for_each_entry_safe (re, __re, &ra_set_hbase[ra_index], list) {
-				if (current_ts - re->last_recv > config.reconnect_timeo) {
-					if (re->refs == 0) {
-						ra_entry_release(re);
-					}
-				} else if (current_ts - re->last_xmit > config.keepalive_timeo) {
-					ra_entry_keepalive(re, sockfd);
-				}
-				ra_count++;
-			}
-			ra_index = (ra_index + 1) & (RA_SET_HASH_SIZE - 1);
-		} while (ra_count < ra_walk_max && ra_index != __ra_index);
+	struct list_head due;
+	struct tw_timer *t, *__t;
+	struct session *s;
+
+	INIT_LIST_HEAD(&due);
+	tw_advance(&session_wheel, current_ts, &due);
+	list_for_each_entry_safe (t, __t, &due, list) {
+		s = session_get(&sessions, container_of(t, struct session_cold, timer)->id);
+		if (session_now() - s->last_recv > config.reconnect_timeo) {
+			session_release(s);
+			continue;
+		}
+		if (session_now() - s->last_xmit > config.keepalive_timeo)
+			session_keepalive(s, sockfd);
+		/* Overdue if the keep-alive didn't go out: retried with the next tick. */
+		tw_add(&session_wheel, t, session_deadline(s));
 	}
-
-	printf("Online clients: %u, addresses: %u\n", ra_set_len, va_map_len);
 }
 
 static inline void source_addr_of_ipdata(
@@ -441,74 +701,120 @@ static inline void dest_addr_of_ipdata(
 	}
 }
 
+/**
+ * A packet from 'vaddr' came in from 'real_peer', which is not known as
+ * the client of that address: find or make the session of 'real_peer',
+ * which may take the address. -1 if no session could be made.
+ */
+static int session_source_learn(const struct tun_addr *vaddr,
+		const struct sockaddr_inx *real_peer)
+{
+	struct session *s, *old;
+	bool routed;
+
+	tables_write_lock();
+	/* It may have changed since it was looked up. */
+	s = session_of_source(vaddr, &routed);
+	if (s == NULL || !is_sockaddr_equal(&s->real_addr, real_peer)) {
+		old = routed ? NULL : s;
+		if ((s = session_get_or_create(real_peer)) == NULL) {
+			tables_write_unlock();
+			return -1;
+		}
+		/**
+		 * The address of a client whose old real address has gone
+		 * quiet moves over to the new one, as the client roamed or
+		 * its NAT mapping changed. Hosts in a subnet routed to this
+		 * client get no binding of their own, nor do link-local
+		 * addresses; any other source is taken as the client's
+		 * address if it has none yet and no other client holds it.
+		 */
+		if (old && session_now() - old->last_recv >= SESSION_ROAM_QUIET)
+			session_bind_virt(s, vaddr, true);
+		else if (!routed && !(vaddr->af == AF_INET6 && IN6_IS_ADDR_LINKLOCAL(&vaddr->in6)))
+			session_bind_virt(s, vaddr, false);
+	}
+	s->last_recv = session_now();
+	tables_write_unlock();
+	return 0;
+}
+
 // This would get called when we have data to receive from a normal interface, i.e. from sockfd
-static int network_receiving(int tunfd, int sockfd)
+/**
+ * Decrypt one datagram from the network into 'out_buffer' and handle it.
+ * Returns the length of the IP packet in '*to_tun' that is to be written
+ * to the tunnel, 0 if there is none, or -1 if the datagram was dropped.
+ */
+static ssize_t network_msg_parse(void *read_buffer, size_t rlen,
+		struct sockaddr_inx *real_peer_p, void *out_buffer,
+		struct minivtun_msg **to_tun)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
+	struct sockaddr_inx real_peer = *real_peer_p;
 	struct minivtun_msg *nmsg;
-	struct tun_pi pi;
 	void *out_data;
 	size_t ip_dlen, out_dlen;
 	unsigned short af = 0;
-	struct tun_addr virt_addr;
-	struct tun_client *ce;
-	struct ra_entry *re;
-	struct sockaddr_inx real_peer;
-	socklen_t real_peer_alen;
-	struct iovec iov[2];
-	int rc;
-
-    // 1. Read a 'struct sockaddr_inx' from sockfd 
-	real_peer_alen = sizeof(real_peer);
-	rc = (int)recvfrom(sockfd, &read_buffer, NM_PI_BUFFER_SIZE, 0,
-			(struct sockaddr *)&real_peer, &real_peer_alen);
-	if (rc <= 0)
-		return 0;
+	struct tun_addr virt_addr, ka_in, ka_in6;
+	struct session *s;
+	bool routed;
 
 #if DEBUG
-    printf("network_receiving: received %d bytes\n", rc);
-	hexdump(read_buffer, rc);
+    printf("network_receiving: received %zu bytes\n", rlen);
+	hexdump(read_buffer, rlen);
 #endif
 
-	out_data = crypt_buffer;
-	out_dlen = (size_t)rc;
-	netmsg_to_local(read_buffer, &out_data, &out_dlen);
+	out_data = out_buffer;
+	out_dlen = rlen;
+	if (netmsg_to_local(read_buffer, &out_data, &out_dlen) != 0) {
+		auth_failure_note(&real_peer);
+		return -1;
+	}
+	if (auth_fails.failed && is_sockaddr_equal(&real_peer, &auth_fails.peer))
+		auth_fails.failed = 0;
 	nmsg = out_data;
-
-	if (out_dlen < MINIVTUN_MSG_BASIC_HLEN)
-		return 0;
  
  #if DEBUG
     dump_nmsg(nmsg);
  #endif
 
-	/* Verify password. */
-	if (memcmp(nmsg->hdr.auth_key, config.crypto_key,
-		sizeof(nmsg->hdr.auth_key)) != 0)
-		return 0;
-
 	switch (nmsg->hdr.opcode) {
 
 		// Keepalive packet
 	case MINIVTUN_MSG_KEEPALIVE:
-		if ((re = ra_get_or_create(&real_peer))) {
-			re->last_recv = current_ts;
-			ra_put_no_free(re);
-		}
 		if (out_dlen < MINIVTUN_MSG_BASIC_HLEN + sizeof(nmsg->keepalive))
-			return 0;
-		if (is_valid_unicast_in(&nmsg->keepalive.loc_tun_in)) {
-			virt_addr.af = AF_INET;
-			virt_addr.in = nmsg->keepalive.loc_tun_in;
-			if ((ce = tun_client_get_or_create(&virt_addr, &real_peer)))
-				ce->last_recv = current_ts;
+			return -1;
+		/* The addresses the client tells are its own, whatever it had. */
+		ka_in.af = AF_INET;
+		ka_in.in = nmsg->keepalive.loc_tun_in;
+		if (!is_valid_unicast_in(&ka_in.in))
+			ka_in.af = 0;
+		ka_in6.af = AF_INET6;
+		ka_in6.in6 = nmsg->keepalive.loc_tun_in6;
+		if (!is_valid_unicast_in6(&ka_in6.in6))
+			ka_in6.af = 0;
+
+		/* Mostly from a known client that has these already. */
+		tables_read_lock();
+		if ((s = session_find_real(&sessions, &real_peer)) &&
+			(!ka_in.af || s->virt_in.s_addr == ka_in.in.s_addr) &&
+			(!ka_in6.af || is_in6_equal(&s->virt_in6, &ka_in6.in6))) {
+			session_stamp(&s->last_recv, session_now());
+			tables_read_unlock();
+			break;
 		}
-		if (is_valid_unicast_in6(&nmsg->keepalive.loc_tun_in6)) {
-			virt_addr.af = AF_INET6;
-			virt_addr.in6 = nmsg->keepalive.loc_tun_in6;
-			if ((ce = tun_client_get_or_create(&virt_addr, &real_peer)))
-				ce->last_recv = current_ts;
+		tables_read_unlock();
+
+		tables_write_lock();
+		if ((s = session_get_or_create(&real_peer)) == NULL) {
+			tables_write_unlock();
+			return -1;
 		}
+		s->last_recv = session_now();
+		if (ka_in.af)
+			session_bind_virt(s, &ka_in, true);
+		if (ka_in6.af)
+			session_bind_virt(s, &ka_in6, true);
+		tables_write_unlock();
 		break;
 
 		// data packet
@@ -517,178 +823,736 @@ static int network_receiving(int tunfd, int sockfd)
 			af = AF_INET;
 			/* No packet is shorter than a 20-byte IPv4 header. */
 			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 20)
-				return 0;
+				return -1;
 		} else if (nmsg->ipdata.proto == htons(ETH_P_IPV6)) {
 			af = AF_INET6;
 			if (out_dlen < MINIVTUN_MSG_IPDATA_OFFSET + 40)
-				return 0;
+				return -1;
 		} else {
 			fprintf(stderr, "*** Invalid protocol: 0x%x.\n", ntohs(nmsg->ipdata.proto));
-			return 0;
+			return -1;
 		}
 
 		ip_dlen = ntohs(nmsg->ipdata.ip_dlen);
 		/* Drop incomplete IP packets. */
 		if (out_dlen - MINIVTUN_MSG_IPDATA_OFFSET < ip_dlen)
-			return 0;
+			return -1;
 
 		source_addr_of_ipdata(nmsg->ipdata.data, af, &virt_addr);
-		if ((ce = tun_client_get_or_create(&virt_addr, &real_peer)) == NULL)
-			return 0;
-
-		ce->last_recv = current_ts;
-		ce->ra->last_recv = current_ts;
-
-		//pi.flags = 0;
-		// pi.proto = nmsg->ipdata.proto;
-		//osx_ether_to_af(&pi.proto);
-		set_pi_with_ether_proto(&pi, ntohs(nmsg->ipdata.proto));
-		iov[0].iov_base = &pi;
-		iov[0].iov_len = sizeof(pi);
-		iov[1].iov_base = (char *)nmsg + MINIVTUN_MSG_IPDATA_OFFSET;
-		iov[1].iov_len = ip_dlen;
-		rc = (int)writev(tunfd, iov, 2);
+
+		/* Mostly from the client of the source address, nothing to change. */
+		tables_read_lock();
+		s = session_of_source(&virt_addr, &routed);
+		if (s && is_sockaddr_equal(&s->real_addr, &real_peer)) {
+			session_stamp(&s->last_recv, session_now());
+			tables_read_unlock();
+		} else {
+			tables_read_unlock();
+			if (session_source_learn(&virt_addr, &real_peer) < 0)
+				return -1;
+		}
 
 #ifdef DEBUG
         printf("Write to tun: ");
-		hexdump(iov[0].iov_base, iov[0].iov_len);
-		hexdump(iov[1].iov_base, iov[1].iov_len);
+		hexdump(nmsg->ipdata.data, ip_dlen);
 #endif
 
-		break;
+		*to_tun = nmsg;
+		return (ssize_t)ip_dlen;
 	}
 
 	return 0;
 }
 
-// When sth. readable from tun interface.
-static int tunnel_receiving(int tunfd, int sockfd)
+/* Handle one datagram from the network, -1 if it was dropped. */
+static int network_msg_handle(struct server_worker *w, void *read_buffer,
+		size_t rlen, struct sockaddr_inx *real_peer)
 {
-	char read_buffer[NM_PI_BUFFER_SIZE], crypt_buffer[NM_PI_BUFFER_SIZE];
-	struct tun_pi *pi = (void *)read_buffer;
-	struct minivtun_msg nmsg;
-	void *out_data;
-	size_t ip_dlen, out_dlen;
-	unsigned short af = 0;
-	struct tun_addr virt_addr;
-	struct tun_client *ce;
+	struct minivtun_msg *nmsg;
+	ssize_t ip_dlen;
+
+	/* Bigger than a packet buffer, must be off a GRO run or AF_XDP. */
+	if (rlen > w->pool.size) {
+		w->io_stats.rx_oversize++;
+		return -1;
+	}
+	ip_dlen = network_msg_parse(read_buffer, rlen, real_peer, w->crypt_buffer, &nmsg);
+	if (ip_dlen > 0 && w->tun_gro)
+		tun_gro_write(w->tun_gro, w->tunfd, nmsg->ipdata.data, (size_t)ip_dlen);
+	else if (ip_dlen > 0)
+		tun_write_ipdata(w->tunfd, nmsg, (size_t)ip_dlen);
+	return ip_dlen < 0 ? -1 : 0;
+}
+
+/* Cut a coalesced receive at 'seg' bytes and handle each datagram. */
+static void network_run_handle(struct server_worker *w, char *buffer,
+		size_t rlen, size_t seg, struct sockaddr_inx *real_peer)
+{
+	size_t off, len;
+
+	if (seg == 0 || seg > rlen)
+		seg = rlen;
+	for (off = 0; off < rlen; off += len) {
+		len = rlen - off < seg ? rlen - off : seg;
+		w->io_stats.rx_packets++;
+		if (network_msg_handle(w, buffer + off, len, real_peer) < 0)
+			w->io_stats.rx_drops++;
+	}
+}
+
+/**
+ * When sth. readable from the socket: take one recvmmsg() batch.
+ * EV_MORE if it came back full, there may be more.
+ */
+static int network_receiving(struct server_worker *w)
+{
+	struct mmsghdr msgs[NM_BATCH_MAX];
+	struct iovec iovs[NM_BATCH_MAX];
+	unsigned batch = w->gro ? w->gro_slots : config.batch_size, i;
 	int rc;
 
-	rc = (int)read(tunfd, pi, NM_PI_BUFFER_SIZE);
-#if DEBUG	
-	if ( rc < 0 ) {
-	   perror("read");
-	   abort();
+	for (i = 0; i < batch; i++) {
+		memset(&msgs[i].msg_hdr, 0x0, sizeof(msgs[i].msg_hdr));
+		if (w->gro) {
+			iovs[i].iov_base = w->gro_buffers[i];
+			iovs[i].iov_len = UDP_GRO_BUFFER_SIZE;
+			msgs[i].msg_hdr.msg_control = w->rx_cmsgs[i].buf;
+			msgs[i].msg_hdr.msg_controllen = sizeof(w->rx_cmsgs[i].buf);
+		} else {
+			iovs[i].iov_base = w->read_buffers[i];
+			iovs[i].iov_len = w->pool.size;
+		}
+		msgs[i].msg_hdr.msg_name = &w->real_peers[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(w->real_peers[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
-    printf("tunnel_receiving:\n");
-	hexdump(read_buffer, rc);
-#endif
+	rc = recvmmsg(w->sockfd, msgs, batch, 0, NULL);
+	if (rc <= 0)
+		return EV_IDLE;
+	w->io_stats.rx_calls++;
+
+	for (i = 0; i < (unsigned)rc; i++) {
+		/* From a peer with a bigger '-m', of no use cut short. */
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			w->io_stats.rx_packets++;
+			w->io_stats.rx_drops++;
+			w->io_stats.rx_oversize++;
+			continue;
+		}
+		network_run_handle(w, iovs[i].iov_base, msgs[i].msg_len,
+				udp_gro_segment(&msgs[i].msg_hdr), &w->real_peers[i]);
+	}
+	if (w->tun_gro)
+		tun_gro_flush(w->tun_gro, w->tunfd);
 
-	if (rc < sizeof(struct tun_pi))
+	if ((unsigned)rc < batch)
 		return 0;
+	w->io_stats.rx_full++;
+	return EV_MORE;
+}
 
-	// osx_af_to_ether(&pi->proto);
-
-	ip_dlen = (size_t)rc - sizeof(struct tun_pi);
-
-	/* We only accept IPv4 or IPv6 frames. */
-	/*
-	if (pi->proto == htons(ETH_P_IP)) {
-		af = AF_INET;
-		if (ip_dlen < 20)
-			return 0;
-	} else if (pi->proto == htons(ETH_P_IPV6)) {
-		af = AF_INET6;
-		if (ip_dlen < 40)
-			return 0;
-	} else {
-		fprintf(stderr, "*** Invalid protocol: 0x%x.\n", ntohs(pi->proto));
-		return 0;
+/**
+ * Find the client that the IP packet in 'nmsg' should go to,
+ * NULL if there is none.
+ */
+static struct session *tunnel_nmsg_dest(struct minivtun_msg *nmsg)
+{
+	unsigned short af;
+	struct tun_addr virt_addr;
+	struct session *s;
+
+	af = nmsg->ipdata.proto == htons(ETH_P_IP) ? AF_INET : AF_INET6;
+	dest_addr_of_ipdata(nmsg->ipdata.data, af, &virt_addr);
+
+	/**
+	 * If not an existing client address, the pseudo route
+	 * table tells which client to send it to.
+	 */
+	if ((s = session_of_virt(&virt_addr)) == NULL)
+		s = vt_route_dest(&virt_addr);
+
+	return s;
+}
+
+/**
+ * Find the destinations of a burst of packets read from the tunnel and
+ * encrypt in place the ones that have one. 'dg[]' and 'real_addrs[]' are
+ * filled in for these, 'which[]' tells their indexes in 'msgs[]'.
+ * Returns how many there are to send.
+ */
+static unsigned tunnel_burst_seal(struct minivtun_msg **msgs, const ssize_t *lens,
+		unsigned nr, struct crypto_datagram *dg, struct sockaddr_inx *real_addrs,
+		unsigned *which)
+{
+	struct session *s;
+	unsigned n = 0, i;
+
+	/* Destinations of the whole burst under one lock. */
+	tables_read_lock();
+	for (i = 0; i < nr; i++) {
+		if ((s = tunnel_nmsg_dest(msgs[i])) == NULL)
+			continue;
+
+		session_stamp(&s->last_xmit, session_now());
+		real_addrs[n] = s->real_addr;
+		dg[n].in = msgs[i];
+		dg[n].out = msgs[i];
+		dg[n].len = (size_t)lens[i];
+		which[n] = i;
+		n++;
+	}
+	tables_read_unlock();
+
+	local_to_netmsg_batch(dg, n);
+
+	return n;
+}
+
+/**
+ * When sth. readable from tun interface: take one burst of packets.
+ * EV_MORE if the burst is full, there may be more.
+ */
+static int tunnel_receiving(struct server_worker *w)
+{
+	struct minivtun_msg *msgs[NM_BATCH_MAX];
+	struct sockaddr_inx real_addrs[NM_BATCH_MAX];
+	struct crypto_datagram dg[NM_BATCH_MAX];
+	unsigned which[NM_BATCH_MAX];
+	unsigned nr_read = 0, n, i;
+	ssize_t lens[NM_BATCH_MAX], len = -1;
+
+	/**
+	 * Packets are read in behind their message headers and encrypted
+	 * in place, a burst at a time: no copies on the way out. They are
+	 * sent with the queue flush at the end of the event loop round.
+	 */
+	while (nr_read < config.batch_size) {
+		msgs[nr_read] = w->nmsgs[nr_read];
+		if ((len = tun_read_to_nmsg(w->tunfd, w->tso, msgs[nr_read])) < 0)
+			break;
+		if (len == 0)
+			continue;
+
+#if DEBUG	
+		printf("tunnel_receiving:\n");
+		hexdump(msgs[nr_read]->ipdata.data, ntohs(msgs[nr_read]->ipdata.ip_dlen));
+#endif
+
+		lens[nr_read++] = len;
 	}
-	*/
-	af = get_family_from_pi(pi);
 
-	if ( af == AF_INET ) {
-	   if ( ip_dlen < 20 )
-	      return 0;
+	n = tunnel_burst_seal(msgs, lens, nr_read, dg, real_addrs, which);
+
+	for (i = 0; i < n; i++) {
+#if DEBUG
+		printf("out data:\n");
+		hexdump(dg[i].out, dg[i].len);
+#endif	
+
+		udp_tx_queue(w, dg[i].out, dg[i].len, &real_addrs[i]);
 	}
-	else if ( af == AF_INET6 ) {
-	   if ( ip_dlen < 40 )
-	      return 0;
+
+	if (len >= 0)
+		return EV_MORE;
+	return nr_read ? 0 : EV_IDLE;
+}
+
+/**
+ * When sth. readable from the AF_XDP socket: one batch off its RX ring,
+ * the same way as from the UDP socket, the way back to each peer learnt
+ * from what passed. EV_MORE if the batch is full.
+ */
+static int xsk_receiving(struct server_worker *w)
+{
+	struct xsk_rx rx[NM_BATCH_MAX];
+	unsigned n, i;
+
+	n = xsk_recv(w->xsk, rx, config.batch_size);
+	if (n == 0) {
+		xsk_recv_done(w->xsk);
+		return EV_IDLE;
 	}
-	else {   
-		fprintf(stderr, "*** Invalid protocol: 0x%x.\n", get_ether_proto_from_pi(pi));
+	w->io_stats.rx_calls++;
+
+	for (i = 0; i < n; i++) {
+		w->io_stats.rx_packets++;
+		if (rx[i].data == NULL ||
+			network_msg_handle(w, rx[i].data, rx[i].len, &rx[i].peer) < 0)
+			w->io_stats.rx_drops++;
+		else
+			xsk_learn(w->xsk, &rx[i]);
+	}
+	if (w->tun_gro)
+		tun_gro_flush(w->tun_gro, w->tunfd);
+	xsk_recv_done(w->xsk);
+
+	if (n < config.batch_size)
 		return 0;
+	w->io_stats.rx_full++;
+	return EV_MORE;
+}
+
+static int on_xsk_readable(struct ev_loop *loop, struct ev_io *io)
+{
+	current_ts = loop->now;
+	return xsk_receiving(io->data);
+}
+
+static int on_sock_readable(struct ev_loop *loop, struct ev_io *io)
+{
+	current_ts = loop->now;
+	return network_receiving(io->data);
+}
+
+static int on_tun_readable(struct ev_loop *loop, struct ev_io *io)
+{
+	current_ts = loop->now;
+	return tunnel_receiving(io->data);
+}
+
+/**
+ * Tick the client timers every second, and show the state every 3
+ * seconds, on the first worker.
+ */
+static void on_walk_timer(struct ev_loop *loop, struct ev_timer *timer)
+{
+	struct server_worker *w = timer->data;
+	static time_t last_dump;
+
+	current_ts = loop->now;
+	tables_write_lock();
+	session_timers_run(w->sockfd);
+	if (current_ts - last_dump >= 3) {
+		last_dump = current_ts;
+		printf("Online clients: %u, addresses: %u, allocations: %lu, memory: %zuK\n",
+				session_count(&sessions), session_virt_count(&sessions),
+				session_allocations(&sessions) - allocations_at_start,
+				session_memory(&sessions) / 1024);
+		io_stats_dump();
 	}
+	tables_write_unlock();
+}
 
-	dest_addr_of_ipdata(pi + 1, af, &virt_addr);
+static int server_socket_open(const struct sockaddr_inx *loc_addr)
+{
+	int sockfd;
 
-	if ((ce = tun_client_try_get(&virt_addr)) == NULL) {
-		/**
-		 * Not an existing client address, lookup the pseudo
-		 * route table for a destination to send.
-		 */
-		if (virt_addr.af == AF_INET) {
-			struct in_addr *gw;
-			struct tun_addr __virt_addr;
-
-			/* Lookup the gateway virtual address first. */
-			if ((gw = vt_route_lookup(&virt_addr.in)) == NULL)
-				return 0;
-
-			/* Then get the gateway client entry. */
-			memset(&__virt_addr, 0x0, sizeof(__virt_addr));
-			__virt_addr.af = AF_INET;
-			__virt_addr.in = *gw;
-			if ((ce = tun_client_try_get(&__virt_addr)) == NULL)
-				return 0;
-
-			/* Finally, create the client entry. */
-			if ((ce = tun_client_get_or_create(&virt_addr,
-				&ce->ra->real_addr)) == NULL)
-				return 0;
-		} else {
-			return 0;
+	if ((sockfd = socket(loc_addr->sa.sa_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+		return -1;
+	}
+	if (workers_len > 1) {
+		int on = 1;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			fprintf(stderr, "*** setsockopt(SO_REUSEPORT) failed: %s.\n", strerror(errno));
+			close(sockfd);
+			return -1;
 		}
 	}
+	if (bind(sockfd, (struct sockaddr *)loc_addr, sizeof_sockaddr(loc_addr)) < 0) {
+		fprintf(stderr, "*** bind() failed: %s.\n", strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+	set_nonblock(sockfd);
+	if (config.busy_poll_us && !socket_busy_poll(sockfd))
+		fprintf(stderr, "*** SO_BUSY_POLL failed: %s.\n", strerror(errno));
 
-	nmsg.hdr.opcode = MINIVTUN_MSG_IPDATA;
-	memset(nmsg.hdr.rsv, 0x0, sizeof(nmsg.hdr.rsv));
-	memcpy(nmsg.hdr.auth_key, config.crypto_key, sizeof(nmsg.hdr.auth_key));
-	nmsg.ipdata.proto = htons(get_ether_proto_from_pi(pi)); // pi->proto;
-	nmsg.ipdata.ip_dlen = htons(ip_dlen);
-	memcpy(nmsg.ipdata.data, pi + 1, ip_dlen);
+	return sockfd;
+}
 
-	/* Do encryption. */
-	out_data = crypt_buffer;
-	out_dlen = MINIVTUN_MSG_IPDATA_OFFSET + ip_dlen;
-	local_to_netmsg(&nmsg, &out_data, &out_dlen);
+#ifdef HAVE_IO_URING
 
-#if DEBUG
-    dump_nmsg(&nmsg);
+/**
+ * The io_uring engine: every slot of the tunnel and of the socket has
+ * a read posted in the ring all the time. A tunnel slot goes back to
+ * reading once its packet has been sent (or dropped), a socket slot
+ * once its packet has been written to the tunnel. Writes and sends of
+ * a round are submitted together with the next wait. Timers still come
+ * from the worker's event loop, whose epoll fd is polled in the ring.
+ */
+enum {
+	URING_TUN_READ,
+	URING_TUN_WRITE,
+	URING_SOCK_RECV,
+	URING_SOCK_SEND,
+	URING_EV_POLL,
+};
+#define URING_UDATA(op, slot)  (((__u64)(op) << 32) | (slot))
 
-	printf("out data:\n");
-	hexdump(out_data, out_dlen);
-#endif	
+/* Indexes of the fixed files and the registered buffers. */
+enum { URING_FILE_TUN, URING_FILE_SOCK, };
+enum { URING_BUF_POOL, };
+
+static struct io_uring_sqe *uring_sqe(struct server_worker *w, __u8 opcode,
+		__u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Never full: each slot has one operation in the ring at most. */
+	if ((sqe = uring_get_sqe(&w->ring)) == NULL) {
+		fprintf(stderr, "*** io_uring submission failed: %s.\n", strerror(errno));
+		exit(1);
+	}
+	sqe->opcode = opcode;
+	sqe->user_data = user_data;
+	return sqe;
+}
+
+static void uring_post_tun_read(struct server_worker *w, unsigned slot)
+{
+	struct io_uring_sqe *sqe = uring_sqe(w, IORING_OP_READ_FIXED,
+			URING_UDATA(URING_TUN_READ, slot));
+
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = URING_FILE_TUN;
+	sqe->addr = (unsigned long)tun_read_buffer(w->nmsgs[slot]);
+	sqe->len = TUN_READ_MAX;
+	sqe->buf_index = URING_BUF_POOL;
+}
+
+static void uring_post_tun_write(struct server_worker *w, unsigned slot,
+		struct minivtun_msg *nmsg, size_t ip_dlen)
+{
+	struct io_uring_sqe *sqe = uring_sqe(w, IORING_OP_WRITE_FIXED,
+			URING_UDATA(URING_TUN_WRITE, slot));
+
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = URING_FILE_TUN;
+	/* In the receive buffer if not encrypted, else the write buffer: both pooled. */
+	sqe->addr = (unsigned long)nmsg->ipdata.data;
+	sqe->len = (__u32)ip_dlen;
+	sqe->buf_index = URING_BUF_POOL;
+}
+
+static void uring_post_sock_recv(struct server_worker *w, unsigned slot)
+{
+	struct io_uring_sqe *sqe = uring_sqe(w, IORING_OP_RECVMSG,
+			URING_UDATA(URING_SOCK_RECV, slot));
+	struct msghdr *mh = &w->rx_hdrs[slot];
+
+	w->rx_iovs[slot].iov_base = w->read_buffers[slot];
+	w->rx_iovs[slot].iov_len = w->pool.size;
+	memset(mh, 0x0, sizeof(*mh));
+	mh->msg_name = &w->real_peers[slot];
+	mh->msg_namelen = sizeof(w->real_peers[slot]);
+	mh->msg_iov = &w->rx_iovs[slot];
+	mh->msg_iovlen = 1;
+
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = URING_FILE_SOCK;
+	sqe->addr = (unsigned long)mh;
+	sqe->len = 1;
+}
+
+static void uring_post_sock_send(struct server_worker *w, unsigned slot,
+		void *data, size_t len, const struct sockaddr_inx *addr)
+{
+	struct io_uring_sqe *sqe = uring_sqe(w, IORING_OP_SENDMSG,
+			URING_UDATA(URING_SOCK_SEND, slot));
+	struct msghdr *mh = &w->tx_msgs[slot].msg_hdr;
+
+	w->tx_addrs[slot] = *addr;
+	w->tx_iovs[slot].iov_base = data;
+	w->tx_iovs[slot].iov_len = len;
+	memset(mh, 0x0, sizeof(*mh));
+	mh->msg_name = &w->tx_addrs[slot];
+	mh->msg_namelen = sizeof_sockaddr(&w->tx_addrs[slot]);
+	mh->msg_iov = &w->tx_iovs[slot];
+	mh->msg_iovlen = 1;
+
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = URING_FILE_SOCK;
+	sqe->addr = (unsigned long)mh;
+	sqe->len = 1;
+}
+
+static void uring_post_ev_poll(struct server_worker *w)
+{
+	struct io_uring_sqe *sqe = uring_sqe(w, IORING_OP_POLL_ADD,
+			URING_UDATA(URING_EV_POLL, 0));
 
-	rc = (int)sendto(sockfd, out_data, out_dlen, 0,
-				(struct sockaddr *)&ce->ra->real_addr,
-				sizeof_sockaddr(&ce->ra->real_addr));
-	ce->last_xmit = current_ts;
-	ce->ra->last_xmit = current_ts;
+	sqe->fd = w->loop.epfd;
+	sqe->poll32_events = POLLIN;
+}
+
+static int server_worker_uring_init(struct server_worker *w)
+{
+	struct iovec buf;
+	int files[2] = { w->tunfd, w->sockfd };
+	unsigned i;
+
+	/* Decrypted datagrams wait in these for the tunnel write, a slot each. */
+	for (i = 0; i < config.batch_size; i++) {
+		if ((w->write_buffers[i] = buf_pool_get(&w->pool)) == NULL)
+			return -1;
+	}
+
+	/* Tunnel and socket slots, a poll and some room. */
+	if (uring_init(&w->ring, config.batch_size * 2 + 2) < 0)
+		return -1;
+
+	/* The whole pool is one registered buffer. */
+	buf.iov_base = w->pool.base;
+	buf.iov_len = w->pool.map_len;
+	if (uring_register_buffers(&w->ring, &buf, 1) < 0 ||
+		uring_register_files(&w->ring, files, 2) < 0) {
+		uring_exit(&w->ring);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void server_worker_run_uring(struct server_worker *w)
+{
+	struct minivtun_msg *msgs[NM_BATCH_MAX], *nmsg;
+	struct sockaddr_inx real_addrs[NM_BATCH_MAX];
+	struct crypto_datagram dg[NM_BATCH_MAX];
+	unsigned slots[NM_BATCH_MAX], which[NM_BATCH_MAX];
+	ssize_t lens[NM_BATCH_MAX], len;
+	unsigned nr_read, nr_recv, n, slot, i;
+	struct io_uring_cqe *cqe;
+	bool has_timers = !list_empty(&w->loop.timers);
+	__u64 user_data;
+	int res;
+
+	for (i = 0; i < config.batch_size; i++) {
+		uring_post_tun_read(w, i);
+		uring_post_sock_recv(w, i);
+	}
+	if (has_timers)
+		uring_post_ev_poll(w);
+
+	for (;;) {
+		if (uring_submit_and_wait(&w->ring, 1) < 0) {
+			fprintf(stderr, "*** io_uring_enter(): %s.\n", strerror(errno));
+			exit(1);
+		}
+		current_ts = ev_time();
+		nr_read = nr_recv = 0;
+
+		while ((cqe = uring_peek_cqe(&w->ring))) {
+			user_data = cqe->user_data;
+			res = cqe->res;
+			uring_cqe_seen(&w->ring);
+			slot = (unsigned)user_data;
+
+			switch (user_data >> 32) {
+			case URING_TUN_READ:
+				msgs[nr_read] = w->nmsgs[slot];
+				if (res > 0 && (len = tun_nmsg_fill(msgs[nr_read], (size_t)res)) > 0) {
+					slots[nr_read] = slot;
+					lens[nr_read++] = len;
+				} else if (res > 0 || res == -EAGAIN || res == -EINTR || res == -ENOBUFS) {
+					uring_post_tun_read(w, slot);
+				} else {
+					/**
+					 * Anything else would fail again at once and spin the
+					 * ring: the slot is left out, as the epoll engine stops
+					 * reading at a failing read().
+					 */
+					if (w->tun_read_errors++ == 0)
+						fprintf(stderr, "*** TUN read failed: %s, slot stops reading.\n",
+								res ? strerror(-res) : "end of file");
+				}
+				break;
+			case URING_SOCK_SEND:
+				if (res < 0)
+					w->io_stats.tx_drops++;
+				else
+					w->io_stats.tx_packets++;
+				uring_post_tun_read(w, slot);
+				break;
+			case URING_SOCK_RECV:
+				nr_recv++;
+				if (res > 0 && (w->rx_hdrs[slot].msg_flags & MSG_TRUNC)) {
+					w->io_stats.rx_packets++;
+					w->io_stats.rx_drops++;
+					w->io_stats.rx_oversize++;
+				} else if (res > 0) {
+					w->io_stats.rx_packets++;
+					len = network_msg_parse(w->read_buffers[slot], (size_t)res,
+							&w->real_peers[slot], w->write_buffers[slot], &nmsg);
+					if (len > 0) {
+						uring_post_tun_write(w, slot, nmsg, (size_t)len);
+						break;
+					}
+					if (len < 0)
+						w->io_stats.rx_drops++;
+				}
+				uring_post_sock_recv(w, slot);
+				break;
+			case URING_TUN_WRITE:
+				uring_post_sock_recv(w, slot);
+				break;
+			case URING_EV_POLL:
+				ev_loop_run_once(&w->loop);
+				uring_post_ev_poll(w);
+				break;
+			}
+		}
+
+		if (nr_recv)
+			w->io_stats.rx_calls++;
+		if (nr_read == 0)
+			continue;
+
+		n = tunnel_burst_seal(msgs, lens, nr_read, dg, real_addrs, which);
+		for (i = 0; i < n; i++) {
+			uring_post_sock_send(w, slots[which[i]], dg[i].out, dg[i].len,
+					&real_addrs[i]);
+			/* Marked as taken, see below. */
+			msgs[which[i]] = NULL;
+		}
+		/* Those with no destination go straight back to reading. */
+		for (i = 0; i < nr_read; i++) {
+			if (msgs[i])
+				uring_post_tun_read(w, slots[i]);
+		}
+		w->io_stats.tx_calls++;
+	}
+}
+
+#endif /* HAVE_IO_URING */
+
+static void *server_worker_run(void *arg)
+{
+	struct server_worker *w = arg;
+
+#ifdef __linux__
+	/* One worker per CPU, in order. */
+	if (workers_len > 1) {
+		cpu_set_t cpus;
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		CPU_ZERO(&cpus);
+		CPU_SET(w->id % (nr_cpus > 0 ? nr_cpus : 1), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#endif
+
+	/* Cipher contexts are per thread. */
+	if (w->id > 0 && init_crypto_contexts() < 0) {
+		fprintf(stderr, "*** Cannot set up the cipher for worker %u.\n", w->id);
+		exit(1);
+	}
+
+	current_ts = w->loop.now;
+	current_worker = w->id;
+
+#ifdef HAVE_IO_URING
+	if (w->use_uring) {
+		server_worker_run_uring(w);
+		return NULL;
+	}
+#endif
+
+	for (;;) {
+		if (ev_loop_run_once(&w->loop) < 0) {
+			fprintf(stderr, "*** epoll_wait(): %s.\n", strerror(errno));
+			exit(1);
+		}
+
+		/* Datagrams queued in this round go out together. */
+		udp_tx_flush(w);
+	}
+
+	return NULL;
+}
+
+static int server_worker_init(struct server_worker *w, unsigned id, int tunfd,
+		const struct sockaddr_inx *loc_addr)
+{
+	unsigned i;
+
+	w->id = id;
+	w->tunfd = tunfd;
+	if ((w->sockfd = server_socket_open(loc_addr)) < 0)
+		return -1;
+	w->gso = udp_gso_probe(w->sockfd);
+
+	/* Socket and tunnel slots, the decryption buffer and io_uring's write slots. */
+	if (buf_pool_init(&w->pool, config.batch_size * (config.io_uring ? 3 : 2) + 1,
+		NM_BUFFER_SIZE, config.huge_pages) < 0) {
+		fprintf(stderr, "*** [%s] buf_pool_init(): %s.\n", __FUNCTION__, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < config.batch_size; i++) {
+		w->read_buffers[i] = buf_pool_get(&w->pool);
+		w->nmsgs[i] = buf_pool_get(&w->pool);
+	}
+	w->crypt_buffer = buf_pool_get(&w->pool);
+
+	if (config.tun_offload && ((w->tso = calloc(1, sizeof(*w->tso))) == NULL ||
+		(w->tun_gro = calloc(1, sizeof(*w->tun_gro))) == NULL)) {
+		fprintf(stderr, "*** [%s] calloc(): %s.\n", __FUNCTION__, strerror(errno));
+		return -1;
+	}
+
+	if (xdp_prog && (w->xsk = xsk_open(xdp_prog, id)) == NULL)
+		fprintf(stderr, "*** No AF_XDP socket on queue %u (%s), using the UDP socket.\n",
+				id, strerror(errno));
+
+	if (config.io_uring && config.tun_offload) {
+		fprintf(stderr, "*** io_uring does not do '--offload', using epoll.\n");
+	} else if (config.io_uring && w->xsk) {
+		fprintf(stderr, "*** io_uring does not do '--xdp', using epoll.\n");
+	} else if (config.io_uring) {
+#ifdef HAVE_IO_URING
+		if (server_worker_uring_init(w) == 0)
+			w->use_uring = true;
+		else
+			fprintf(stderr, "*** io_uring unavailable (%s), using epoll.\n", strerror(errno));
+#else
+		fprintf(stderr, "*** io_uring not supported in this build, using epoll.\n");
+#endif
+	}
+
+	/**
+	 * io_uring completes reads of an O_NONBLOCK file with -EAGAIN at once
+	 * on many kernels, which would spin the ring on an idle tunnel, so
+	 * its TUN queue stays blocking and the ring waits on it instead.
+	 */
+	if (!server_worker_uses_uring(w))
+		set_nonblock(tunfd);
+
+	/* The io_uring engine reads datagrams one at a time, no GRO there. */
+	if (!server_worker_uses_uring(w) && udp_gro_enable(w->sockfd)) {
+		w->gro = true;
+		w->gro_slots = config.batch_size < UDP_GRO_SLOTS_MAX ?
+				config.batch_size : UDP_GRO_SLOTS_MAX;
+		if (buf_pool_init(&w->gro_pool, w->gro_slots, UDP_GRO_BUFFER_SIZE,
+				config.huge_pages) < 0) {
+			fprintf(stderr, "*** [%s] buf_pool_init(): %s.\n", __FUNCTION__, strerror(errno));
+			return -1;
+		}
+		for (i = 0; i < w->gro_slots; i++)
+			w->gro_buffers[i] = buf_pool_get(&w->gro_pool);
+	}
+
+	/* With io_uring the event loop is there for the timers only. */
+	if (ev_loop_init(&w->loop) < 0 ||
+		(!server_worker_uses_uring(w) &&
+		 (ev_io_add(&w->loop, &w->sock_io, w->sockfd, on_sock_readable, w) < 0 ||
+		  ev_io_add(&w->loop, &w->tun_io, w->tunfd, on_tun_readable, w) < 0)) ||
+		(w->xsk && ev_io_add(&w->loop, &w->xsk_io, xsk_fd(w->xsk), on_xsk_readable, w) < 0) ||
+		(id == 0 && ev_timer_add(&w->loop, &w->walk_timer, 1000, on_walk_timer, w) < 0)) {
+		fprintf(stderr, "*** Cannot set up the event loop: %s.\n", strerror(errno));
+		return -1;
+	}
+	ev_loop_set_busy_poll(&w->loop, config.busy_poll_us);
 
 	return 0;
 }
 
 int run_server(int tunfd, const char *loc_addr_pair)
 {
-	struct timeval timeo;
-	int sockfd, rc;
 	struct sockaddr_inx loc_addr;
-	fd_set rset;
-	time_t last_walk;
 	char s_loc_addr[50];
+	unsigned i;
 
 	if (get_sockaddr_inx_pair(loc_addr_pair, &loc_addr) < 0) {
 		fprintf(stderr, "*** Cannot resolve address pair '%s'.\n", loc_addr_pair);
@@ -697,22 +1561,41 @@ int run_server(int tunfd, const char *loc_addr_pair)
 
 	inet_ntop(loc_addr.sa.sa_family, addr_of_sockaddr(&loc_addr), s_loc_addr,
 			  sizeof(s_loc_addr));
-	printf("Mini virtual tunnelling server on %s:%u, interface: %s.\n",
-			s_loc_addr, ntohs(port_of_sockaddr(&loc_addr)), config.devname);
+	printf("Mini virtual tunnelling server on %s:%u, interface: %s, workers: %u.\n",
+			s_loc_addr, ntohs(port_of_sockaddr(&loc_addr)), config.devname,
+			config.workers);
 
 	/* Initialize address map hash table. */
-	init_va_ra_maps();
 	hash_initval = (uint32_t)time(NULL);
+	init_sessions();
+	vt_routes_build();
 
-	if ((sockfd = socket(loc_addr.sa.sa_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-		fprintf(stderr, "*** socket() failed: %s.\n", strerror(errno));
+	workers_len = config.workers;
+	if ((workers = calloc(workers_len, sizeof(*workers))) == NULL) {
+		fprintf(stderr, "*** [%s] calloc(): %s.\n", __FUNCTION__, strerror(errno));
 		exit(1);
 	}
-	if (bind(sockfd, (struct sockaddr *)&loc_addr, sizeof_sockaddr(&loc_addr)) < 0) {
-		fprintf(stderr, "*** bind() failed: %s.\n", strerror(errno));
+	if (lglock_init(&tables_lock, workers_len) < 0) {
+		fprintf(stderr, "*** [%s] lglock_init(): %s.\n", __FUNCTION__, strerror(errno));
 		exit(1);
 	}
-	set_nonblock(sockfd);
+
+	/* XDP program first, the workers put their AF_XDP sockets in its map. */
+	if (config.xdp_ifname && (xdp_prog = xdp_prog_attach(config.xdp_ifname, &loc_addr)) == NULL)
+		fprintf(stderr, "*** AF_XDP on %s unavailable (%s), using the UDP socket.\n",
+				config.xdp_ifname, strerror(errno));
+
+	/* The first TUN queue is given, open one more for each other worker. */
+	for (i = 0; i < workers_len; i++) {
+		int fd = tunfd;
+
+		if (i > 0 && (fd = tun_alloc(config.devname)) < 0) {
+			fprintf(stderr, "*** Cannot open TUN queue %u: %s.\n", i, strerror(errno));
+			exit(1);
+		}
+		if (server_worker_init(&workers[i], i, fd, &loc_addr) < 0)
+			exit(1);
+	}
 
 	/* Run in background. */
 	if (config.in_background)
@@ -725,40 +1608,14 @@ int run_server(int tunfd, const char *loc_addr_pair)
 		}
 	}
 
-	last_walk = time(NULL);
-
-	for (;;) {
-		FD_ZERO(&rset);
-		FD_SET(tunfd, &rset);
-		FD_SET(sockfd, &rset);
-
-		timeo.tv_sec = 2;
-		timeo.tv_usec = 0;
-
-		rc = select((tunfd > sockfd ? tunfd : sockfd) + 1, &rset, NULL, NULL, &timeo);
-		if (rc < 0) {
-			fprintf(stderr, "*** select(): %s.\n", strerror(errno));
-			return -1;
-		}
-
-		current_ts = time(NULL);
-
-		if (rc > 0) {
-			if (FD_ISSET(sockfd, &rset)) {
-				rc = network_receiving(tunfd, sockfd);
-			}
-
-			if (FD_ISSET(tunfd, &rset)) {
-				rc = tunnel_receiving(tunfd, sockfd);
-			}
-		}
-
-		/* Check connection state at each chance. */
-		if (current_ts - last_walk >= 3) {
-			va_ra_walk_continue(sockfd);
-			last_walk = current_ts;
+	/* The first worker is this thread. */
+	for (i = 1; i < workers_len; i++) {
+		if (pthread_create(&workers[i].thread, NULL, server_worker_run, &workers[i])) {
+			fprintf(stderr, "*** pthread_create() failed.\n");
+			exit(1);
 		}
 	}
+	server_worker_run(&workers[0]);
 
 	return 0;
 }
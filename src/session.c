@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "session.h"
+
+/* Tables are never shrunk below this. */
+#define SESSION_TABLE_MIN_SIZE  (1 << 4)
+/* Subnets bigger than a /16 are left to the hash table. */
+#define SESSION_SUBNET_MIN_PREFIX  16
+
+static bool session_match_real(const void *ctx, uint32_t id, const struct addr_key *key)
+{
+	const struct session *s = session_get(ctx, id);
+
+	if (s->real_addr.sa.sa_family != key->af)
+		return false;
+	if (key->af == AF_INET6)
+		return s->real_addr.in6.sin6_port == key->port &&
+			is_in6_equal(&s->real_addr.in6.sin6_addr, &key->in6);
+	return s->real_addr.in.sin_port == key->port &&
+		s->real_addr.in.sin_addr.s_addr == key->in.s_addr;
+}
+
+static bool session_match_virt(const void *ctx, uint32_t id, const struct addr_key *key)
+{
+	const struct session *s = session_get(ctx, id);
+
+	if (key->af == AF_INET6)
+		return is_in6_equal(&s->virt_in6, &key->in6);
+	return s->virt_in.s_addr == key->in.s_addr;
+}
+
+static inline void real_addr_key(struct addr_key *key, const struct sockaddr_inx *sa)
+{
+	addr_key_set(key, sa->sa.sa_family, addr_of_sockaddr(sa), port_of_sockaddr(sa));
+}
+
+/* Slot of 'addr' in the subnet array, NULL if it is not in there. */
+static inline uint32_t *session_subnet_slot(const struct session_store *st, int af,
+		const void *addr)
+{
+	uint32_t i;
+
+	if (af != AF_INET || st->subnet == NULL)
+		return NULL;
+	i = ntohl(((const struct in_addr *)addr)->s_addr) - st->subnet_base;
+	return i < st->subnet_size ? &st->subnet[i] : NULL;
+}
+
+/**
+ * Smallest table that holds 'capacity' entries without growing (it does
+ * at 3/4 full), and never shrinks below that.
+ */
+static unsigned table_size_for(unsigned capacity)
+{
+	unsigned size = SESSION_TABLE_MIN_SIZE;
+
+	while (size / 4 * 3 <= capacity)
+		size <<= 1;
+	return size;
+}
+
+/**
+ * With a 'capacity', the sessions and the tables are all set up for that
+ * many (each with an IPv4 and an IPv6 address) at once, so as long as
+ * there are not more of them, no memory is allocated for sessions coming
+ * and going. 'subnet'/'prefix' is the server's own IPv4 subnet, 'prefix'
+ * is 0 if it has none.
+ */
+int session_store_init(struct session_store *st, unsigned capacity, uint32_t seed,
+		struct in_addr subnet, unsigned prefix)
+{
+	memset(st, 0x0, sizeof(*st));
+	if (addr_table_init(&st->by_real, table_size_for(capacity), seed,
+			session_match_real, st) < 0 ||
+		addr_table_init(&st->by_virt, table_size_for(capacity * 2), seed,
+			session_match_virt, st) < 0 ||
+		slab_cache_init(&st->cache, sizeof(struct session),
+			sizeof(struct session_cold), capacity) < 0)
+		return -1;
+	if (prefix >= SESSION_SUBNET_MIN_PREFIX && prefix <= 32) {
+		st->subnet_size = 1U << (32 - prefix);
+		st->subnet_base = ntohl(subnet.s_addr) & ~(st->subnet_size - 1);
+		if ((st->subnet = calloc(st->subnet_size, sizeof(*st->subnet))) == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+void session_store_destroy(struct session_store *st)
+{
+	addr_table_destroy(&st->by_real);
+	addr_table_destroy(&st->by_virt);
+	slab_cache_destroy(&st->cache);
+	free(st->subnet);
+	memset(st, 0x0, sizeof(*st));
+}
+
+struct session *session_find_real(const struct session_store *st,
+		const struct sockaddr_inx *sa)
+{
+	struct addr_key key;
+	uint32_t id;
+
+	real_addr_key(&key, sa);
+	if ((id = addr_table_lookup(&st->by_real, &key)) == 0)
+		return NULL;
+	return session_get(st, id);
+}
+
+struct session *session_find_virt(const struct session_store *st, int af,
+		const void *addr)
+{
+	struct addr_key key;
+	uint32_t *slot, id;
+
+	if ((slot = session_subnet_slot(st, af, addr)))
+		id = *slot;
+	else {
+		addr_key_set(&key, af, addr, 0);
+		id = addr_table_lookup(&st->by_virt, &key);
+	}
+	return id ? session_get(st, id) : NULL;
+}
+
+/* A session for 'sa', which must have none yet, with no virtual addresses. */
+struct session *session_new(struct session_store *st, const struct sockaddr_inx *sa)
+{
+	struct session_cold *sc;
+	struct session *s;
+	struct addr_key key;
+	uint32_t id;
+
+	if ((id = slab_alloc(&st->cache)) == 0)
+		return NULL;
+	s = session_get(st, id);
+	memset(s, 0x0, sizeof(*s));
+	s->real_addr = *sa;
+	s->id = id;
+	real_addr_key(&key, sa);
+	if (addr_table_insert(&st->by_real, &key, id) < 0) {
+		slab_free(&st->cache, id);
+		return NULL;
+	}
+	sc = session_cold(st, s);
+	tw_timer_init(&sc->timer);
+	sc->id = id;
+	return s;
+}
+
+/* Its timer must be off the wheel. */
+void session_delete(struct session_store *st, struct session *s)
+{
+	struct addr_key key;
+
+	session_clear_virt(st, s, AF_INET);
+	session_clear_virt(st, s, AF_INET6);
+	real_addr_key(&key, &s->real_addr);
+	addr_table_remove(&st->by_real, &key);
+	slab_free(&st->cache, s->id);
+}
+
+/**
+ * Give 's' the virtual address 'addr' of family 'af', in place of the
+ * one it has. No other session may hold it.
+ */
+int session_set_virt(struct session_store *st, struct session *s, int af,
+		const void *addr)
+{
+	struct addr_key key;
+	uint32_t *slot;
+
+	session_clear_virt(st, s, af);
+	if (af == AF_INET6)
+		s->virt_in6 = *(const struct in6_addr *)addr;
+	else
+		s->virt_in = *(const struct in_addr *)addr;
+
+	if ((slot = session_subnet_slot(st, af, addr))) {
+		*slot = s->id;
+		st->subnet_count++;
+		return 0;
+	}
+	addr_key_set(&key, af, addr, 0);
+	if (addr_table_insert(&st->by_virt, &key, s->id) < 0) {
+		if (af == AF_INET6)
+			memset(&s->virt_in6, 0x0, sizeof(s->virt_in6));
+		else
+			s->virt_in.s_addr = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void session_clear_virt(struct session_store *st, struct session *s, int af)
+{
+	const void *addr = af == AF_INET6 ? (void *)&s->virt_in6 : (void *)&s->virt_in;
+	struct addr_key key;
+	uint32_t *slot;
+
+	if (!session_has_virt(s, af))
+		return;
+	if ((slot = session_subnet_slot(st, af, addr))) {
+		*slot = 0;
+		st->subnet_count--;
+	} else {
+		addr_key_set(&key, af, addr, 0);
+		addr_table_remove(&st->by_virt, &key);
+	}
+	if (af == AF_INET6)
+		memset(&s->virt_in6, 0x0, sizeof(s->virt_in6));
+	else
+		s->virt_in.s_addr = 0;
+}
+
+/* Bytes mapped or allocated for the sessions and the tables. */
+size_t session_memory(const struct session_store *st)
+{
+	return slab_memory(&st->cache) + addr_table_memory(&st->by_real) +
+		addr_table_memory(&st->by_virt) + sizeof(*st->subnet) * st->subnet_size +
+		sizeof(*st->cache.slabs) * st->cache.max_slabs;
+}
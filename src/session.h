@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __SESSION_H
+#define __SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "library.h"
+#include "timer_wheel.h"
+#include "addr_table.h"
+#include "slab.h"
+
+/**
+ * A client of the server: one record per real address, which holds the
+ * client's virtual addresses too (an IPv4 and an IPv6 one at most). The
+ * part that packets look at is one 64-byte cache line; the timer of the
+ * session is kept apart, in the cold part of its slab (see slab.h).
+ *
+ * Times are coarse: the low 32 bits of the server's clock in seconds,
+ * compared by unsigned difference, so their wrapping doesn't matter.
+ */
+struct session {
+	struct sockaddr_inx real_addr;
+	uint32_t last_recv;
+	uint32_t last_xmit;
+	struct in_addr virt_in;    /* 0.0.0.0 if there is none */
+	struct in6_addr virt_in6;  /* :: if there is none */
+	uint32_t id;               /* index in the store */
+} __attribute__((aligned(64)));
+
+struct session_cold {
+	struct tw_timer timer;
+	uint32_t id;
+};
+
+/**
+ * Sessions, found by real address in 'by_real' and by virtual address
+ * in 'by_virt', except for the IPv4 addresses of the server's own subnet
+ * (if it is /16 or longer), where nearly all of them are: those sit in
+ * an array indexed by the host part, with no hashing. The tables and
+ * the array hold the 4-byte session ids. No locking of its own.
+ */
+struct session_store {
+	struct slab_cache cache;
+	struct addr_table by_real;
+	struct addr_table by_virt;
+	uint32_t *subnet;
+	uint32_t subnet_base;  /* host byte order */
+	uint32_t subnet_size;
+	unsigned subnet_count;
+};
+
+int session_store_init(struct session_store *st, unsigned capacity, uint32_t seed,
+		struct in_addr subnet, unsigned prefix);
+void session_store_destroy(struct session_store *st);
+struct session *session_find_real(const struct session_store *st,
+		const struct sockaddr_inx *sa);
+struct session *session_find_virt(const struct session_store *st, int af,
+		const void *addr);
+struct session *session_new(struct session_store *st, const struct sockaddr_inx *sa);
+void session_delete(struct session_store *st, struct session *s);
+int session_set_virt(struct session_store *st, struct session *s, int af,
+		const void *addr);
+void session_clear_virt(struct session_store *st, struct session *s, int af);
+size_t session_memory(const struct session_store *st);
+
+static inline struct session *session_get(const struct session_store *st, uint32_t id)
+{
+	return slab_hot(&st->cache, id);
+}
+
+static inline struct session_cold *session_cold(const struct session_store *st,
+		const struct session *s)
+{
+	return slab_cold(&st->cache, s->id);
+}
+
+/**
+ * Set 'last_recv' or 'last_xmit' of a session to 'now' on a lookup,
+ * which other threads may be doing on it at the same time: it is only
+ * written when the second changes, so the line of a busy session is
+ * not bounced between them with each packet.
+ */
+static inline void session_stamp(uint32_t *t, uint32_t now)
+{
+	if (__atomic_load_n(t, __ATOMIC_RELAXED) != now)
+		__atomic_store_n(t, now, __ATOMIC_RELAXED);
+}
+
+static inline bool session_has_virt(const struct session *s, int af)
+{
+	if (af == AF_INET6)
+		return !IN6_IS_ADDR_UNSPECIFIED(&s->virt_in6);
+	return s->virt_in.s_addr != 0;
+}
+
+static inline unsigned session_count(const struct session_store *st)
+{
+	return slab_in_use(&st->cache);
+}
+
+/* Virtual addresses held by all sessions. */
+static inline unsigned session_virt_count(const struct session_store *st)
+{
+	return st->subnet_count + addr_table_count(&st->by_virt);
+}
+
+/* Slabs and table arrays mapped so far. */
+static inline unsigned long session_allocations(const struct session_store *st)
+{
+	return st->cache.grows + st->by_real.resizes + st->by_virt.resizes;
+}
+
+#endif /* __SESSION_H */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+/* Hot and cold parts are kept 16-byte aligned. */
+#define SLAB_ALIGN  16
+#define slab_align(size)  (((size) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+/* Largest size of a slab; it holds a power of 2 of objects. */
+#define SLAB_SIZE  (64 * 1024)
+
+/**
+ * Objects of a 'hot_size' part and a 'cold_size' one (which may be 0).
+ * Slabs for 'prealloc' objects are mapped right away; after that the
+ * cache grows by a slab at a time.
+ */
+int slab_cache_init(struct slab_cache *sc, size_t hot_size, size_t cold_size,
+		unsigned prealloc)
+{
+	memset(sc, 0x0, sizeof(*sc));
+	if (hot_size < sizeof(uint32_t))
+		hot_size = sizeof(uint32_t);
+	sc->hot_size = slab_align(hot_size);
+	sc->cold_size = slab_align(cold_size);
+	while (((size_t)2 << sc->shift) * (sc->hot_size + sc->cold_size) <= SLAB_SIZE)
+		sc->shift++;
+	sc->slab_len = ((size_t)1 << sc->shift) * (sc->hot_size + sc->cold_size);
+	if (prealloc)
+		return slab_cache_grow(sc, prealloc);
+	return 0;
+}
+
+void slab_cache_destroy(struct slab_cache *sc)
+{
+	unsigned i;
+
+	for (i = 0; i < sc->nr_slabs; i++)
+		munmap(sc->slabs[i], sc->slab_len);
+	free(sc->slabs);
+	memset(sc, 0x0, sizeof(*sc));
+}
+
+/**
+ * Map slabs for at least 'nr' more objects and put them on the free
+ * list, lowest index first. Index 0 is never handed out.
+ */
+int slab_cache_grow(struct slab_cache *sc, unsigned nr)
+{
+	unsigned per_slab = 1U << sc->shift, first, i;
+	char **slabs;
+	char *s;
+
+	while (nr) {
+		if (sc->nr_slabs >= sc->max_slabs) {
+			i = sc->max_slabs ? sc->max_slabs * 2 : 16;
+			if (((uint64_t)i << sc->shift) > UINT32_MAX ||
+				(slabs = realloc(sc->slabs, sizeof(*slabs) * i)) == NULL)
+				return -1;
+			sc->slabs = slabs;
+			sc->max_slabs = i;
+		}
+		s = mmap(NULL, sc->slab_len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (s == MAP_FAILED)
+			return -1;
+		sc->slabs[sc->nr_slabs++] = s;
+		sc->grows++;
+
+		first = (sc->nr_slabs - 1) << sc->shift;
+		for (i = first + per_slab - 1; i >= first && i > 0; i--) {
+			slab_free(sc, i);
+			sc->nr++;
+		}
+		nr = nr > per_slab ? nr - per_slab : 0;
+	}
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Cache of fixed-size objects carved out of mapped slabs, for the small
+ * entries that come and go with clients. Objects are known by a 32-bit
+ * index (never 0), so that tables can hold them in 4 bytes.
+ *
+ * An object has a hot part, which is looked at on each packet, and an
+ * optional cold one: a slab holds the hot parts of all its objects one
+ * after the other (cache-line aligned if their size is a multiple of
+ * 64), then the cold parts, so the hot ones are packed together.
+ *
+ * Freed objects go onto a free list threaded through their hot parts
+ * and are handed out again first, so once the slabs hold as many
+ * objects as are ever live at a time, no more memory is asked of the
+ * system; slabs are only given back when the cache is destroyed. No
+ * locking of its own.
+ */
+
+struct slab_cache {
+	size_t hot_size;
+	size_t cold_size;
+	unsigned shift;     /* 1 << shift objects per slab */
+	size_t slab_len;
+	char **slabs;
+	unsigned nr_slabs;
+	unsigned max_slabs; /* room in 'slabs' */
+	uint32_t free;      /* first free object, each links to the next */
+	unsigned nr;        /* objects in all slabs */
+	unsigned nr_free;
+	unsigned long grows; /* slabs mapped so far */
+};
+
+int slab_cache_init(struct slab_cache *sc, size_t hot_size, size_t cold_size,
+		unsigned prealloc);
+void slab_cache_destroy(struct slab_cache *sc);
+int slab_cache_grow(struct slab_cache *sc, unsigned nr);
+
+static inline void *slab_hot(const struct slab_cache *sc, uint32_t i)
+{
+	return sc->slabs[i >> sc->shift] + (size_t)(i & ((1U << sc->shift) - 1)) * sc->hot_size;
+}
+
+static inline void *slab_cold(const struct slab_cache *sc, uint32_t i)
+{
+	return sc->slabs[i >> sc->shift] + ((size_t)sc->hot_size << sc->shift) +
+			(size_t)(i & ((1U << sc->shift) - 1)) * sc->cold_size;
+}
+
+/* Index of a new object, 0 if no slab could be mapped for it. */
+static inline uint32_t slab_alloc(struct slab_cache *sc)
+{
+	uint32_t i;
+
+	if (sc->free == 0 && slab_cache_grow(sc, 1) < 0)
+		return 0;
+	i = sc->free;
+	sc->free = *(uint32_t *)slab_hot(sc, i);
+	sc->nr_free--;
+	return i;
+}
+
+static inline void slab_free(struct slab_cache *sc, uint32_t i)
+{
+	*(uint32_t *)slab_hot(sc, i) = sc->free;
+	sc->free = i;
+	sc->nr_free++;
+}
+
+static inline unsigned slab_in_use(const struct slab_cache *sc)
+{
+	return sc->nr - sc->nr_free;
+}
+
+/* Bytes mapped for the slabs. */
+static inline size_t slab_memory(const struct slab_cache *sc)
+{
+	return sc->slab_len * sc->nr_slabs;
+}
+
+#endif /* __SLAB_H */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+#define TW_MASK  (TW_SLOTS - 1)
+#define tw_slot(expires, level)  (((expires) >> (TW_BITS * (level))) & TW_MASK)
+
+void tw_init(struct timer_wheel *tw, time_t now)
+{
+	unsigned i, j;
+
+	for (i = 0; i < TW_LEVELS; i++) {
+		for (j = 0; j < TW_SLOTS; j++)
+			INIT_LIST_HEAD(&tw->slots[i][j]);
+	}
+	tw->now = now;
+	tw->count = 0;
+}
+
+void tw_timer_init(struct tw_timer *t)
+{
+	init_list_entry(&t->list);
+	t->expires = 0;
+}
+
+/**
+ * Onto the lowest level whose range takes the deadline: a slot there is
+ * reached (or cascaded down) exactly in the second, or block of seconds,
+ * that 'expires' falls in.
+ */
+static void tw_place(struct timer_wheel *tw, struct tw_timer *t)
+{
+	time_t delta = t->expires - tw->now;
+	unsigned level;
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (time_t)1 << (TW_BITS * (level + 1)))
+			break;
+	}
+	list_add_tail(&t->list, &tw->slots[level][tw_slot(t->expires, level)]);
+}
+
+/* (Re)arm 't' to fire at 'expires', in seconds of the wheel's clock. */
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, time_t expires)
+{
+	if (tw_pending(t))
+		list_del(&t->list);
+	else
+		tw->count++;
+
+	/* Overdue ones go with the next tick. */
+	if (expires <= tw->now)
+		expires = tw->now + 1;
+	else if (expires - tw->now >= TW_RANGE)
+		expires = tw->now + TW_RANGE - 1;
+	t->expires = expires;
+	tw_place(tw, t);
+}
+
+void tw_del(struct timer_wheel *tw, struct tw_timer *t)
+{
+	if (tw_pending(t)) {
+		list_del(&t->list);
+		tw->count--;
+	}
+}
+
+/* Spread a slot of an upper level over the levels below. */
+static void tw_cascade(struct timer_wheel *tw, unsigned level, unsigned slot)
+{
+	struct tw_timer *t, *__t;
+
+	list_for_each_entry_safe (t, __t, &tw->slots[level][slot], list) {
+		list_del(&t->list);
+		tw_place(tw, t);
+	}
+}
+
+/**
+ * Tick the wheel up to 'now'. The timers due by then are taken off it
+ * and put on 'due', where they stay pending until re-added or deleted.
+ */
+void tw_advance(struct timer_wheel *tw, time_t now, struct list_head *due)
+{
+	struct tw_timer *t, *__t;
+	unsigned top, level, slot;
+
+	while (tw->now < now) {
+		tw->now++;
+		/**
+		 * Entering new blocks of upper levels: bring them down, the
+		 * highest first, since its timers may go to the others.
+		 */
+		for (top = 0; top < TW_LEVELS - 1 && tw_slot(tw->now, top) == 0; top++)
+			;
+		for (level = top; level > 0; level--)
+			tw_cascade(tw, level, tw_slot(tw->now, level));
+		slot = tw_slot(tw->now, 0);
+		list_for_each_entry_safe (t, __t, &tw->slots[0][slot], list) {
+			list_del(&t->list);
+			list_add_tail(&t->list, due);
+		}
+	}
+}
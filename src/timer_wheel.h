@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "list.h"
+
+/**
+ * Hierarchical timer wheel with a resolution of one second, for large
+ * numbers of timers that are re-armed often and rarely fire: adding or
+ * removing one is O(1), and a tick costs O(timers due) plus the ones
+ * cascaded down from the upper levels, each at most once per level.
+ *
+ * Level 0 has a slot for each of the next TW_SLOTS seconds; a slot of
+ * level n covers TW_SLOTS^n seconds and is spread over the level below
+ * when the wheel gets there. Deadlines beyond the top level are cut to
+ * its range, the owner checks again when such a timer fires.
+ *
+ * Timers that are due are handed back on a list, with no callbacks.
+ * The wheel has no locking of its own.
+ */
+
+#define TW_BITS  6
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_LEVELS  3
+/* Seconds ahead that a timer can be set to. */
+#define TW_RANGE  ((time_t)1 << (TW_BITS * TW_LEVELS))
+
+struct tw_timer {
+	struct list_head list;
+	time_t expires;
+};
+
+struct timer_wheel {
+	/* Last second ticked, the timers of later ones are pending. */
+	time_t now;
+	unsigned count;
+	struct list_head slots[TW_LEVELS][TW_SLOTS];
+};
+
+void tw_init(struct timer_wheel *tw, time_t now);
+void tw_timer_init(struct tw_timer *t);
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, time_t expires);
+void tw_del(struct timer_wheel *tw, struct tw_timer *t);
+void tw_advance(struct timer_wheel *tw, time_t now, struct list_head *due);
+
+/* If 't' is on the wheel (or on a list of due timers). */
+static inline bool tw_pending(struct tw_timer *t)
+{
+	return !list_entry_orphan(&t->list);
+}
+
+#endif /* __TIMER_WHEEL_H */
@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "library.h"
+#include "tun_offload.h"
+
+#ifdef HAVE_TUN_OFFLOAD
+
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+
+_Static_assert(sizeof(struct tun_vnet_hdr) == sizeof(struct virtio_net_hdr),
+		"struct tun_vnet_hdr must match struct virtio_net_hdr");
+
+/* Pseudo-header sum of an IPv4/IPv6 packet for an L4 length of 'l4_len'. */
+static uint32_t csum_pseudo(const char *pkt, uint8_t proto, size_t l4_len)
+{
+	uint32_t sum;
+
+	if (((uint8_t)pkt[0] >> 4) == 4)
+		sum = ip_csum_partial(pkt + 12, 8, 0);
+	else
+		sum = ip_csum_partial(pkt + 8, 32, 0);
+	sum += htons(proto);
+	sum += htons((uint16_t)l4_len);
+	return sum;
+}
+
+/**
+ * Turn on the offloads of a device opened with IFF_VNET_HDR: checksums
+ * and TSO for IPv4 and IPv6.
+ */
+int tun_offload_enable(int tunfd)
+{
+	int hdr_len = sizeof(struct virtio_net_hdr);
+
+	if (ioctl(tunfd, TUNSETVNETHDRSZ, &hdr_len) < 0)
+		return -1;
+	return ioctl(tunfd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6);
+}
+
+/* Cut the next TCP segment of the pending super-packet into 'buf'. */
+static ssize_t tso_next_segment(struct tun_offload *to, char *buf, size_t size)
+{
+	size_t payload = to->len - to->hdr_len - to->off;
+	size_t chunk = payload < to->vh.gso_size ? payload : to->vh.gso_size;
+	size_t l4 = to->vh.csum_start, len = to->hdr_len + chunk;
+	bool first = to->off == 0, last = chunk == payload;
+	uint32_t seq;
+	uint16_t v16;
+
+	if (len > size) {
+		to->len = 0;
+		return 0;
+	}
+	memcpy(buf, to->pkt, to->hdr_len);
+	memcpy(buf + to->hdr_len, to->pkt + to->hdr_len + to->off, chunk);
+
+	if (((uint8_t)buf[0] >> 4) == 4) {
+		memcpy(&v16, buf + 4, 2);
+		v16 = htons(ntohs(v16) + to->segs);
+		memcpy(buf + 4, &v16, 2);
+		v16 = htons((uint16_t)len);
+		memcpy(buf + 2, &v16, 2);
+		memset(buf + 10, 0x0, 2);
+		v16 = ip_csum_fold(ip_csum_partial(buf, (buf[0] & 0x0f) * 4, 0));
+		memcpy(buf + 10, &v16, 2);
+	} else {
+		v16 = htons((uint16_t)(len - 40));
+		memcpy(buf + 4, &v16, 2);
+	}
+
+	memcpy(&seq, buf + l4 + 4, 4);
+	seq = htonl(ntohl(seq) + (uint32_t)to->off);
+	memcpy(buf + l4 + 4, &seq, 4);
+	/* FIN and PSH go with the last segment only, CWR with the first. */
+	if (!last)
+		buf[l4 + 13] &= ~0x09;
+	if (!first)
+		buf[l4 + 13] &= ~0x80;
+	memset(buf + l4 + 16, 0x0, 2);
+	v16 = ip_csum_fold(ip_csum_partial(buf + l4, len - l4,
+			csum_pseudo(buf, IPPROTO_TCP, len - l4)));
+	memcpy(buf + l4 + 16, &v16, 2);
+
+	to->off += chunk;
+	to->segs++;
+	if (last)
+		to->len = 0;
+	return (ssize_t)len;
+}
+
+/* Check the header of a fresh read and set up cutting. 0 to drop it. */
+static int tso_start(struct tun_offload *to)
+{
+	struct tun_vnet_hdr *vh = &to->vh;
+	size_t l4 = vh->csum_start, doff;
+
+	if (!(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) || vh->gso_size == 0)
+		return 0;
+	switch (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		if (to->len < 20 || ((uint8_t)to->pkt[0] >> 4) != 4)
+			return 0;
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		if (to->len < 40 || ((uint8_t)to->pkt[0] >> 4) != 6)
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+	if (l4 + 20 > to->len)
+		return 0;
+	doff = ((uint8_t)to->pkt[l4 + 12] >> 4) * 4;
+	if (doff < 20 || l4 + doff > to->len)
+		return 0;
+
+	to->hdr_len = l4 + doff;
+	to->off = 0;
+	to->segs = 0;
+	return 1;
+}
+
+/**
+ * Next plain IP packet from an offload TUN device into 'buf': a segment
+ * of the pending super-packet, or one more packet read from the device.
+ * A packet is read straight into 'buf'; only what doesn't fit there goes
+ * to 'to->pkt', which takes a whole super-packet when one has to be cut.
+ * Returns its length, 0 if one was dropped, -1 if there was nothing to
+ * read.
+ */
+ssize_t tun_offload_read(struct tun_offload *to, int tunfd, void *buf, size_t size)
+{
+	struct iovec iov[3];
+	size_t start, pos, len;
+	uint16_t csum;
+	ssize_t rc;
+
+	if (to->len)
+		return tso_next_segment(to, buf, size);
+
+	if (size > sizeof(to->pkt))
+		size = sizeof(to->pkt);
+	iov[0].iov_base = &to->vh;
+	iov[0].iov_len = sizeof(to->vh);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = size;
+	/* The rest of a super-packet, where it will be behind the first part. */
+	iov[2].iov_base = to->pkt + size;
+	iov[2].iov_len = sizeof(to->pkt) - size;
+	if ((rc = readv(tunfd, iov, 3)) < 0)
+		return -1;
+	if ((size_t)rc <= sizeof(to->vh))
+		return 0;
+	len = (size_t)rc - sizeof(to->vh);
+
+	if (to->vh.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+		memcpy(to->pkt, buf, len < size ? len : size);
+		to->len = len;
+		if (!tso_start(to)) {
+			to->len = 0;
+			return 0;
+		}
+		return tso_next_segment(to, buf, size);
+	}
+	if (len > size)
+		return 0;
+
+	/* Only the pseudo-header sum is there, finish the checksum. */
+	if (to->vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		start = to->vh.csum_start;
+		pos = start + to->vh.csum_offset;
+		if (pos + 2 > len)
+			return 0;
+		csum = ip_csum_fold(ip_csum_partial((char *)buf + start, len - start, 0));
+		memcpy((char *)buf + pos, &csum, 2);
+	}
+	return (ssize_t)len;
+}
+
+/* Write a plain IP packet, behind a virtio-net header that asks for nothing. */
+ssize_t tun_offload_write(int tunfd, const void *data, size_t len)
+{
+	static const struct tun_vnet_hdr vh;
+	struct iovec iov[2];
+
+	iov[0].iov_base = (void *)&vh;
+	iov[0].iov_len = sizeof(vh);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	return writev(tunfd, iov, 2);
+}
+
+/* TCP flags */
+#define TCPF_PSH  0x08
+#define TCPF_ACK  0x10
+
+/* Where the TCP header starts in a segment tcp_gro_hdr_len() took. */
+#define tcp_gro_l4(pkt)  (((uint8_t)(pkt)[0] >> 4) == 4 ? 20 : 40)
+
+/**
+ * Length of the IP and TCP headers if 'pkt' is a TCP segment that may
+ * be glued: no IPv4 options or fragments, no IPv6 extension headers,
+ * only ACK (and PSH) set, some payload. 0 otherwise.
+ */
+static size_t tcp_gro_hdr_len(const char *pkt, size_t len)
+{
+	size_t l4, doff;
+	uint16_t v16;
+
+	if (len < 40)
+		return 0;
+	if (((uint8_t)pkt[0] >> 4) == 4) {
+		memcpy(&v16, pkt + 6, 2);
+		if (pkt[0] != 0x45 || pkt[9] != IPPROTO_TCP || (ntohs(v16) & 0x3fff))
+			return 0;
+		memcpy(&v16, pkt + 2, 2);
+		l4 = 20;
+	} else if (((uint8_t)pkt[0] >> 4) == 6) {
+		memcpy(&v16, pkt + 4, 2);
+		if (pkt[6] != IPPROTO_TCP || len < 60)
+			return 0;
+		v16 = htons(ntohs(v16) + 40);
+		l4 = 40;
+	} else {
+		return 0;
+	}
+	if (ntohs(v16) != len)
+		return 0;
+
+	doff = ((uint8_t)pkt[l4 + 12] >> 4) * 4;
+	if (doff < 20 || l4 + doff >= len)
+		return 0;
+	if ((pkt[l4 + 13] & ~TCPF_PSH) != TCPF_ACK)
+		return 0;
+	return l4 + doff;
+}
+
+/* If segment 'pkt' is of the flow pending in 'f': same addresses and ports. */
+static bool tcp_gro_flow_match(const struct tun_gro_flow *f, const char *pkt)
+{
+	const char *p0 = f->pkt;
+	size_t l4 = tcp_gro_l4(pkt);
+
+	if (pkt[0] != p0[0])
+		return false;
+	if (l4 == 20 ? memcmp(pkt + 12, p0 + 12, 8) : memcmp(pkt + 8, p0 + 8, 32))
+		return false;
+	return memcmp(pkt + l4, p0 + l4, 4) == 0;
+}
+
+/* If segment 'pkt' of the flow of 'f' has the same headers, so it can be glued. */
+static bool tcp_gro_same_headers(const struct tun_gro_flow *f, const char *pkt,
+		size_t hdr_len)
+{
+	const char *p0 = f->pkt;
+	size_t l4 = tcp_gro_l4(pkt);
+
+	if (hdr_len != f->hdr_len)
+		return false;
+	if (l4 == 20) {
+		/* TOS, TTL, protocol */
+		if (pkt[1] != p0[1] || memcmp(pkt + 8, p0 + 8, 2))
+			return false;
+	} else {
+		/* traffic class, flow label, next header, hop limit */
+		if (memcmp(pkt, p0, 4) || memcmp(pkt + 6, p0 + 6, 2))
+			return false;
+	}
+	/* ACK number, header length, window, options */
+	return memcmp(pkt + l4 + 8, p0 + l4 + 8, 5) == 0 &&
+		memcmp(pkt + l4 + 14, p0 + l4 + 14, 2) == 0 &&
+		memcmp(pkt + l4 + 20, p0 + l4 + 20, hdr_len - l4 - 20) == 0;
+}
+
+/* If the TCP checksum of segment 'pkt' is right. */
+static bool tcp_gro_csum_ok(const char *pkt, size_t len, size_t l4)
+{
+	return ip_csum_fold(ip_csum_partial(pkt + l4, len - l4,
+			csum_pseudo(pkt, IPPROTO_TCP, len - l4))) == 0;
+}
+
+/**
+ * Write out the segments pending in 'f'. A single one goes as it is,
+ * more are one GSO packet: lengths fixed, the TCP checksum left to the
+ * kernel.
+ */
+static void tun_gro_flow_flush(struct tun_gro_flow *f, int tunfd)
+{
+	struct tun_vnet_hdr vh;
+	struct iovec iov[2];
+	char *pkt = f->pkt;
+	size_t l4 = tcp_gro_l4(pkt);
+	uint16_t v16;
+
+	if (f->len == 0)
+		return;
+
+	memset(&vh, 0x0, sizeof(vh));
+	if (f->segs > 1) {
+		if (l4 == 20) {
+			v16 = htons((uint16_t)f->len);
+			memcpy(pkt + 2, &v16, 2);
+			memset(pkt + 10, 0x0, 2);
+			v16 = ip_csum_fold(ip_csum_partial(pkt, l4, 0));
+			memcpy(pkt + 10, &v16, 2);
+			vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+		} else {
+			v16 = htons((uint16_t)(f->len - 40));
+			memcpy(pkt + 4, &v16, 2);
+			vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+		}
+		/* Partial checksum: the pseudo-header sum, not inverted. */
+		v16 = (uint16_t)~ip_csum_fold(csum_pseudo(pkt, IPPROTO_TCP, f->len - l4));
+		memcpy(pkt + l4 + 16, &v16, 2);
+
+		vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh.hdr_len = (uint16_t)f->hdr_len;
+		vh.gso_size = (uint16_t)f->mss;
+		vh.csum_start = (uint16_t)l4;
+		vh.csum_offset = 16;
+	}
+
+	iov[0].iov_base = &vh;
+	iov[0].iov_len = sizeof(vh);
+	iov[1].iov_base = pkt;
+	iov[1].iov_len = f->len;
+	writev(tunfd, iov, 2);
+	f->len = 0;
+}
+
+/* Write out all pending segments. */
+void tun_gro_flush(struct tun_gro *g, int tunfd)
+{
+	unsigned i;
+
+	for (i = 0; i < TUN_GRO_FLOWS; i++)
+		tun_gro_flow_flush(&g->flows[i], tunfd);
+}
+
+/**
+ * Slot for the segment 'pkt': the one of its flow, else a free one, else
+ * the one least recently used after it has been flushed.
+ */
+static struct tun_gro_flow *tun_gro_slot(struct tun_gro *g, int tunfd, const char *pkt)
+{
+	struct tun_gro_flow *f, *free_f = NULL, *lru = &g->flows[0];
+	unsigned i;
+
+	for (i = 0; i < TUN_GRO_FLOWS; i++) {
+		f = &g->flows[i];
+		if (f->len == 0) {
+			if (free_f == NULL)
+				free_f = f;
+		} else if (tcp_gro_flow_match(f, pkt)) {
+			return f;
+		} else if (f->used < lru->used || lru->len == 0) {
+			lru = f;
+		}
+	}
+	if (free_f)
+		return free_f;
+	tun_gro_flow_flush(lru, tunfd);
+	return lru;
+}
+
+/**
+ * Write a plain IP packet to an offload TUN device: glued to the pending
+ * segments of its flow if it continues them, else after they have been
+ * flushed. Anything that can't be glued flushes all flows first, so no
+ * packet overtakes another of its flow. tun_gro_flush() must be called
+ * at the end of each receive batch.
+ */
+void tun_gro_write(struct tun_gro *g, int tunfd, const void *data, size_t len)
+{
+	const char *pkt = data;
+	size_t hdr_len = tcp_gro_hdr_len(pkt, len), payload = len - hdr_len, l4;
+	struct tun_gro_flow *f;
+	uint32_t seq;
+	bool psh;
+
+	/* One with a bad checksum goes as it is, for the kernel to drop. */
+	if (hdr_len == 0 || !tcp_gro_csum_ok(pkt, len, tcp_gro_l4(pkt))) {
+		tun_gro_flush(g, tunfd);
+		tun_offload_write(tunfd, data, len);
+		return;
+	}
+	l4 = tcp_gro_l4(pkt);
+	memcpy(&seq, pkt + l4 + 4, 4);
+	seq = ntohl(seq);
+	psh = pkt[l4 + 13] & TCPF_PSH;
+
+	f = tun_gro_slot(g, tunfd, pkt);
+	if (f->len && seq == f->next_seq && payload <= f->mss &&
+		f->len + payload <= sizeof(f->pkt) &&
+		tcp_gro_same_headers(f, pkt, hdr_len)) {
+		memcpy(f->pkt + f->len, pkt + hdr_len, payload);
+		f->len += payload;
+		f->segs++;
+	} else {
+		tun_gro_flow_flush(f, tunfd);
+		memcpy(f->pkt, pkt, len);
+		f->len = len;
+		f->hdr_len = hdr_len;
+		f->mss = payload;
+		f->segs = 1;
+	}
+	f->next_seq = seq + (uint32_t)payload;
+	f->used = ++g->clock;
+
+	/* A short or pushed segment ends the run. */
+	if (psh || payload < f->mss) {
+		f->pkt[l4 + 13] |= psh ? TCPF_PSH : 0;
+		tun_gro_flow_flush(f, tunfd);
+	}
+}
+
+#else /* !HAVE_TUN_OFFLOAD */
+
+int tun_offload_enable(int tunfd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t tun_offload_read(struct tun_offload *to, int tunfd, void *buf, size_t size)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t tun_offload_write(int tunfd, const void *data, size_t len)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+void tun_gro_write(struct tun_gro *g, int tunfd, const void *data, size_t len)
+{
+}
+
+void tun_gro_flush(struct tun_gro *g, int tunfd)
+{
+}
+
+#endif /* HAVE_TUN_OFFLOAD */
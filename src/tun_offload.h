@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __TUN_OFFLOAD_H
+#define __TUN_OFFLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * TUN offload mode ('--offload', Linux): the device carries a virtio-net
+ * header in front of each packet and does TCP segmentation offload, so
+ * the kernel hands over TSO super-packets of up to 64K with the checksum
+ * left partial. They are cut into MSS-sized TCP segments here, each one
+ * a plain IP packet again, before being encrypted and sent.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/virtio_net.h>)
+    #define HAVE_TUN_OFFLOAD  1
+  #endif
+#endif
+
+#define TUN_OFFLOAD_MAX  65535
+
+/* Same layout as 'struct virtio_net_hdr', in host byte order. */
+struct tun_vnet_hdr {
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+/* Reader state: the super-packet being cut, kept across reads. */
+struct tun_offload {
+	struct tun_vnet_hdr vh;
+	char pkt[TUN_OFFLOAD_MAX];
+	size_t len;        /* bytes in 'pkt', 0 if nothing is pending */
+	size_t hdr_len;    /* IP and TCP headers, copied to each segment */
+	size_t off;        /* payload bytes cut so far */
+	unsigned segs;     /* segments cut so far */
+};
+
+/**
+ * The other way round, in-order TCP segments of a flow that come in a
+ * row (within a receive batch) are glued back into one super-packet,
+ * written to the device with the GSO fields set. Only segments whose
+ * TCP checksum is right are glued, since the kernel takes the result as
+ * checked. Up to TUN_GRO_FLOWS flows are pending at a time, 64K each.
+ */
+#define TUN_GRO_FLOWS  8
+
+struct tun_gro_flow {
+	char pkt[TUN_OFFLOAD_MAX];
+	size_t len;        /* bytes in 'pkt', 0 if the slot is free */
+	size_t hdr_len;    /* IP and TCP headers of the first segment */
+	size_t mss;        /* payload size of the first segment */
+	unsigned segs;     /* segments glued so far */
+	uint32_t next_seq; /* sequence number the next segment must have */
+	unsigned long used; /* when a segment last went in, see 'tun_gro.clock' */
+};
+
+struct tun_gro {
+	struct tun_gro_flow flows[TUN_GRO_FLOWS];
+	unsigned long clock;
+};
+
+int tun_offload_enable(int tunfd);
+ssize_t tun_offload_read(struct tun_offload *to, int tunfd, void *buf, size_t size);
+ssize_t tun_offload_write(int tunfd, const void *data, size_t len);
+void tun_gro_write(struct tun_gro *g, int tunfd, const void *data, size_t len);
+void tun_gro_flush(struct tun_gro *g, int tunfd);
+
+#endif /* __TUN_OFFLOAD_H */
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, _NSIG / 8);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+		unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r, 0x0, sizeof(*r));
+	memset(&p, 0x0, sizeof(p));
+	if ((r->fd = sys_io_uring_setup(entries, &p)) < 0)
+		return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			goto err;
+		}
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto err;
+	}
+
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+
+	return 0;
+
+err:
+	uring_exit(r);
+	return -1;
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0x0, sizeof(*r));
+	r->fd = -1;
+}
+
+int uring_register_buffers(struct uring *r, const struct iovec *iovs, unsigned n)
+{
+	return sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iovs, n);
+}
+
+int uring_register_files(struct uring *r, const int *fds, unsigned n)
+{
+	return sys_io_uring_register(r->fd, IORING_REGISTER_FILES, fds, n);
+}
+
+/**
+ * A cleared SQE to fill in, queued for the next uring_submit_and_wait().
+ * When the ring is full the queued ones are submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	unsigned tail = *r->sq_tail, index;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		if (uring_submit_and_wait(r, 0) < 0)
+			return NULL;
+		if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+			return NULL;
+	}
+
+	index = tail & *r->sq_mask;
+	sqe = &r->sqes[index];
+	memset(sqe, 0x0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+
+	return sqe;
+}
+
+/* Submit the queued SQEs and wait for 'wait_nr' completions at least. */
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr)
+{
+	int rc;
+
+	do {
+		rc = sys_io_uring_enter(r->fd, r->to_submit, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 0)
+		return -1;
+	r->to_submit -= (unsigned)rc < r->to_submit ? (unsigned)rc : r->to_submit;
+	return rc;
+}
+
+#endif /* HAVE_IO_URING */
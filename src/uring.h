@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2015 Justin Liu
+ * Author: Justin Liu <rssnsj@gmail.com>
+ * https://github.com/rssnsj/minivtun
+ */
+
+#ifndef __URING_H
+#define __URING_H
+
+/**
+ * Minimal io_uring access over the raw system calls, just what the
+ * packet paths need: SQE/CQE rings, registered buffers and files.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #define HAVE_IO_URING  1
+  #endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	unsigned to_submit;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+int uring_register_buffers(struct uring *r, const struct iovec *iovs, unsigned n);
+int uring_register_files(struct uring *r, const int *fds, unsigned n);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr);
+
+/* Next completion, NULL if there is none. Release it with uring_cqe_seen(). */
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_IO_URING */
+
+#endif /* __URING_H */